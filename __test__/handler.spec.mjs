@@ -73,6 +73,39 @@ test('Capture exceptions', async (t) => {
   t.assert(/Uncaught Exception: Hello, from PHP!/.test(res.log))
 })
 
+test('Report exceptions thrown after output', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      echo 'Hello, ';
+      flush();
+      throw new Exception('Hello, from PHP!');
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path
+  })
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+  t.is(res.status, 200)
+  t.true(res.body.toString('utf8').startsWith('Hello, '))
+  t.truthy(res.exception)
+
+  const throwing = new Php({
+    docroot: mockroot.path,
+    throwRequestErrors: true
+  })
+
+  await t.throwsAsync(() => throwing.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  })), {
+    message: res.exception
+  })
+})
+
 test('Support request and response headers', async (t) => {
   const mockroot = await MockRoot.from({
     'index.php': `<?php
@@ -202,3 +235,714 @@ test('Accept rewriter', async (t) => {
   t.is(res.status, 200)
   t.is(res.body.toString('utf8'), 'Hello, World!')
 })
+
+test('Queue concurrent requests onto a fixed worker pool', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php echo $_GET["n"]; ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    workers: 2,
+    queueSize: 1
+  })
+
+  const responses = await Promise.all(
+    Array.from({ length: 16 }, (_, n) => php.handleRequest(new Request({
+      url: `http://example.com/index.php?n=${n}`
+    })))
+  )
+
+  for (const [n, res] of responses.entries()) {
+    t.is(res.status, 200)
+    t.is(res.body.toString('utf8'), String(n))
+  }
+})
+
+test('Dispatch requests into a long-lived worker script', async (t) => {
+  const mockroot = await MockRoot.from({
+    'worker.php': `<?php
+      $count = 0;
+      while (php_node_handle_request(function () use (&$count) {
+        $count++;
+        header("X-Count: {$count}");
+        echo "{$_GET['name']}:{$count}";
+      })) {}
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    worker: 'worker.php',
+    workers: 1
+  })
+
+  for (const [i, name] of ['first', 'second'].entries()) {
+    const res = await php.handleRequest(new Request({
+      url: `http://example.com/anything?name=${name}`
+    }))
+    t.is(res.status, 200)
+    t.is(res.headers.get('X-Count'), String(i + 1))
+    t.is(res.body.toString('utf8'), `${name}:${i + 1}`)
+  }
+})
+
+test('Read large request bodies in full', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      $input = file_get_contents('php://input');
+      echo strlen($input) . ':' . md5($input);
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path
+  })
+
+  const body = Buffer.alloc(1024 * 1024 + 17, 'abcdefgh')
+  const { createHash } = await import('node:crypto')
+  const expected = `${body.length}:${createHash('md5').update(body).digest('hex')}`
+
+  const res = await php.handleRequest(new Request({
+    method: 'POST',
+    url: 'http://example.com/index.php',
+    body
+  }))
+  t.is(res.status, 200)
+  t.is(res.body.toString('utf8'), expected)
+})
+
+test('Coalesce many small writes into the response', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      for ($i = 0; $i < 10000; $i++) {
+        echo $i % 10;
+      }
+      flush();
+      echo 'done';
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    outputBufferSize: 1024
+  })
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+  t.is(res.status, 200)
+  t.is(res.body.toString('utf8'), '0123456789'.repeat(1000) + 'done')
+})
+
+test('Replay cached rewrites', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php echo $_SERVER["REQUEST_URI"]; ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const rewriter = new Rewriter([
+    {
+      conditions: [
+        { type: 'not_exists' }
+      ],
+      rewriters: [
+        { type: 'path', args: ['.*', '/index.php'] }
+      ]
+    }
+  ])
+
+  const php = new Php({
+    docroot: mockroot.path,
+    throwRequestErrors: true,
+    pathCacheTtl: 2000,
+    cacheRewrites: true,
+    rewriter
+  })
+
+  for (const path of ['/foo', '/bar', '/foo']) {
+    const res = await php.handleRequest(new Request({
+      url: `http://example.com${path}`
+    }))
+    t.is(res.status, 200)
+    t.is(res.body.toString('utf8'), path)
+  }
+})
+
+test('Key cached rewrites by request headers', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php echo "index"; ?>',
+    'foo.php': '<?php echo "foo"; ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const rewriter = new Rewriter([{
+    conditions: [
+      { type: 'header', args: ['TEST', 'foo'] }
+    ],
+    rewriters: [
+      { type: 'path', args: ['^/index.php$', '/foo.php'] }
+    ]
+  }])
+
+  const php = new Php({
+    docroot: mockroot.path,
+    pathCacheTtl: 2000,
+    cacheRewrites: true,
+    rewriter
+  })
+
+  for (const test of ['foo', 'bar', 'foo']) {
+    const res = await php.handleRequest(new Request({
+      url: 'http://example.com/index.php',
+      headers: { TEST: [test] }
+    }))
+    t.is(res.body.toString('utf8'), test === 'foo' ? 'foo' : 'index')
+  }
+})
+
+test('Shed load when the worker queue is full', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php usleep(200000); echo "ok"; ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    workers: 1,
+    queueSize: 1,
+    shedLoad: true
+  })
+
+  const responses = await Promise.all(
+    Array.from({ length: 4 }, () => php.handleRequest(new Request({
+      url: 'http://example.com/index.php'
+    })))
+  )
+
+  const statuses = responses.map((res) => res.status)
+  t.true(statuses.includes(200))
+  t.true(statuses.includes(503))
+  t.is(php.poolStats().rejected, statuses.filter((s) => s === 503).length)
+})
+
+test('Report request phases in Server-Timing', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php echo "ok"; ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    serverTiming: true
+  })
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+
+  t.is(res.status, 200)
+  const timing = res.headers.get('server-timing')
+  for (const phase of ['rewrite', 'queue', 'startup', 'execute', 'first-byte', 'shutdown']) {
+    t.regex(timing, new RegExp(`\\b${phase};dur=\\d+\\.\\d{3}`))
+  }
+})
+
+test('Count requests and bytes in metrics', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php echo file_get_contents("php://input"); ?>',
+    'fatal.php': '<?php undefined_function(); ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path
+  })
+
+  await php.handleRequest(new Request({
+    method: 'POST',
+    url: 'http://example.com/index.php',
+    body: Buffer.from('hello')
+  }))
+  await php.handleRequest(new Request({
+    url: 'http://example.com/fatal.php'
+  }))
+  await php.handleRequest(new Request({
+    url: 'http://example.com/missing.php'
+  }))
+
+  const metrics = php.metrics()
+  t.is(metrics.requests, 2)
+  t.is(metrics.notFound, 1)
+  t.is(metrics.bytesIn, 5)
+  t.true(metrics.bytesOut >= 5)
+  t.is(metrics.requestDuration.count, 2)
+  t.is(metrics.requestDuration.counts.length, metrics.requestDuration.boundsMs.length + 1)
+  t.true(metrics.memoryPeak.some((peak) => peak > 0))
+  t.regex(php.prometheusMetrics(), /^php_requests_not_found_total 1$/m)
+})
+
+test('Apply request INI settings per instance', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php echo ini_get("memory_limit"); ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const small = new Php({
+    docroot: mockroot.path,
+    requestIni: { memory_limit: '64M' }
+  })
+  const large = new Php({
+    docroot: mockroot.path,
+    requestIni: { memory_limit: '512M' }
+  })
+
+  const request = () => new Request({ url: 'http://example.com/index.php' })
+  t.is((await small.handleRequest(request())).body.toString('utf8'), '64M')
+  t.is((await large.handleRequest(request())).body.toString('utf8'), '512M')
+  t.is((await small.handleRequest(request())).body.toString('utf8'), '64M')
+
+  const unknown = new Php({
+    docroot: mockroot.path,
+    requestIni: { 'not.a.setting': '1' }
+  })
+  t.is((await unknown.handleRequest(request())).status, 500)
+})
+
+test('Buffer large responses across reused workers', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      $size = (int) $_GET['size'];
+      for ($i = 0; $i < $size; $i += 1000) {
+        echo str_repeat($_GET['char'], min(1000, $size - $i));
+        flush();
+      }
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    workers: 1
+  })
+
+  // Each body must survive the next request reusing the worker's buffer
+  const sizes = [100000, 10, 50000]
+  const responses = []
+  for (const [i, size] of sizes.entries()) {
+    const char = 'abc'[i]
+    responses.push(await php.handleRequest(new Request({
+      url: `http://example.com/index.php?size=${size}&char=${char}`
+    })))
+  }
+
+  for (const [i, res] of responses.entries()) {
+    t.is(res.status, 200)
+    t.is(res.body.toString('utf8'), 'abc'[i].repeat(sizes[i]))
+  }
+})
+
+test('Route tenants by host and prefix', async (t) => {
+  const main = await MockRoot.from({ 'index.php': '<?php echo "main"; ?>' })
+  const blog = await MockRoot.from({
+    'index.php': '<?php echo "blog " . ini_get("memory_limit"); ?>'
+  })
+  const shop = await MockRoot.from({
+    'cart.php': '<?php echo "shop " . $_SERVER["DOCUMENT_ROOT"]; ?>'
+  })
+  t.teardown(() => Promise.all([main.clean(), blog.clean(), shop.clean()]))
+
+  const php = new Php({
+    docroot: main.path,
+    tenants: [
+      { host: 'blog.example.com', docroot: blog.path, requestIni: { memory_limit: '32M' } },
+      { prefix: '/shop', docroot: shop.path }
+    ]
+  })
+
+  const body = async (url) => {
+    const res = await php.handleRequest(new Request({ url }))
+    return res.body.toString('utf8')
+  }
+
+  t.is(await body('http://blog.example.com:3000/index.php'), 'blog 32M')
+  t.regex(await body('http://example.com/shop/cart.php'), /^shop .+/)
+  t.is(await body('http://example.com/index.php'), 'main')
+  t.is((await php.handleRequest(new Request({
+    url: 'http://example.com/shops/cart.php'
+  }))).status, 404)
+})
+
+test('Limit concurrent requests per tenant', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php usleep(200000); echo "done"; ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    workers: 2,
+    tenants: [{ prefix: '/app', docroot: mockroot.path, maxRequests: 1 }]
+  })
+
+  const [first, second] = await Promise.all([
+    php.handleRequest(new Request({ url: 'http://example.com/app/index.php' })),
+    php.handleRequest(new Request({ url: 'http://example.com/app/index.php' }))
+  ])
+  t.deepEqual([first.status, second.status].sort(), [200, 503])
+})
+
+test('Share sessions across workers', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      session_start();
+      $_SESSION['count'] = ($_SESSION['count'] ?? 0) + 1;
+      echo ini_get('session.save_handler') . ' ' . $_SESSION['count'];
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    workers: 2,
+    sessions: true
+  })
+
+  const first = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+  t.is(first.body.toString('utf8'), 'php_node 1')
+
+  const cookie = first.headers.get('set-cookie').split(';')[0]
+  for (const count of [2, 3]) {
+    const res = await php.handleRequest(new Request({
+      url: 'http://example.com/index.php',
+      headers: { Cookie: [cookie] }
+    }))
+    t.is(res.body.toString('utf8'), `php_node ${count}`)
+  }
+})
+
+test('Refuse handleRequestSync with a JavaScript session store', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php session_start(); ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    sessionStore: {
+      read: async () => null,
+      write: async () => {},
+      destroy: async () => {}
+    }
+  })
+
+  t.throws(() => php.handleRequestSync(new Request({
+    url: 'http://example.com/index.php'
+  })), { message: /sessionStore/ })
+})
+
+test('Serve static files without a worker', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': '<?php echo "php"; ?>',
+    'style.css': 'body { color: red; }'
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    staticFiles: { cacheControl: 'max-age=60' }
+  })
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/style.css'
+  }))
+  t.is(res.status, 200)
+  t.is(res.body.toString('utf8'), 'body { color: red; }')
+  t.is(res.headers.get('content-type'), 'text/css; charset=utf-8')
+  t.is(res.headers.get('cache-control'), 'max-age=60')
+
+  const etag = res.headers.get('etag')
+  const cached = await php.handleRequest(new Request({
+    url: 'http://example.com/style.css',
+    headers: { 'If-None-Match': [etag] }
+  }))
+  t.is(cached.status, 304)
+
+  const partial = await php.handleRequest(new Request({
+    url: 'http://example.com/style.css',
+    headers: { Range: ['bytes=7-11'] }
+  }))
+  t.is(partial.status, 206)
+  t.is(partial.body.toString('utf8'), 'color')
+  t.is(partial.headers.get('content-range'), 'bytes 7-11/20')
+
+  const script = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+  t.is(script.body.toString('utf8'), 'php')
+  t.is(php.metrics().staticFiles, 3)
+})
+
+test('Never serve script sources as static files', async (t) => {
+  const mockroot = await MockRoot.from({
+    'page.phtml': '<?php echo "phtml"; ?>',
+    'config.inc': '<?php $secret = "hunter2"; ?>'
+  })
+  t.teardown(() => mockroot.clean())
+
+  for (const extensions of [undefined, ['phtml', 'inc']]) {
+    const php = new Php({
+      docroot: mockroot.path,
+      staticFiles: { extensions }
+    })
+
+    const page = await php.handleRequest(new Request({
+      url: 'http://example.com/page.phtml'
+    }))
+    t.is(page.body.toString('utf8'), 'phtml')
+
+    const config = await php.handleRequest(new Request({
+      url: 'http://example.com/config.inc'
+    }))
+    t.false(config.body.toString('utf8').includes('hunter2'))
+
+    t.is(php.metrics().staticFiles, 0)
+  }
+})
+
+test('Call JavaScript functions from PHP', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      $sum = node_call('sum', [1, 2, 3]);
+      $user = node_call('user', ['id' => 7]);
+      try {
+        node_call('fail');
+      } catch (Exception $e) {
+        $error = $e->getMessage();
+      }
+      echo "$sum {$user['name']} {$user['id']} $error";
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    functions: {
+      sum: async (values) => values.reduce((a, b) => a + b, 0),
+      user: async ({ id }) => ({ id, name: 'Ada' }),
+      fail: async () => { throw new Error('nope') }
+    }
+  })
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+  t.is(res.body.toString('utf8'), '6 Ada 7 nope')
+
+  // The functions' promises could never settle while the thread is blocked
+  t.throws(() => php.handleRequestSync(new Request({
+    url: 'http://example.com/index.php'
+  })), { message: /functions/ })
+})
+
+test('Keep repeated response headers in order', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      header('Content-Type: application/json');
+      for ($i = 0; $i < 3; $i++) {
+        header("Set-Cookie: c$i=$i", false);
+      }
+      error_log('logged');
+      echo '{}';
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path
+  })
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+  t.is(res.headers.get('content-type'), 'application/json')
+  t.deepEqual(res.headers.getAll('set-cookie'), ['c0=0', 'c1=1', 'c2=2'])
+  t.regex(res.log.toString('utf8'), /logged/)
+})
+
+test('Wait for worker scripts to boot before taking requests', async (t) => {
+  const mockroot = await MockRoot.from({
+    'worker.php': `<?php
+      usleep(100000);
+      while (php_node_handle_request(function () {
+        echo 'ready';
+      })) {}
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    worker: 'worker.php',
+    workers: 2,
+    keepEngine: true
+  })
+
+  const report = await php.warmup()
+  t.is(report.workers, 2)
+  t.is(report.ready, 2)
+  t.is(php.poolStats().ready, 2)
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/anything'
+  }))
+  t.is(res.body.toString('utf8'), 'ready')
+})
+
+test('Stream multipart uploads into $_FILES', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      $file = $_FILES['upload'];
+      echo $_POST['name'] . ':' . $file['size'] . ':' . md5_file($file['tmp_name']);
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path
+  })
+
+  // Within the default upload_max_filesize, as startup INI can not differ
+  // from the engine kept resident by earlier tests
+  const boundary = 'php-node-boundary'
+  const content = Buffer.alloc(1024 * 1024, 'abcdefgh')
+  const head = Buffer.from([
+    `--${boundary}`,
+    'Content-Disposition: form-data; name="name"',
+    '',
+    'report',
+    `--${boundary}`,
+    'Content-Disposition: form-data; name="upload"; filename="report.bin"',
+    'Content-Type: application/octet-stream',
+    '',
+    ''
+  ].join('\r\n'))
+  const tail = Buffer.from(`\r\n--${boundary}--\r\n`)
+
+  const req = new Request({
+    method: 'POST',
+    url: 'http://example.com/index.php',
+    headers: {
+      'Content-Type': [`multipart/form-data; boundary=${boundary}`],
+      'Transfer-Encoding': ['chunked']
+    }
+  })
+
+  const [res] = await Promise.all([
+    php.handleRequest(req, null, { streamBody: true }),
+    (async () => {
+      await req.write(head)
+      for (let i = 0; i < content.length; i += 64 * 1024) {
+        await req.write(content.subarray(i, i + 64 * 1024))
+      }
+      await req.write(tail)
+      await req.end()
+    })()
+  ])
+
+  const { createHash } = await import('node:crypto')
+  const md5 = createHash('md5').update(content).digest('hex')
+  t.is(res.body.toString('utf8'), `report:${content.length}:${md5}`)
+})
+
+test('Complete chunked requests with an empty body', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      echo strlen(file_get_contents('php://input'));
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path
+  })
+
+  const req = new Request({
+    method: 'POST',
+    url: 'http://example.com/index.php',
+    headers: {
+      'Transfer-Encoding': ['chunked']
+    },
+    body: Buffer.alloc(0)
+  })
+
+  const res = await php.handleRequest(req)
+  t.is(res.body.toString('utf8'), '0')
+})
+
+test('Stop scripts which run past the request timeout', async (t) => {
+  const mockroot = await MockRoot.from({
+    'loop.php': `<?php
+      while (true) {}
+    ?>`,
+    'index.php': `<?php
+      echo 'still serving';
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    workers: 1,
+    requestTimeout: 100
+  })
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/loop.php'
+  }))
+  t.is(res.status, 504)
+  t.regex(res.log.toString('utf8'), /deadline of 100 ms/)
+  t.is(php.metrics().deadlinesExceeded, 1)
+
+  // The worker went back to the pool
+  const next = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+  t.is(next.body.toString('utf8'), 'still serving')
+})
+
+test('Sample the PHP call stacks of requests', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      function spin() {
+        $end = microtime(true) + 0.05;
+        while (microtime(true) < $end) {}
+      }
+      spin();
+      echo 'done';
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    profiler: { intervalMs: 1 }
+  })
+
+  const res = await php.handleRequest(new Request({
+    url: 'http://example.com/index.php'
+  }))
+  t.is(res.body.toString('utf8'), 'done')
+
+  const profile = php.profile(true)
+  t.is(profile.requests, 1)
+  t.true(profile.samples > 0)
+  t.regex(profile.folded, /index\.php;spin \d+\n/)
+  t.is(php.profile().samples, 0)
+})
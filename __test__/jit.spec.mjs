@@ -0,0 +1,55 @@
+import test from 'ava'
+
+import { Php, Request } from '../index.js'
+
+import { MockRoot } from './util.mjs'
+
+// Startup INI settings are shared by every instance in the process, so the
+// JIT is tested in its own file, which AVA runs in a separate process.
+
+test('Reject unknown JIT modes', (t) => {
+  t.throws(() => new Php({ opcache: { jit: 'fast' } }), {
+    message: /Unknown JIT mode 'fast'/
+  })
+})
+
+test('Enable the tracing JIT', async (t) => {
+  const mockroot = await MockRoot.from({
+    'index.php': `<?php
+      $sum = 0;
+      for ($i = 0; $i < 100000; $i++) {
+        $sum += $i % 7;
+      }
+      echo $sum;
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path,
+    workers: 1,
+    opcache: { jit: 'tracing', jitBufferSize: 32 }
+  })
+
+  // Rejects if the JIT could not be enabled.
+  await php.warmup()
+
+  for (let i = 0; i < 5; i++) {
+    const res = await php.handleRequest(new Request({
+      url: 'http://example.com/index.php'
+    }))
+    t.is(res.status, 200)
+    t.is(res.body.toString('utf8'), '299995')
+  }
+
+  // The first call schedules a fresh sample behind the requests above.
+  php.metrics()
+  await new Promise((resolve) => setTimeout(resolve, 100))
+
+  const { jit } = php.metrics()
+  t.true(jit.enabled)
+  t.true(jit.on)
+  t.true(jit.bufferSize > 0)
+  t.true(jit.bufferFree < jit.bufferSize)
+  t.regex(php.prometheusMetrics(), /^php_jit_on 1$/m)
+})
@@ -249,3 +249,38 @@ test('handleStream - empty response', async (t) => {
   }
   t.is(body, '')
 })
+
+test('handleStream - park the worker on a slow consumer', async (t) => {
+  const mockroot = await MockRoot.from({
+    'export.php': `<?php
+      for ($i = 0; $i < 256; $i++) {
+        echo str_repeat('x', 16 * 1024);
+      }
+    ?>`
+  })
+  t.teardown(() => mockroot.clean())
+
+  const php = new Php({
+    docroot: mockroot.path
+  })
+
+  const req = new Request({
+    method: 'GET',
+    url: 'http://example.com/export.php'
+  })
+
+  const before = Php.backpressureStats()
+  const [res] = await Promise.all([
+    php.handleStream(req),
+    req.end()
+  ])
+
+  let length = 0
+  for await (const chunk of res) {
+    length += chunk.length
+    await new Promise((resolve) => setTimeout(resolve, 1))
+  }
+
+  t.is(length, 256 * 16 * 1024)
+  t.true(Php.backpressureStats().parkedWrites > before.parkedWrites)
+})
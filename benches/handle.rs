@@ -0,0 +1,184 @@
+//! Benchmarks for the request hot path through `Embed::handle`.
+//!
+//! Run with `cargo bench`. Each request is driven to completion, including
+//! reading the whole response body, so the numbers cover the full round trip
+//! through a PHP worker thread.
+
+use std::time::Duration;
+
+use bytes::Bytes;
+use criterion::{criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion, Throughput};
+use http_body_util::BodyExt;
+use php::{Embed, EmbedOptions, Handler, MockRoot, Request};
+use tokio::runtime::Runtime;
+
+const LARGE_BODY: usize = 1024 * 1024;
+
+fn embed(docroot: &MockRoot, options: EmbedOptions) -> Embed {
+  Embed::new_with_options(docroot, None, Vec::<String>::new(), options)
+    .expect("should construct embed")
+}
+
+fn docroot() -> MockRoot {
+  MockRoot::builder()
+    .file("hello.php", "<?php echo 'Hello, World!';")
+    .file(
+      "echo.php",
+      format!("<?php echo str_repeat('x', {LARGE_BODY});"),
+    )
+    .file(
+      "post.php",
+      "<?php echo strlen(file_get_contents('php://input'));",
+    )
+    .file("empty.php", "<?php")
+    .file("server.php", "<?php $_SERVER['REQUEST_URI'];")
+    .build()
+    .expect("should prepare docroot")
+}
+
+async fn request(path: &str, body: Bytes, headers: usize) -> Request {
+  let method = if body.is_empty() { "GET" } else { "POST" };
+  let body = http_handler::RequestBody::from_data(body)
+    .await
+    .expect("should create body");
+
+  let mut builder = http_handler::request::Request::builder()
+    .method(method)
+    .uri(format!("http://example.com{path}"));
+  for i in 0..headers {
+    builder = builder.header(format!("x-bench-header-{i}"), "some header value");
+  }
+
+  builder.body(body).expect("should build request")
+}
+
+// Handle a request and read its body to the end, returning the body length.
+async fn roundtrip(embed: &Embed, request: Request) -> usize {
+  let response = embed.handle(request).await.expect("should handle request");
+  let mut body = response.into_body();
+
+  let mut len = 0;
+  while let Some(frame) = body.frame().await {
+    if let Ok(data) = frame.expect("should read body").into_data() {
+      len += data.len();
+    }
+  }
+  len
+}
+
+fn bench_handle(c: &mut Criterion) {
+  let runtime = Runtime::new().expect("should start runtime");
+  let docroot = docroot();
+  let embed = embed(&docroot, EmbedOptions::default());
+
+  let mut group = c.benchmark_group("handle");
+  group.measurement_time(Duration::from_secs(10));
+
+  group.throughput(Throughput::Elements(1));
+  group.bench_function("hello_world", |b| {
+    b.to_async(&runtime).iter_batched(
+      || runtime.block_on(request("/hello.php", Bytes::new(), 0)),
+      |request| roundtrip(&embed, request),
+      BatchSize::SmallInput,
+    )
+  });
+
+  group.throughput(Throughput::Bytes(LARGE_BODY as u64));
+  group.bench_function("large_echo", |b| {
+    b.to_async(&runtime).iter_batched(
+      || runtime.block_on(request("/echo.php", Bytes::new(), 0)),
+      |request| roundtrip(&embed, request),
+      BatchSize::SmallInput,
+    )
+  });
+
+  let post_body = Bytes::from(vec![b'x'; LARGE_BODY]);
+  group.bench_function("large_post", |b| {
+    b.to_async(&runtime).iter_batched(
+      || runtime.block_on(request("/post.php", post_body.clone(), 0)),
+      |request| roundtrip(&embed, request),
+      BatchSize::SmallInput,
+    )
+  });
+
+  group.throughput(Throughput::Elements(1));
+  group.bench_function("many_headers", |b| {
+    b.to_async(&runtime).iter_batched(
+      || runtime.block_on(request("/server.php", Bytes::new(), 64)),
+      |request| roundtrip(&embed, request),
+      BatchSize::SmallInput,
+    )
+  });
+
+  group.finish();
+}
+
+// Requests for a missing script fail in translate_path before reaching a
+// worker, so they measure path resolution, with and without the path cache.
+fn bench_translate_path(c: &mut Criterion) {
+  let runtime = Runtime::new().expect("should start runtime");
+  let docroot = docroot();
+
+  let mut group = c.benchmark_group("translate_path");
+  for (name, ttl) in [
+    ("uncached", Duration::ZERO),
+    ("cached", Duration::from_secs(60)),
+  ] {
+    let embed = embed(
+      &docroot,
+      EmbedOptions {
+        path_cache_ttl: ttl,
+        ..Default::default()
+      },
+    );
+
+    group.bench_function(name, |b| {
+      b.to_async(&runtime).iter_batched(
+        || runtime.block_on(request("/some/missing/script.php", Bytes::new(), 0)),
+        |request| async {
+          embed
+            .handle(request)
+            .await
+            .expect_err("should not find script")
+        },
+        BatchSize::SmallInput,
+      )
+    });
+  }
+  group.finish();
+}
+
+// $_SERVER is only populated when a script uses it, so the difference between
+// these two scripts is the cost of sapi_module_register_server_variables.
+fn bench_server_variables(c: &mut Criterion) {
+  let runtime = Runtime::new().expect("should start runtime");
+  let docroot = docroot();
+  let embed = embed(&docroot, EmbedOptions::default());
+
+  let mut group = c.benchmark_group("register_server_variables");
+  for headers in [0, 16, 64] {
+    for script in ["empty", "server"] {
+      let path = format!("/{script}.php");
+      group.bench_with_input(
+        BenchmarkId::new(script, headers),
+        &headers,
+        |b, &headers| {
+          b.to_async(&runtime).iter_batched(
+            || runtime.block_on(request(&path, Bytes::new(), headers)),
+            |request| roundtrip(&embed, request),
+            BatchSize::SmallInput,
+          )
+        },
+      );
+    }
+  }
+  group.finish();
+}
+
+criterion_group!(
+  benches,
+  bench_handle,
+  bench_translate_path,
+  bench_server_variables
+);
+criterion_main!(benches);
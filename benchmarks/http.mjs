@@ -0,0 +1,109 @@
+// Load test demo/server.js through each of handleRequest, handleRequestSync
+// and handleStream, reporting throughput, latency percentiles and RSS growth.
+//
+//   node benchmarks/http.mjs [--duration 10] [--connections 32]
+
+import { spawn, execFileSync } from 'node:child_process'
+import { once } from 'node:events'
+import { join } from 'node:path'
+import { parseArgs } from 'node:util'
+
+const { values: options } = parseArgs({
+  options: {
+    duration: { type: 'string', default: '10' },
+    connections: { type: 'string', default: '32' },
+    mode: { type: 'string', multiple: true, default: ['request', 'sync', 'stream'] }
+  }
+})
+
+const duration = Number(options.duration) * 1000
+const connections = Number(options.connections)
+const demo = join(import.meta.dirname, '..', 'demo')
+
+const results = []
+for (const mode of options.mode) {
+  results.push(await bench(mode))
+}
+console.table(results)
+
+async function bench(mode) {
+  const server = spawn(process.execPath, ['server.js'], {
+    cwd: demo,
+    env: { ...process.env, PORT: '0', PHP_NODE_MODE: mode },
+    stdio: ['ignore', 'pipe', 'inherit']
+  })
+
+  try {
+    const url = await serverUrl(server)
+
+    // Warm up workers, then measure from a settled RSS
+    await load(url, 1000)
+    const rssBefore = rss(server.pid)
+    const { requests, errors, latencies } = await load(url, duration)
+    const rssAfter = rss(server.pid)
+
+    latencies.sort((a, b) => a - b)
+    return {
+      mode,
+      'req/s': Math.round(requests / (duration / 1000)),
+      errors,
+      'p50 (ms)': percentile(latencies, 0.5).toFixed(2),
+      'p99 (ms)': percentile(latencies, 0.99).toFixed(2),
+      'rss (MB)': (rssAfter / 1024).toFixed(1),
+      'rss growth (MB)': ((rssAfter - rssBefore) / 1024).toFixed(1)
+    }
+  } finally {
+    server.kill()
+    await once(server, 'exit')
+  }
+}
+
+// The demo server prints its address once it has checked it can serve PHP.
+async function serverUrl(server) {
+  let output = ''
+  for await (const chunk of server.stdout) {
+    output += chunk
+    const match = output.match(/http:\/\/localhost:(\d+)\//)
+    if (match) {
+      server.stdout.resume()
+      return `http://localhost:${match[1]}/index.php`
+    }
+  }
+  throw new Error('demo server exited before listening')
+}
+
+// Keep `connections` requests in flight until `ms` has passed.
+async function load(url, ms) {
+  const deadline = performance.now() + ms
+  const latencies = []
+  let requests = 0
+  let errors = 0
+
+  async function connection() {
+    while (performance.now() < deadline) {
+      const start = performance.now()
+      try {
+        const res = await fetch(url, { method: 'POST', body: 'Hello, from Node.js!' })
+        await res.arrayBuffer()
+        if (res.status !== 200) errors++
+      } catch {
+        errors++
+      }
+      latencies.push(performance.now() - start)
+      requests++
+    }
+  }
+
+  await Promise.all(Array.from({ length: connections }, connection))
+  return { requests, errors, latencies }
+}
+
+function percentile(sorted, p) {
+  if (sorted.length === 0) return 0
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))]
+}
+
+// Resident set size of a process, in kilobytes
+function rss(pid) {
+  return Number(execFileSync('ps', ['-o', 'rss=', '-p', String(pid)]).toString().trim())
+}
@@ -0,0 +1,156 @@
+// Run a long mix of normal, streamed, aborted, bailed out and throwing
+// requests, sampling RSS, the Zend heap and live request contexts as it goes.
+// Exits non-zero if memory grows past the thresholds after warmup, or if any
+// request context outlives its request.
+//
+//   node benchmarks/soak.mjs [--requests 1000000] [--concurrency 32]
+//     [--max-rss-growth 64] [--max-retained-growth 8]
+
+import { parseArgs } from 'node:util'
+import { setTimeout as sleep } from 'node:timers/promises'
+
+import { Php, Request } from '../index.js'
+import { MockRoot } from '../__test__/util.mjs'
+
+const { values: options } = parseArgs({
+  options: {
+    requests: { type: 'string', default: '1000000' },
+    concurrency: { type: 'string', default: '32' },
+    samples: { type: 'string', default: '50' },
+    'max-rss-growth': { type: 'string', default: '64' },
+    'max-retained-growth': { type: 'string', default: '8' }
+  }
+})
+
+const total = Number(options.requests)
+const concurrency = Number(options.concurrency)
+const sampleEvery = Math.max(1, Math.floor(total / Number(options.samples)))
+const warmup = Math.min(total, Math.max(sampleEvery, Math.floor(total * 0.05)))
+const MB = 1024 * 1024
+
+const mockroot = await MockRoot.from({
+  'echo.php': '<?php echo file_get_contents("php://input"); ?>',
+  'stream.php': `<?php
+    for ($i = 0; $i < 64; $i++) {
+      echo str_repeat('x', 1024);
+      flush();
+    }
+  ?>`,
+  'slow.php': `<?php
+    for ($i = 0; $i < 100 && !connection_aborted(); $i++) {
+      echo str_repeat('x', 64 * 1024);
+      flush();
+    }
+  ?>`,
+  'bailout.php': `<?php
+    ini_set('memory_limit', '4M');
+    $data = str_repeat('x', 8 * 1024 * 1024);
+  ?>`,
+  'exception.php': '<?php throw new Exception("soak"); ?>'
+})
+
+const php = new Php({ docroot: mockroot.path })
+
+const kinds = [
+  async function buffered() {
+    const res = await php.handleRequest(new Request({
+      method: 'POST',
+      url: 'http://example.com/echo.php',
+      body: Buffer.from('soak')
+    }))
+    if (res.body.toString() !== 'soak') throw new Error('unexpected echo')
+  },
+  async function streamed() {
+    const res = await php.handleStream(new Request({
+      url: 'http://example.com/stream.php'
+    }))
+    for await (const _chunk of res) {}
+  },
+  async function aborted() {
+    const controller = new AbortController()
+    const res = await php.handleStream(new Request({
+      url: 'http://example.com/slow.php'
+    }), controller.signal)
+    try {
+      for await (const _chunk of res) {
+        controller.abort()
+      }
+    } catch {}
+  },
+  async function bailout() {
+    await php.handleRequest(new Request({ url: 'http://example.com/bailout.php' }))
+  },
+  async function exception() {
+    await php.handleRequest(new Request({ url: 'http://example.com/exception.php' }))
+  }
+]
+
+function sample(completed) {
+  const metrics = php.metrics()
+  return {
+    requests: completed,
+    'rss (MB)': +(process.memoryUsage().rss / MB).toFixed(1),
+    'zend retained (MB)': +(metrics.memoryRetained.reduce((a, b) => a + b, 0) / MB).toFixed(2),
+    'zend peak (MB)': +(Math.max(...metrics.memoryPeak) / MB).toFixed(2),
+    contexts: metrics.requestContexts
+  }
+}
+
+const samples = []
+let baseline
+let started = 0
+let completed = 0
+let failures = 0
+
+async function worker() {
+  while (started < total) {
+    const kind = kinds[started++ % kinds.length]
+    try {
+      await kind()
+    } catch (err) {
+      failures++
+      if (failures <= 10) console.error(`${kind.name}: ${err.message}`)
+    }
+
+    completed++
+    if (completed === warmup) {
+      baseline = sample(completed)
+    }
+    if (completed % sampleEvery === 0) {
+      const current = sample(completed)
+      samples.push(current)
+      console.log(JSON.stringify(current))
+    }
+  }
+}
+
+await Promise.all(Array.from({ length: concurrency }, worker))
+
+// Let aborted scripts notice and finish before checking for leaked contexts
+for (let i = 0; i < 50 && php.metrics().requestContexts > 0; i++) {
+  await sleep(100)
+}
+
+const final = sample(completed)
+await mockroot.clean()
+
+console.table(samples)
+
+const errors = []
+const rssGrowth = final['rss (MB)'] - baseline['rss (MB)']
+const retainedGrowth = final['zend retained (MB)'] - baseline['zend retained (MB)']
+if (rssGrowth > Number(options['max-rss-growth'])) {
+  errors.push(`RSS grew by ${rssGrowth.toFixed(1)}MB after warmup`)
+}
+if (retainedGrowth > Number(options['max-retained-growth'])) {
+  errors.push(`Zend heap grew by ${retainedGrowth.toFixed(2)}MB after warmup`)
+}
+if (final.contexts !== 0) {
+  errors.push(`${final.contexts} request contexts still alive after all requests finished`)
+}
+
+console.log(`${completed} requests, ${failures} failed, RSS +${rssGrowth.toFixed(1)}MB after warmup`)
+if (errors.length > 0) {
+  for (const error of errors) console.error(error)
+  process.exit(1)
+}
@@ -16,14 +16,11 @@ const php = new Php({
   docroot: cwd()
 })
 
-const server = createServer(async (req, res) => {
-  // TODO: We need to buffer the whole request rather than streaming to PHP.
-  // Need to add streaming support to lang_handler and the php crate.
-  const chunks = []
-  for await (const chunk of req) {
-    chunks.push(chunk)
-  }
+// Dispatch with handleRequest by default. Set PHP_NODE_MODE to `sync` or
+// `stream` to use handleRequestSync or handleStream instead.
+const mode = process.env.PHP_NODE_MODE ?? 'request'
 
+const server = createServer(async (req, res) => {
   const url = urlForRequest(req)
 
   // Every page except /index.php should show the homepage.
@@ -35,16 +32,36 @@ const server = createServer(async (req, res) => {
     return
   }
 
+  // handleRequestSync blocks the thread, so its body must be given up front.
+  // Otherwise the body is streamed into PHP as it arrives.
   const request = new Request({
     method: req.method,
     url: url.href,
     headers: fixHeaders(req.headers),
-    body: Buffer.concat(chunks),
+    body: mode === 'sync' ? await readBody(req) : undefined,
     socket: req.socket
   })
 
   try {
-    const response = await php.handleRequest(request)
+    if (mode === 'stream') {
+      const [response] = await Promise.all([
+        php.handleStream(request),
+        writeBody(req, request)
+      ])
+      res.writeHead(response.status, response.headers)
+      for await (const chunk of response) {
+        res.write(chunk)
+      }
+      res.end()
+      return
+    }
+
+    const [response] = mode === 'sync'
+      ? [php.handleRequestSync(request)]
+      : await Promise.all([
+        php.handleRequest(request, null, { streamBody: true }),
+        writeBody(req, request)
+      ])
     res.writeHead(response.status, response.headers)
     res.end(response.body)
   } catch (err) {
@@ -55,7 +72,7 @@ const server = createServer(async (req, res) => {
   }
 })
 
-server.listen(3000, async () => {
+server.listen(Number(process.env.PORT ?? 3000), async () => {
   const { port } = server.address()
   const url = `http://localhost:${port}/index.php`
 
@@ -83,6 +100,24 @@ function urlForRequest(req) {
   return new URL(req.url, `${proto}//${host}`)
 }
 
+// Collect the whole request body.
+async function readBody(req) {
+  const chunks = []
+  for await (const chunk of req) {
+    chunks.push(chunk)
+  }
+  return Buffer.concat(chunks)
+}
+
+// Write the request body into the PHP request as it arrives, waiting for room
+// before reading more from the socket.
+async function writeBody(req, request) {
+  for await (const chunk of req) {
+    await request.write(chunk)
+  }
+  await request.end()
+}
+
 // Currently header values must be arrays. Need to make it support single values too.
 function fixHeaders(headers) {
   return Object.fromEntries(
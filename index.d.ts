@@ -1374,6 +1374,10 @@ export declare class Php {
   /**
    * Handle a PHP request.
    *
+   * With `streamBody`, a request without a body given up front reads its
+   * body from `request.write()` and `request.end()`, which must be called
+   * while the response is pending. Otherwise the body is closed for it.
+   *
    * # Examples
    *
    * ```js
@@ -1391,10 +1395,13 @@ export declare class Php {
    * console.log(response.body);
    * ```
    */
-  handleRequest(request: PhpRequest, signal?: AbortSignal | undefined | null): Promise<unknown>
+  handleRequest(request: PhpRequest, signal?: AbortSignal | undefined | null, options?: PhpHandleOptions | undefined | null): Promise<unknown>
   /**
    * Handle a PHP request synchronously.
    *
+   * Fails when `sessionStore` or `functions` is set, as their promises could
+   * never settle while this blocks the thread.
+   *
    * # Examples
    *
    * ```js
@@ -1442,9 +1449,243 @@ export declare class Php {
    * ```
    */
   handleStream(request: PhpRequest, signal?: AbortSignal | undefined | null): Promise<unknown>
+  /**
+   * Compile scripts into the opcode cache without executing them.
+   *
+   * Paths are relative to the docroot. Resolves with the number of scripts
+   * compiled, which is zero if OPcache is not enabled.
+   *
+   * # Examples
+   *
+   * ```js
+   * const php = new Php({
+   *   docroot: process.cwd(),
+   *   opcache: { validateTimestamps: false }
+   * });
+   *
+   * await php.warmOpcache(['index.php', 'src/app.php']);
+   * ```
+   */
+  warmOpcache(scripts: Array<string>): Promise<number>
+  /**
+   * Wait until every worker thread is ready to serve requests, then compile
+   * the given scripts into the opcode cache.
+   *
+   * Paths are relative to the docroot. The first call also waits for the
+   * `opcache.warm` scripts, and rejects if they failed to compile or if the
+   * `opcache.jit` could not be enabled. Call this before taking traffic so
+   * the first requests do not pay for startup.
+   *
+   * # Examples
+   *
+   * ```js
+   * const php = new Php({ worker: 'worker.php', keepEngine: true });
+   *
+   * const { ready, workers } = await php.warmup(['index.php']);
+   * ```
+   */
+  warmup(scripts?: Array<string> | undefined | null): Promise<PhpWarmupReport>
+  /**
+   * Get counters describing how requests to this PHP instance are admitted to
+   * its worker threads.
+   *
+   * # Examples
+   *
+   * ```js
+   * const php = new Php({ queueTimeout: 1000, shedLoad: true });
+   *
+   * const { queued, running, rejected } = php.poolStats();
+   * ```
+   */
+  poolStats(): PhpPoolStats
+  /**
+   * Get the PHP call stacks sampled from requests to this instance, and
+   * optionally start over. Empty unless the `profiler` option is set.
+   *
+   * # Examples
+   *
+   * ```js
+   * const php = new Php({ profiler: { intervalMs: 5, everyNthRequest: 10 } });
+   *
+   * // Later, write out the stacks for a flame graph tool
+   * const { folded } = php.profile(true);
+   * ```
+   */
+  profile(reset?: boolean | undefined | null): PhpProfile
+  /**
+   * Get request counters, latency histograms and memory peaks for this PHP
+   * instance.
+   *
+   * # Examples
+   *
+   * ```js
+   * const php = new Php();
+   *
+   * const { requests, bailouts, requestDuration } = php.metrics();
+   * ```
+   */
+  metrics(): PhpMetrics
+  /**
+   * Render the metrics for this PHP instance in the Prometheus text format.
+   *
+   * # Examples
+   *
+   * ```js
+   * const php = new Php();
+   *
+   * app.get('/metrics', (req, res) => res.type('text/plain').send(php.prometheusMetrics()));
+   * ```
+   */
+  prometheusMetrics(): string
+  /**
+   * Get counters describing how often PHP workers were blocked writing
+   * output to slow response consumers, across all PHP instances.
+   *
+   * # Examples
+   *
+   * ```js
+   * const { parkedWrites, parkedTimeMs } = Php.backpressureStats();
+   * ```
+   */
+  static backpressureStats(): PhpBackpressureStats
 }
 export type PhpRuntime = Php
 
+/** Counters describing how requests are admitted to the PHP worker threads. */
+export interface PhpPoolStats {
+  /** Requests waiting for a worker. */
+  queued: number
+  /** Requests currently running on a worker. */
+  running: number
+  /** Requests which started running on a worker. */
+  started: number
+  /** Requests rejected because the queue was full. */
+  rejected: number
+  /** Requests dropped because they waited longer than the queue timeout. */
+  timedOut: number
+  /** Total milliseconds started requests spent waiting for a worker. */
+  waitTimeMs: number
+  /** Worker threads ready to take requests. */
+  ready: number
+  /** Worker threads in the pool. */
+  workers: number
+}
+
+/** Outcome of warming up a PHP instance. */
+export interface PhpWarmupReport {
+  /** Worker threads ready to serve requests. */
+  ready: number
+  /**
+   * Worker threads in the pool. Fewer are ready when some did not finish
+   * starting within 30 seconds.
+   */
+  workers: number
+  /** Scripts compiled into the opcode cache. */
+  compiled: number
+  /** Milliseconds spent warming up. */
+  durationMs: number
+}
+
+/** Counts of observations in each latency bucket. */
+export interface PhpHistogram {
+  /** Upper bound of each bucket, in milliseconds. */
+  boundsMs: Array<number>
+  /**
+   * Observations in each bucket, not cumulative. The last entry counts
+   * observations above the largest bound.
+   */
+  counts: Array<number>
+  /** Total number of observations. */
+  count: number
+  /** Sum of all observations, in milliseconds. */
+  sumMs: number
+}
+
+/** Request counters, latency histograms and memory peaks of a PHP instance. */
+export interface PhpMetrics {
+  /** Requests which ran on a worker to completion. */
+  requests: number
+  /** Requests which ended in a PHP bailout, such as a fatal error. */
+  bailouts: number
+  /** Requests which ended with an uncaught exception. */
+  exceptions: number
+  /** Requests stopped for running longer than the request timeout. */
+  deadlinesExceeded: number
+  /** Requests for which no script was found. */
+  notFound: number
+  /** Requests answered with a static file, without a worker. */
+  staticFiles: number
+  /** Requests currently running on a worker. */
+  running: number
+  /** Requests waiting for a worker. */
+  queued: number
+  /** Request body bytes read by PHP. */
+  bytesIn: number
+  /** Response body bytes written by PHP. */
+  bytesOut: number
+  /** Time from receiving each request until its script finished. */
+  requestDuration: PhpHistogram
+  /** Time each request waited for a worker. */
+  queueWait: PhpHistogram
+  /** Highest Zend memory peak of any request, in bytes, per worker thread. */
+  memoryPeak: Array<number>
+  /** Zend heap held by each worker thread after its last request, in bytes. */
+  memoryRetained: Array<number>
+  /** Request contexts alive across all PHP instances in the process. */
+  requestContexts: number
+  /** Latest state of the OPcache JIT, when it is enabled. */
+  jit?: PhpJitStatus
+}
+
+/** State of the OPcache JIT. */
+export interface PhpJitStatus {
+  /** Whether the JIT was enabled at startup. */
+  enabled: boolean
+  /** Whether the JIT is currently compiling code. */
+  on: boolean
+  /** Size of the buffer for compiled code, in bytes. */
+  bufferSize: number
+  /** Bytes of the buffer not yet holding compiled code. */
+  bufferFree: number
+}
+
+/** Counters describing how often PHP workers were blocked on slow consumers. */
+export interface PhpBackpressureStats {
+  /** Writes which had to wait for the consumer to read before completing. */
+  parkedWrites: number
+  /** Total milliseconds workers spent parked on those writes. */
+  parkedTimeMs: number
+  /** Writes dropped because the request was aborted. */
+  abortedWrites: number
+}
+
+/**
+ * OPcache options for a PHP instance.
+ *
+ * These are applied when the PHP engine starts, so all PHP instances alive
+ * at the same time must use the same settings.
+ */
+export interface PhpOpcacheOptions {
+  /** Shared memory size in megabytes. */
+  memoryConsumption?: number
+  /** Maximum number of cached scripts. */
+  maxAcceleratedFiles?: number
+  /** Check scripts for changes on disk. */
+  validateTimestamps?: boolean
+  /** Seconds between timestamp checks. */
+  revalidateFreq?: number
+  /** Script, relative to the docroot, to preload at engine startup. */
+  preload?: string
+  /** User to run the preload script as when running as root. */
+  preloadUser?: string
+  /** Scripts, relative to the docroot, to compile into the cache at startup. */
+  warm?: Array<string>
+  /** JIT mode, either `'tracing'` or `'function'`. Off when unset. */
+  jit?: string
+  /** Memory for JIT compiled code in megabytes. Defaults to 64. */
+  jitBufferSize?: number
+}
+
 /** Options for creating a new PHP instance. */
 export interface PhpOptions {
   /** The command-line arguments for the PHP instance. */
@@ -1455,4 +1696,175 @@ export interface PhpOptions {
   throwRequestErrors?: boolean
   /** Request rewriter */
   rewriter?: NapiRewriter
+  /** Number of PHP worker threads. Defaults to the available parallelism. */
+  workers?: number
+  /** Maximum number of requests waiting for a free worker thread. */
+  queueSize?: number
+  /**
+   * Milliseconds a request may wait for a free worker before failing with a
+   * 503 response.
+   */
+  queueTimeout?: number
+  /**
+   * Milliseconds a script may run on a worker before it is stopped with a
+   * 504 response.
+   */
+  requestTimeout?: number
+  /** Respond with 503 as soon as the queue is full, instead of waiting. */
+  shedLoad?: boolean
+  /** Worker script, relative to the docroot, to boot once per worker thread. */
+  worker?: string
+  /** Enable and configure OPcache. */
+  opcache?: PhpOpcacheOptions
+  /**
+   * Bytes of output to coalesce before writing to the response. Zero writes
+   * output through immediately.
+   */
+  outputBufferSize?: number
+  /**
+   * Milliseconds to remember which script a request path resolves to. Zero,
+   * the default, resolves every request against the filesystem.
+   */
+  pathCacheTtl?: number
+  /**
+   * Remember what each request is rewritten to, keyed by its method, URL and
+   * headers. Only safe when rewrite rules depend on nothing but the request
+   * and the filesystem.
+   */
+  cacheRewrites?: boolean
+  /** Thread counts of the tokio runtime shared by all PHP instances. */
+  runtime?: PhpRuntimeOptions
+  /** Add a Server-Timing header describing where request time was spent. */
+  serverTiming?: boolean
+  /**
+   * INI settings applied when the PHP engine starts. All PHP instances alive
+   * at the same time must use the same settings.
+   */
+  ini?: Record<string, string>
+  /** INI settings applied at the start of every request to this instance. */
+  requestIni?: Record<string, string>
+  /** Applications served from their own docroots, routed by host or prefix. */
+  tenants?: Array<PhpTenantOptions>
+  /**
+   * Keep PHP sessions in memory shared by all worker threads, instead of
+   * files on disk.
+   */
+  sessions?: boolean
+  /**
+   * Keep PHP sessions in a store implemented in JavaScript, such as one
+   * backed by Redis. Takes precedence over `sessions`.
+   */
+  sessionStore?: PhpSessionStore
+  /**
+   * Serve files which are not PHP scripts straight from the docroot,
+   * without involving a worker thread.
+   */
+  staticFiles?: PhpStaticFileOptions
+  /**
+   * Functions scripts may call with `node_call($name, $payload)`. Each one
+   * is given the payload and must return a promise of the result.
+   */
+  functions?: Record<string, (payload: any) => Promise<any>>
+  /**
+   * Keep the PHP engine running after every instance has been garbage
+   * collected, so later instances start faster. Later instances with
+   * different startup `ini` then throw.
+   */
+  keepEngine?: boolean
+  /** Sample the PHP call stacks of requests, to be read with `profile()`. */
+  profiler?: PhpProfilerOptions
+}
+
+/** Options for serving static files from the docroot. */
+export interface PhpStaticFileOptions {
+  /**
+   * Extensions of the files to serve, without the dot. Defaults to common web
+   * assets. PHP scripts, including `.phtml` and `.inc` files, are never
+   * served.
+   */
+  extensions?: Array<string>
+  /** Largest file to keep in memory, in bytes. Defaults to 64 KiB. */
+  maxCachedSize?: number
+  /** `Cache-Control` header to send with every file. */
+  cacheControl?: string
+}
+
+/** Options for a single call to handleRequest. */
+export interface PhpHandleOptions {
+  /**
+   * Read the request body from `request.write()` and `request.end()` while
+   * the response is pending, unless a body was given up front.
+   */
+  streamBody?: boolean
+}
+
+/** Options for sampling the PHP call stacks of requests. */
+export interface PhpProfilerOptions {
+  /** Milliseconds between samples of a profiled request. Defaults to 10. */
+  intervalMs?: number
+  /** Profile one in every this many requests. Defaults to 1, profiling all. */
+  everyNthRequest?: number
+}
+
+/** PHP call stacks sampled from requests. */
+export interface PhpProfile {
+  /** Stacks sampled. */
+  samples: number
+  /** Requests which were profiled. */
+  requests: number
+  /**
+   * Sampled stacks in the folded format, one `stack count` per line with
+   * frames separated by `;`, as read by flame graph tools.
+   */
+  folded: string
+}
+
+/**
+ * Session storage implemented in JavaScript.
+ *
+ * Each function must return a promise. PHP waits for it to settle, so the
+ * store cannot be used with `handleRequestSync`, which blocks the thread
+ * the promise would settle on.
+ */
+export interface PhpSessionStore {
+  /** Get the data of a session, or `null` when it does not exist. */
+  read: (id: string) => Promise<Buffer | null | undefined>
+  /** Store the data of a session for `ttl` seconds. */
+  write: (id: string, data: Buffer, ttl: number) => Promise<void>
+  /** Remove a session. */
+  destroy: (id: string) => Promise<void>
+}
+
+/** An application served by a PHP instance from its own docroot. */
+export interface PhpTenantOptions {
+  /** Host to serve, ignoring the port. Matches any host when unset. */
+  host?: string
+  /**
+   * Path prefix to serve, stripped before resolving the script. Matches any
+   * path when unset.
+   */
+  prefix?: string
+  /** Document root of this application. */
+  docroot: string
+  /** INI settings applied at the start of every request to this application. */
+  requestIni?: Record<string, string>
+  /**
+   * Most requests which may be queued or running at once before further
+   * requests fail with a 503 response.
+   */
+  maxRequests?: number
+}
+
+/**
+ * Options for the tokio runtime shared by all PHP instances.
+ *
+ * The runtime starts when the addon is loaded, configured by the
+ * `PHP_NODE_RUNTIME_WORKERS` and `PHP_NODE_RUNTIME_BLOCKING_THREADS`
+ * environment variables. Values given here must match the running runtime.
+ */
+export interface PhpRuntimeOptions {
+  /** Number of async worker threads. */
+  workerThreads?: number
+  /** Maximum number of threads for blocking tasks. */
+  maxBlockingThreads?: number
 }
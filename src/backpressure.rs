@@ -0,0 +1,99 @@
+//! Backpressure between PHP output and the response body consumer.
+//!
+//! The response body is a bounded pipe, so a write from PHP parks the worker
+//! thread when the consumer is reading slower than the script produces output.
+//! Together with the [`OutputBuffer`](crate::extensions::OutputBuffer) high-water
+//! mark, this caps how much output is held in memory per response. Parked
+//! writes are counted here, and are woken early if the request is aborted.
+
+use std::{
+  future::{poll_fn, Future},
+  pin::pin,
+  sync::atomic::{AtomicU64, Ordering},
+  task::Poll,
+  time::{Duration, Instant},
+};
+
+use tokio::io::AsyncWriteExt;
+
+use crate::extensions::RequestAbort;
+
+static PARKED_WRITES: AtomicU64 = AtomicU64::new(0);
+static PARKED_NANOS: AtomicU64 = AtomicU64::new(0);
+static ABORTED_WRITES: AtomicU64 = AtomicU64::new(0);
+
+/// Counters describing how often PHP workers were blocked on slow consumers.
+///
+/// # Examples
+///
+/// ```
+/// let stats = php::backpressure_stats();
+/// assert!(stats.parked_time >= std::time::Duration::ZERO);
+/// ```
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct BackpressureStats {
+  /// Writes which had to wait for the consumer to read before completing.
+  pub parked_writes: u64,
+
+  /// Total time workers spent parked on those writes.
+  pub parked_time: Duration,
+
+  /// Writes dropped because the request was aborted.
+  pub aborted_writes: u64,
+}
+
+/// Get the process-wide backpressure counters.
+pub fn backpressure_stats() -> BackpressureStats {
+  BackpressureStats {
+    parked_writes: PARKED_WRITES.load(Ordering::Relaxed),
+    parked_time: Duration::from_nanos(PARKED_NANOS.load(Ordering::Relaxed)),
+    aborted_writes: ABORTED_WRITES.load(Ordering::Relaxed),
+  }
+}
+
+/// Write output to the response body, parking the current thread while the
+/// consumer is not keeping up.
+///
+/// Returns false if the write failed, or was interrupted or skipped because
+/// the request was aborted.
+pub(crate) fn write(
+  mut body: http_handler::ResponseBody,
+  bytes: &[u8],
+  abort: Option<&RequestAbort>,
+) -> bool {
+  if abort.is_some_and(RequestAbort::is_aborted) {
+    ABORTED_WRITES.fetch_add(1, Ordering::Relaxed);
+    return false;
+  }
+
+  crate::runtime::handle().block_on(async {
+    let mut write = pin!(body.write_all(bytes));
+
+    // Most writes fit in the pipe and complete on the first poll.
+    let first = poll_fn(|cx| match write.as_mut().poll(cx) {
+      Poll::Ready(result) => Poll::Ready(Some(result)),
+      Poll::Pending => Poll::Ready(None),
+    })
+    .await;
+    if let Some(result) = first {
+      return result.is_ok();
+    }
+
+    let parked_at = Instant::now();
+    let written = match abort {
+      Some(abort) => tokio::select! {
+        result = write => result.is_ok(),
+        _ = abort.aborted() => {
+          ABORTED_WRITES.fetch_add(1, Ordering::Relaxed);
+          false
+        }
+      },
+      None => write.await.is_ok(),
+    };
+
+    PARKED_WRITES.fetch_add(1, Ordering::Relaxed);
+    PARKED_NANOS.fetch_add(parked_at.elapsed().as_nanos() as u64, Ordering::Relaxed);
+
+    written
+  })
+}
@@ -0,0 +1,157 @@
+use std::{
+  borrow::Borrow,
+  collections::{hash_map::RandomState, HashMap},
+  hash::{BuildHasher, Hash},
+  sync::RwLock,
+  time::{Duration, Instant},
+};
+
+// Number of independently locked shards. Lookups for different keys rarely
+// contend, and readers of the same shard never block each other.
+const SHARDS: usize = 16;
+
+/// A concurrent map whose entries expire a fixed time after insertion.
+///
+/// Shared across worker threads in shards, each behind a read-write lock, so
+/// lookups only wait on an insert into the same shard. Each shard holds at
+/// most `capacity / SHARDS` entries. When full, expired entries are dropped
+/// first, and the whole shard is cleared if that was not enough.
+pub(crate) struct TtlCache<K, V> {
+  shards: Box<[RwLock<HashMap<K, Entry<V>>>]>,
+  hasher: RandomState,
+  ttl: Duration,
+  shard_capacity: usize,
+}
+
+struct Entry<V> {
+  value: V,
+  expires: Instant,
+}
+
+impl<K, V> TtlCache<K, V>
+where
+  K: Hash + Eq,
+  V: Clone,
+{
+  /// Create a cache holding entries for `ttl`, up to about `capacity` entries.
+  pub fn new(ttl: Duration, capacity: usize) -> Self {
+    Self {
+      shards: (0..SHARDS).map(|_| RwLock::new(HashMap::new())).collect(),
+      hasher: RandomState::new(),
+      ttl,
+      shard_capacity: capacity.div_ceil(SHARDS).max(1),
+    }
+  }
+
+  /// Get the value for `key`, if present and not yet expired.
+  pub fn get<Q>(&self, key: &Q) -> Option<V>
+  where
+    K: Borrow<Q>,
+    Q: Hash + Eq + ?Sized,
+  {
+    let shard = self
+      .shard(key)
+      .read()
+      .unwrap_or_else(|poisoned| poisoned.into_inner());
+
+    shard
+      .get(key)
+      .filter(|entry| entry.expires > Instant::now())
+      .map(|entry| entry.value.clone())
+  }
+
+  /// Insert a value for `key`, replacing any existing entry.
+  pub fn insert(&self, key: K, value: V) {
+    let now = Instant::now();
+    let mut shard = self
+      .shard(&key)
+      .write()
+      .unwrap_or_else(|poisoned| poisoned.into_inner());
+
+    if shard.len() >= self.shard_capacity && !shard.contains_key(&key) {
+      shard.retain(|_, entry| entry.expires > now);
+      if shard.len() >= self.shard_capacity {
+        shard.clear();
+      }
+    }
+
+    shard.insert(
+      key,
+      Entry {
+        value,
+        expires: now + self.ttl,
+      },
+    );
+  }
+
+  /// Get the value for `key`, computing it with `f` on a miss and caching it
+  /// if `f` succeeds. Errors are not cached, so the next lookup tries again.
+  ///
+  /// No lock is held while `f` runs, so concurrent misses for the same key
+  /// may each compute it.
+  pub fn get_or_try_insert_with<Q, F, E>(&self, key: &Q, f: F) -> Result<V, E>
+  where
+    K: Borrow<Q>,
+    Q: Hash + Eq + ToOwned<Owned = K> + ?Sized,
+    F: FnOnce() -> Result<V, E>,
+  {
+    if let Some(value) = self.get(key) {
+      return Ok(value);
+    }
+
+    let value = f()?;
+    self.insert(key.to_owned(), value.clone());
+    Ok(value)
+  }
+
+  fn shard<Q>(&self, key: &Q) -> &RwLock<HashMap<K, Entry<V>>>
+  where
+    Q: Hash + ?Sized,
+  {
+    let index = self.hasher.hash_one(key) as usize % SHARDS;
+    &self.shards[index]
+  }
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+
+  #[test]
+  fn test_entries_expire() {
+    let cache = TtlCache::<String, u32>::new(Duration::from_millis(20), 64);
+    cache.insert("a".to_string(), 1);
+    assert_eq!(cache.get("a"), Some(1));
+
+    std::thread::sleep(Duration::from_millis(30));
+    assert_eq!(cache.get("a"), None);
+    assert_eq!(cache.get_or_try_insert_with("a", || Ok::<_, ()>(2)), Ok(2));
+    assert_eq!(cache.get("a"), Some(2));
+  }
+
+  #[test]
+  fn test_errors_are_not_cached() {
+    let cache = TtlCache::<String, u32>::new(Duration::from_secs(60), 64);
+    assert_eq!(
+      cache.get_or_try_insert_with("a", || Err("missing")),
+      Err("missing")
+    );
+    assert_eq!(cache.get("a"), None);
+    assert_eq!(
+      cache.get_or_try_insert_with("a", || Ok::<_, &str>(1)),
+      Ok(1)
+    );
+  }
+
+  #[test]
+  fn test_capacity_is_bounded() {
+    let cache = TtlCache::<u32, u32>::new(Duration::from_secs(60), 32);
+    for i in 0..1000 {
+      cache.insert(i, i);
+    }
+
+    let len: usize = cache.shards.iter().map(|s| s.read().unwrap().len()).sum();
+    assert!(len <= 32);
+    assert_eq!(cache.get(&999), Some(999));
+  }
+}
@@ -0,0 +1,167 @@
+//! Interrupting scripts which run past their deadline or are aborted.
+//!
+//! Each request running on a worker may be armed with a timeout and the
+//! caller's [`RequestAbort`]. A watchdog task on the async runtime waits for
+//! either and then raises the worker thread's VM interrupt, which is checked
+//! at function calls and loop back-edges. A timed out script ends
+//! with a fatal error, and an aborted one bails out as PHP does when the
+//! client goes away unless it called `ignore_user_abort()`. Either way the
+//! script unwinds like any other bailout, so request shutdown runs and the
+//! worker goes back to the pool.
+//!
+//! Time spent inside a single internal function, such as `sleep()` or a
+//! blocking read, is only interrupted once it returns to the VM.
+
+use std::{
+  cell::RefCell,
+  ffi::{c_char, c_int},
+  sync::{
+    atomic::{AtomicU8, Ordering},
+    Arc,
+  },
+  time::Duration,
+};
+
+use ext_php_rs::{
+  ffi::zend_long,
+  zend::{bailout, ProcessGlobals, SapiGlobals},
+};
+
+use crate::{interrupt::Trigger, EmbedRequestError, RequestAbort};
+
+extern "C" {
+  fn zend_error_noreturn(ty: c_int, format: *const c_char, ...) -> !;
+}
+
+const E_ERROR: c_int = 1;
+
+// Status sent when a script is stopped by its deadline before sending
+// headers, as a proxy would for an upstream which took too long.
+const GATEWAY_TIMEOUT: c_int = 504;
+
+const RUNNING: u8 = 0;
+const TIMED_OUT: u8 = 1;
+const ABORTED: u8 = 2;
+
+thread_local! {
+  // Deadline of the request running on this worker thread.
+  static CURRENT: RefCell<Option<Arc<State>>> = const { RefCell::new(None) };
+}
+
+struct State {
+  trigger: Trigger,
+  timeout: Option<Duration>,
+  reason: AtomicU8,
+}
+
+impl State {
+  fn trip(&self, reason: u8) {
+    self.reason.store(reason, Ordering::Release);
+    self.trigger.raise();
+  }
+
+  fn reason(&self) -> u8 {
+    self.reason.load(Ordering::Acquire)
+  }
+}
+
+/// Deadline of a request running on the current worker thread. Disarmed
+/// when dropped.
+pub(crate) struct Deadline(Arc<State>);
+
+impl Deadline {
+  /// Arm a deadline for the request about to run on this thread, measured
+  /// from now. Nothing is armed when there is neither a timeout nor a way
+  /// to abort the request.
+  pub fn arm(timeout: Option<Duration>, abort: Option<RequestAbort>) -> Option<Self> {
+    if timeout.is_none() && abort.is_none() {
+      return None;
+    }
+
+    let state = Arc::new(State {
+      trigger: Trigger::current(),
+      timeout,
+      reason: AtomicU8::new(RUNNING),
+    });
+
+    let watched = state.clone();
+    crate::runtime::handle().spawn(async move {
+      let expired = async {
+        match watched.timeout {
+          Some(timeout) => tokio::time::sleep(timeout).await,
+          None => std::future::pending().await,
+        }
+      };
+      let aborted = async {
+        match &abort {
+          Some(abort) => abort.aborted().await,
+          None => std::future::pending().await,
+        }
+      };
+
+      tokio::select! {
+        _ = watched.trigger.disarmed() => {}
+        _ = expired => watched.trip(TIMED_OUT),
+        _ = aborted => watched.trip(ABORTED),
+      }
+    });
+
+    CURRENT.with(|current| *current.borrow_mut() = Some(state.clone()));
+    Some(Self(state))
+  }
+
+  /// Report a script ended by this deadline as such, rather than as the
+  /// bailout it unwound with.
+  pub fn result(&self, result: Result<(), EmbedRequestError>) -> Result<(), EmbedRequestError> {
+    match (result, self.0.reason()) {
+      (Err(EmbedRequestError::Bailout), TIMED_OUT) => Err(EmbedRequestError::DeadlineExceeded),
+      (Err(EmbedRequestError::Bailout), ABORTED) => Err(EmbedRequestError::Aborted),
+      (result, _) => result,
+    }
+  }
+}
+
+impl Drop for Deadline {
+  fn drop(&mut self) {
+    self.0.trigger.disarm();
+    CURRENT.with(|current| current.borrow_mut().take());
+  }
+}
+
+/// Stop the script running on this thread if its deadline has passed or it
+/// was aborted. Called from the VM interrupt hook.
+pub(crate) unsafe fn check() {
+  // Nothing owned may be left on the stack when the fatal error unwinds
+  // below, so only copies leave the thread local.
+  let tripped = CURRENT.with(|current| {
+    let current = current.borrow();
+    let state = current.as_ref()?;
+    let millis = state.timeout.unwrap_or_default().as_millis() as zend_long;
+    // Taken once, so an interrupt raised for something else during request
+    // shutdown does not stop the script again
+    state.trigger.take().then_some((state.reason(), millis))
+  });
+
+  match tripped {
+    Some((TIMED_OUT, millis)) => {
+      {
+        let mut globals = SapiGlobals::get_mut();
+        if globals.headers_sent == 0 && globals.sapi_headers.http_response_code == 200 {
+          globals.sapi_headers.http_response_code = GATEWAY_TIMEOUT;
+        }
+      }
+      zend_error_noreturn(
+        E_ERROR,
+        c"Request exceeded its deadline of %ld ms".as_ptr(),
+        millis,
+      );
+    }
+    // As PHP does once it notices the client has gone, unless the script
+    // asked to carry on with ignore_user_abort()
+    Some(_) if ProcessGlobals::get().ignore_user_abort == 0 => {
+      ProcessGlobals::get_mut().connection_status |= 1;
+      bailout();
+    }
+    _ => {}
+  }
+}
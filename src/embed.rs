@@ -1,13 +1,12 @@
 use std::{
   env::Args,
-  ffi::c_char,
   ops::DerefMut,
   path::{Path, PathBuf},
-  sync::Arc,
+  sync::{Arc, Mutex},
+  time::{Duration, Instant},
 };
 
 use ext_php_rs::{
-  alloc::estrdup,
   error::Error,
   ffi::php_execute_script,
   zend::{try_catch, try_catch_first, ExecutorGlobals, SapiGlobals},
@@ -15,37 +14,80 @@ use ext_php_rs::{
 
 use http_handler::types::{Request, Response};
 use http_handler::Handler;
+use tokio::sync::oneshot;
 
 use super::{
-  sapi::{ensure_sapi, Sapi},
-  scopes::{FileHandleScope, RequestScope, ThreadScope},
-  strings::translate_path,
-  EmbedRequestError, EmbedStartError, RequestContext,
+  cache::TtlCache,
+  deadline::Deadline,
+  extensions::{
+    BufferedResponse, CapturedOutput, OutputBuffer, Phase, RequestAbort, RequestIni, RequestTiming,
+  },
+  ini,
+  metrics::{memory_retained, take_memory_peak, EmbedMetrics, Metrics},
+  opcache,
+  pool::{self, Admission, PoolStats, WorkerPool},
+  profiler::{Profile, Profiler},
+  sapi::{ensure_sapi_with_ini, keep_resident, Sapi},
+  scopes::{FileHandleScope, RequestScope},
+  session::{self, Sessions},
+  static_files::StaticFiles,
+  strings::{translate_path, with_request_strings},
+  tenant::{self, Tenant},
+  worker, EmbedOptions, EmbedRequestError, EmbedStartError, Functions, RequestContext, SentHeaders,
 };
 
-/// Extension type to keep the blocking PHP task alive while the response is being consumed
+// Upper bound on remembered request paths and rewrites, so requests for many
+// distinct paths cannot grow the caches without limit.
+const PATH_CACHE_CAPACITY: usize = 4096;
+
+// Longest warmup() waits for the workers to be ready. Workers not ready by
+// then are reported rather than waited on indefinitely.
+const WARMUP_TIMEOUT: Duration = Duration::from_secs(30);
+
+// What a worker reports about the JIT when asked at startup.
+type JitCheck = Result<Option<opcache::JitStatus>, EmbedRequestError>;
+
+// Everything about a request which rewrite rules may match on.
+type RewriteKey = (
+  http_handler::Method,
+  http_handler::Uri,
+  Vec<(http_handler::HeaderName, http_handler::HeaderValue)>,
+);
+
+// What a request was rewritten to. Headers are only kept when the rules
+// changed them.
+type RewriteTarget = (
+  http_handler::Method,
+  http_handler::Uri,
+  Option<http_handler::HeaderMap>,
+);
+
+/// Extension type to track the PHP task which is producing a response.
+///
+/// Worker threads keep their PHP thread-local storage for the lifetime of the
+/// pool, so a response being dropped early no longer needs to wait for the
+/// task to finish to keep TSRM consistent. The receiver still resolves with
+/// the task result once the script has fully completed.
 #[derive(Clone)]
 pub struct BlockingTaskHandle(
-  Arc<tokio::sync::Mutex<Option<tokio::task::JoinHandle<Result<(), EmbedRequestError>>>>>,
+  Arc<tokio::sync::Mutex<Option<oneshot::Receiver<Result<(), EmbedRequestError>>>>>,
 );
 
-impl Drop for BlockingTaskHandle {
-  fn drop(&mut self) {
-    // Only wait if this is the last reference
-    if Arc::strong_count(&self.0) == 1 {
-      // CRITICAL: We must wait for the blocking task to complete, not abort it.
-      // The blocking task contains ThreadScope which must call ext_php_rs_sapi_per_thread_shutdown()
-      // to properly clean up PHP's thread-local storage. If we abort, the cleanup never happens
-      // and PHP's TSRM can be left in an inconsistent state, causing memory corruption.
-      if let Ok(mut guard) = self.0.try_lock() {
-        if let Some(handle) = guard.take() {
-          // Use block_on to wait for the task to complete
-          // This ensures ThreadScope::drop() runs and PHP TLS is cleaned up
-          let _ = crate::sapi::fallback_handle().block_on(handle);
-        }
-      }
-    }
-  }
+/// Outcome of [`Embed::warmup`].
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct WarmupReport {
+  /// Workers ready to serve requests.
+  pub ready: usize,
+
+  /// Workers in the pool. Fewer are ready when some did not finish starting
+  /// in time, such as when a worker script fails to boot.
+  pub workers: usize,
+
+  /// Scripts compiled into the opcode cache.
+  pub compiled: usize,
+
+  /// Time spent warming up.
+  pub elapsed: Duration,
 }
 
 /// A simple trait for rewriting requests that works with our specific request type
@@ -85,7 +127,29 @@ where
 /// Embed a PHP script into a Rust application to handle HTTP requests.
 pub struct Embed {
   docroot: PathBuf,
-  args: Vec<String>,
+  args: Arc<[String]>,
+  worker_script: Option<PathBuf>,
+  output_buffer_size: usize,
+  path_cache: Option<TtlCache<String, PathBuf>>,
+  rewrite_cache: Option<TtlCache<RewriteKey, RewriteTarget>>,
+  request_ini: Arc<[(String, String)]>,
+  tenants: Box<[Tenant]>,
+  sessions: Option<Sessions>,
+  static_files: Option<StaticFiles>,
+  functions: Option<Functions>,
+  request_timeout: Option<Duration>,
+  profiler: Option<Arc<Profiler>>,
+  metrics: Arc<Metrics>,
+  jit: bool,
+  // Compilation of the `warm` scripts started with the instance, until
+  // warmup() reports how it went.
+  startup_warm: Mutex<Option<oneshot::Receiver<Result<usize, EmbedRequestError>>>>,
+  // Whether a worker managed to turn the JIT on, until warmup() reports it.
+  jit_check: Mutex<Option<oneshot::Receiver<JitCheck>>>,
+
+  // NOTE: The pool must be declared before the SAPI so its worker threads are
+  // joined, and their thread-local storage released, before the SAPI drops.
+  pool: WorkerPool,
 
   // NOTE: This needs to hold the SAPI to keep it alive
   #[allow(dead_code)]
@@ -99,6 +163,20 @@ impl std::fmt::Debug for Embed {
     f.debug_struct("Embed")
       .field("docroot", &self.docroot)
       .field("args", &self.args)
+      .field("worker_script", &self.worker_script)
+      .field("output_buffer_size", &self.output_buffer_size)
+      .field("path_cache", &self.path_cache.is_some())
+      .field("rewrite_cache", &self.rewrite_cache.is_some())
+      .field("request_ini", &self.request_ini)
+      .field("tenants", &self.tenants.len())
+      .field("sessions", &self.sessions.is_some())
+      .field("static_files", &self.static_files.is_some())
+      .field("functions", &self.functions.is_some())
+      .field("request_timeout", &self.request_timeout)
+      .field("profiler", &self.profiler.is_some())
+      .field("jit", &self.jit)
+      .field("metrics", &"Metrics")
+      .field("pool", &"WorkerPool")
       .field("sapi", &self.sapi)
       .field("rewriter", &"Box<dyn RequestRewriter>")
       .finish()
@@ -178,6 +256,35 @@ impl Embed {
     rewriter: Option<Box<dyn RequestRewriter>>,
     argv: Vec<S>,
   ) -> Result<Self, EmbedStartError>
+  where
+    C: AsRef<Path>,
+    S: AsRef<str> + std::fmt::Debug,
+  {
+    Embed::new_with_options(docroot, rewriter, argv, EmbedOptions::default())
+  }
+
+  /// Creates a new `Embed` instance with command-line arguments and options.
+  ///
+  /// # Examples
+  ///
+  /// ```
+  /// use std::env::current_dir;
+  /// use php::{Embed, EmbedOptions};
+  ///
+  /// let docroot = current_dir()
+  ///   .expect("should have current_dir");
+  ///
+  /// let embed = Embed::new_with_options(docroot, None, vec!["foo"], EmbedOptions {
+  ///   workers: 2,
+  ///   ..Default::default()
+  /// });
+  /// ```
+  pub fn new_with_options<C, S>(
+    docroot: C,
+    rewriter: Option<Box<dyn RequestRewriter>>,
+    argv: Vec<S>,
+    options: EmbedOptions,
+  ) -> Result<Self, EmbedStartError>
   where
     C: AsRef<Path>,
     S: AsRef<str> + std::fmt::Debug,
@@ -187,14 +294,426 @@ impl Embed {
       .canonicalize()
       .map_err(|_| EmbedStartError::DocRootNotFound(docroot_path.display().to_string()))?;
 
-    Ok(Embed {
+    let worker_script = options
+      .worker
+      .map(|script| {
+        let script = docroot.join(script);
+        script
+          .canonicalize()
+          .ok()
+          .filter(|path| path.is_file())
+          .ok_or_else(|| EmbedStartError::WorkerScriptNotFound(script.display().to_string()))
+      })
+      .transpose()?;
+
+    if worker_script.is_some() && !options.tenants.is_empty() {
+      return Err(EmbedStartError::InvalidTenant(
+        "tenants are not supported in worker mode".into(),
+      ));
+    }
+    let tenants = options
+      .tenants
+      .into_iter()
+      .map(|tenant| Tenant::new(tenant, options.path_cache_ttl))
+      .collect::<Result<Box<[_]>, _>>()?;
+
+    let mut ini_entries = String::new();
+    let mut warm = vec![];
+    let mut jit = false;
+    if let Some(mut opcache) = options.opcache {
+      jit = opcache.jit.is_some();
+      opcache.preload = opcache.preload.map(|preload| docroot.join(preload));
+      ini_entries = opcache.ini_entries();
+      warm = opcache.warm;
+    }
+    if !options.ini.is_empty() {
+      ini_entries.push('\n');
+      ini_entries.push_str(&ini::startup_entries(&options.ini)?);
+    }
+
+    crate::runtime::init(options.runtime)?;
+    let sapi = ensure_sapi_with_ini(&ini_entries)?;
+    if options.sessions.is_some() && !session::is_registered() {
+      return Err(EmbedStartError::SessionsUnavailable);
+    }
+    if options.keep_engine {
+      keep_resident(&sapi);
+    }
+    let admission = Admission {
+      queue_timeout: options.queue_timeout,
+      shed_load: options.shed_load,
+    };
+    let pool = WorkerPool::new(
+      sapi.clone(),
+      options.workers,
+      options.queue_size,
+      admission,
+      worker_script.clone(),
+    )?;
+
+    let mut embed = Embed {
       docroot,
       args: argv.iter().map(|v| v.as_ref().to_string()).collect(),
-      sapi: ensure_sapi()?,
+      worker_script,
+      output_buffer_size: options.output_buffer_size,
+      path_cache: (!options.path_cache_ttl.is_zero())
+        .then(|| TtlCache::new(options.path_cache_ttl, PATH_CACHE_CAPACITY)),
+      rewrite_cache: (options.cache_rewrites
+        && rewriter.is_some()
+        && !options.path_cache_ttl.is_zero())
+      .then(|| TtlCache::new(options.path_cache_ttl, PATH_CACHE_CAPACITY)),
+      // Switch to the store's save handler for every request, beneath any
+      // other request INI so it still applies when that changes sessions.
+      request_ini: options
+        .sessions
+        .iter()
+        .map(|_| ("session.save_handler".into(), session::SAVE_HANDLER.into()))
+        .chain(options.request_ini)
+        .collect(),
+      tenants,
+      sessions: options.sessions,
+      static_files: options
+        .static_files
+        .map(|files| StaticFiles::new(files, options.path_cache_ttl)),
+      functions: options.functions,
+      request_timeout: options.request_timeout,
+      profiler: options
+        .profiler
+        .map(|options| Arc::new(Profiler::new(options))),
+      metrics: Arc::new(Metrics::new(options.workers)),
+      jit,
+      startup_warm: Mutex::new(None),
+      jit_check: Mutex::new(None),
+      pool,
+      sapi,
       rewriter,
+    };
+
+    // Ask a worker whether OPcache managed to turn the JIT on. It is silently
+    // left off when PHP was built without it, or the platform or other loaded
+    // extensions do not support it. The outcome is reported by warmup().
+    if jit {
+      let status = embed
+        .pool
+        .try_spawn(opcache::jit_status)
+        .map_err(|_| EmbedStartError::WorkerPoolNotStarted)?;
+      embed.jit_check = Mutex::new(Some(status));
+    }
+
+    // Warm the opcode cache in the background so construction doesn't wait
+    // on compilation. It runs on the first free worker while the others take
+    // requests, which may compile scripts it has not reached yet themselves.
+    // The outcome is reported by warmup().
+    if !warm.is_empty() {
+      let scripts = embed.resolve_scripts(&warm);
+      let compiled = embed
+        .pool
+        .try_spawn(move || opcache::compile(&scripts))
+        .map_err(|_| EmbedStartError::WorkerPoolNotStarted)?;
+      embed.startup_warm = Mutex::new(Some(compiled));
+    }
+
+    Ok(embed)
+  }
+
+  /// Get a snapshot of how requests are being admitted to the worker pool.
+  ///
+  /// # Examples
+  ///
+  /// ```
+  /// use std::env::current_dir;
+  /// use php::Embed;
+  ///
+  /// let docroot = current_dir()
+  ///   .expect("should have current_dir");
+  ///
+  /// let embed = Embed::new(docroot, None)
+  ///   .expect("should construct embed");
+  ///
+  /// assert_eq!(embed.pool_stats().running, 0);
+  /// ```
+  pub fn pool_stats(&self) -> PoolStats {
+    self.pool.stats()
+  }
+
+  /// Get the PHP call stacks sampled from requests to this instance, and
+  /// optionally start over. Empty unless the `profiler` option is set.
+  ///
+  /// # Examples
+  ///
+  /// ```
+  /// use std::env::current_dir;
+  /// use php::{Embed, EmbedOptions, ProfilerOptions};
+  ///
+  /// let docroot = current_dir()
+  ///   .expect("should have current_dir");
+  ///
+  /// let options = EmbedOptions {
+  ///   profiler: Some(ProfilerOptions::default()),
+  ///   ..Default::default()
+  /// };
+  ///
+  /// let embed = Embed::new_with_options(docroot, None, Vec::<String>::new(), options)
+  ///   .expect("should construct embed");
+  ///
+  /// // Write to a file for flamegraph.pl or speedscope
+  /// let folded = embed.profile(true).folded();
+  /// assert!(folded.is_empty());
+  /// ```
+  pub fn profile(&self, reset: bool) -> Profile {
+    self
+      .profiler
+      .as_ref()
+      .map_or_else(Profile::default, |profiler| profiler.snapshot(reset))
+  }
+
+  /// Get a snapshot of the request counters, latency histograms and memory
+  /// peaks of this instance.
+  ///
+  /// # Examples
+  ///
+  /// ```
+  /// use std::env::current_dir;
+  /// use php::Embed;
+  ///
+  /// let docroot = current_dir()
+  ///   .expect("should have current_dir");
+  ///
+  /// let embed = Embed::new(docroot, None)
+  ///   .expect("should construct embed");
+  ///
+  /// let metrics = embed.metrics();
+  /// assert_eq!(metrics.requests, 0);
+  /// assert!(metrics.to_prometheus().contains("php_requests_total 0"));
+  /// ```
+  pub fn metrics(&self) -> EmbedMetrics {
+    self.metrics.snapshot(self.pool.stats())
+  }
+
+  /// Compile scripts into the opcode cache without executing them.
+  ///
+  /// Paths are relative to the docroot. Returns how many scripts compiled
+  /// successfully, which is zero if OPcache is not enabled.
+  ///
+  /// # Examples
+  ///
+  /// ```no_run
+  /// use std::env::current_dir;
+  /// use php::{Embed, EmbedOptions, OpcacheOptions};
+  ///
+  /// let docroot = current_dir()
+  ///   .expect("should have current_dir");
+  ///
+  /// let embed = Embed::new_with_options(docroot, None, Vec::<String>::new(), EmbedOptions {
+  ///   opcache: Some(OpcacheOptions::default()),
+  ///   ..Default::default()
+  /// })
+  /// .expect("should construct embed");
+  ///
+  /// # tokio_test::block_on(async {
+  /// let compiled = embed
+  ///   .warm_opcache(&["index.php"])
+  ///   .await
+  ///   .expect("should compile scripts");
+  /// # });
+  /// ```
+  pub async fn warm_opcache<P>(&self, scripts: &[P]) -> Result<usize, EmbedRequestError>
+  where
+    P: AsRef<Path>,
+  {
+    let scripts = self.resolve_scripts(scripts);
+    self
+      .pool
+      .spawn(move || opcache::compile(&scripts))
+      .await?
+      .await
+      .map_err(|_| EmbedRequestError::WorkerUnavailable)?
+  }
+
+  /// Wait until every worker is ready to serve requests, then compile
+  /// `scripts` into the opcode cache.
+  ///
+  /// The first call also waits for the `warm` scripts of
+  /// [`OpcacheOptions`](crate::OpcacheOptions) to compile, counting them
+  /// in the report and failing if compiling them failed.
+  ///
+  /// Workers start initializing as soon as the `Embed` is constructed, so
+  /// this only waits for the rest of that to finish, including booting the
+  /// worker script in worker mode. Call it before taking traffic, so the
+  /// first requests do not pay for startup. Paths are relative to the
+  /// docroot, like for [`warm_opcache`](Embed::warm_opcache).
+  ///
+  /// # Examples
+  ///
+  /// ```no_run
+  /// use std::env::current_dir;
+  /// use php::{Embed, EmbedOptions};
+  ///
+  /// let docroot = current_dir()
+  ///   .expect("should have current_dir");
+  ///
+  /// let embed = Embed::new_with_options(docroot, None, Vec::<String>::new(), EmbedOptions {
+  ///   keep_engine: true,
+  ///   ..Default::default()
+  /// })
+  /// .expect("should construct embed");
+  ///
+  /// # tokio_test::block_on(async {
+  /// let report = embed
+  ///   .warmup(&["index.php"])
+  ///   .await
+  ///   .expect("should warm up");
+  ///
+  /// assert_eq!(report.ready, report.workers);
+  /// # });
+  /// ```
+  pub async fn warmup<P>(&self, scripts: &[P]) -> Result<WarmupReport, EmbedRequestError>
+  where
+    P: AsRef<Path>,
+  {
+    let started = Instant::now();
+    let ready = self.pool.wait_ready(WARMUP_TIMEOUT).await;
+
+    let startup_warm = self
+      .startup_warm
+      .lock()
+      .unwrap_or_else(|e| e.into_inner())
+      .take();
+    let mut compiled = match startup_warm {
+      Some(compiled) => compiled
+        .await
+        .map_err(|_| EmbedRequestError::WorkerUnavailable)??,
+      None => 0,
+    };
+
+    let jit_check = self
+      .jit_check
+      .lock()
+      .unwrap_or_else(|e| e.into_inner())
+      .take();
+    if let Some(status) = jit_check {
+      match status
+        .await
+        .map_err(|_| EmbedRequestError::WorkerUnavailable)??
+      {
+        Some(status) if status.on => self.metrics.record_jit(&status),
+        _ => return Err(EmbedRequestError::JitUnavailable),
+      }
+    }
+
+    if !scripts.is_empty() {
+      compiled += self.warm_opcache(scripts).await?;
+    }
+
+    Ok(WarmupReport {
+      ready,
+      workers: self.pool.stats().workers,
+      compiled,
+      elapsed: started.elapsed(),
     })
   }
 
+  // Apply the rewriter, replaying a cached rewrite of the same method and URI
+  // when rewrite caching is enabled.
+  fn rewrite(
+    &self,
+    mut request: Request,
+    tenant: Option<&Tenant>,
+  ) -> Result<Request, EmbedRequestError> {
+    let Some(rewriter) = &self.rewriter else {
+      return Ok(request);
+    };
+
+    // Tenants routed by a Host header share URIs, which would share cache
+    // entries despite rewriting against different docroots.
+    let cacheable = request.uri().host().is_some() || !tenant.is_some_and(Tenant::routes_by_host);
+    // Header conditions may match on any header, so requests only share an
+    // entry when all of them are the same.
+    let key = self.rewrite_cache.as_ref().filter(|_| cacheable).map(|_| {
+      let headers = request
+        .headers()
+        .iter()
+        .map(|(name, value)| (name.clone(), value.clone()))
+        .collect();
+      (request.method().clone(), request.uri().clone(), headers)
+    });
+
+    if let (Some(cache), Some(key)) = (&self.rewrite_cache, &key) {
+      if let Some((method, uri, headers)) = cache.get(key) {
+        *request.method_mut() = method;
+        *request.uri_mut() = uri;
+        if let Some(headers) = headers {
+          *request.headers_mut() = headers;
+        }
+        return Ok(request);
+      }
+    }
+
+    let original_headers = key.as_ref().map(|_| request.headers().clone());
+    let docroot = tenant.map_or(&self.docroot, |tenant| &tenant.docroot);
+    let request = rewriter
+      .rewrite_request(request, docroot)
+      .map_err(|e| EmbedRequestError::RequestRewriteError(e.to_string()))?;
+
+    if let (Some(cache), Some(key)) = (&self.rewrite_cache, key) {
+      // Header rewriters are replayed along with the method and URI
+      let headers = original_headers
+        .filter(|original| original != request.headers())
+        .map(|_| request.headers().clone());
+      cache.insert(
+        key,
+        (request.method().clone(), request.uri().clone(), headers),
+      );
+    }
+
+    Ok(request)
+  }
+
+  // Resolve the script for a request path, consulting the path cache first.
+  // Only scripts which were found are cached, so a new script is served as
+  // soon as it exists.
+  fn translate_path(
+    &self,
+    tenant: Option<&Tenant>,
+    request_path: &str,
+  ) -> Result<PathBuf, EmbedRequestError> {
+    let (docroot, path_cache) = match tenant {
+      Some(tenant) => (&tenant.docroot, &tenant.path_cache),
+      None => (&self.docroot, &self.path_cache),
+    };
+
+    match path_cache {
+      Some(cache) => {
+        cache.get_or_try_insert_with(request_path, || translate_path(docroot, request_path))
+      }
+      None => translate_path(docroot, request_path),
+    }
+  }
+
+  // Serve the static file a request resolves to, if it is for one.
+  async fn serve_static(&self, request: &Request, tenant: Option<&Tenant>) -> Option<Response> {
+    let files = self.static_files.as_ref()?;
+    let request_path = request.uri().path();
+    let request_path = tenant.map_or(request_path, |tenant| tenant.script_path(request_path));
+    if !files.accepts(request.method(), request_path) {
+      return None;
+    }
+
+    let docroot = tenant.map_or(&self.docroot, |tenant| &tenant.docroot);
+    let file = self.translate_path(tenant, request_path).ok()?;
+    files.serve(request, docroot, file).await
+  }
+
+  fn resolve_scripts<P>(&self, scripts: &[P]) -> Vec<PathBuf>
+  where
+    P: AsRef<Path>,
+  {
+    scripts
+      .iter()
+      .map(|script| self.docroot.join(script))
+      .collect()
+  }
+
   /// Get the docroot used for this Embed instance
   ///
   /// # Examples
@@ -222,7 +741,8 @@ impl Handler for Embed {
   /// Handles an HTTP request with streaming response.
   ///
   /// Returns immediately after headers are sent, with body chunks streaming asynchronously.
-  /// Buffering is handled externally by NAPI Task compute() methods when needed.
+  /// Requests carrying a [`BufferedResponse`] extension instead resolve once the
+  /// script has finished, with the whole body in a `BodyBuffer` extension.
   ///
   /// # Examples
   ///
@@ -272,210 +792,370 @@ impl Handler for Embed {
   /// drop(handler);
   /// # });
   /// ```
-  /// Handle a PHP request with streaming response.
-  ///
-  /// Returns immediately after headers are sent, with body chunks streaming asynchronously.
-  /// All buffering is external to this method, handled by NAPI Task compute() methods.
   async fn handle(&self, request: Request) -> Result<Response, Self::Error> {
-    use tokio::sync::oneshot;
+    let timing = RequestTiming::new();
 
     // Get REQUEST_URI _first_ as it needs the pre-rewrite state.
-    let uri = request.uri().clone();
-    let request_uri_str = uri.path().to_string();
+    let original_uri = request.uri().clone();
+
+    // Tenants are routed by the request as it arrived, and then rewrite and
+    // resolve scripts against their own docroot.
+    let tenant = tenant::route(&self.tenants, &request);
+    let permit = tenant.map(Tenant::admit).transpose()?;
 
     // Apply request rewriting rules
-    let request = if let Some(rewriter) = &self.rewriter {
-      rewriter
-        .rewrite_request(request, &self.docroot)
-        .map_err(|e| EmbedRequestError::RequestRewriteError(e.to_string()))?
-    } else {
-      request
+    let request = self.rewrite(request, tenant)?;
+    let translating = timing.record_since(Phase::Rewrite, timing.started());
+
+    // Assets are answered here without waiting for a worker
+    if let Some(mut response) = self.serve_static(&request, tenant).await {
+      timing.record_since(Phase::TranslatePath, translating);
+      self.metrics.record_static_file();
+      response.extensions_mut().insert(timing);
+      return Ok(response);
+    }
+
+    // Translate path on async thread. In worker mode every request is served
+    // by the worker script, so there is no file to resolve.
+    let docroot = tenant
+      .map_or(&self.docroot, |tenant| &tenant.docroot)
+      .clone();
+    let path_translated = match &self.worker_script {
+      Some(script) => script.clone(),
+      None => {
+        let request_path = request.uri().path();
+        let request_path = tenant.map_or(request_path, |tenant| tenant.script_path(request_path));
+        self
+          .translate_path(tenant, request_path)
+          .inspect_err(|err| self.metrics.record_error(err))?
+      }
     };
+    let queued_at = timing.record_since(Phase::TranslatePath, translating);
+
+    let request_ini = request.extensions().get::<RequestIni>().cloned();
+    let buffered = request.extensions().get::<BufferedResponse>().is_some();
+    let instance_ini = self.request_ini.clone();
+    let tenant_ini = tenant.map(|tenant| tenant.request_ini.clone());
+    let sessions = self.sessions.clone();
+    let functions = self.functions.clone();
+    let request_timeout = self.request_timeout;
+    let profiler = self.profiler.clone();
+    let abort = request.extensions().get::<RequestAbort>().cloned();
 
-    // Clone headers as owned HashMap
-    let headers_map: std::collections::HashMap<String, String> = request
+    let content_length = request
       .headers()
-      .iter()
-      .filter_map(|(k, v)| {
-        v.to_str()
-          .ok()
-          .map(|val| (k.as_str().to_string(), val.to_string()))
+      .get(http_handler::header::CONTENT_LENGTH)
+      .and_then(|value| value.to_str().ok())
+      .and_then(|value| value.parse::<i64>().ok())
+      .or_else(|| {
+        // A fully buffered body has a known length even without the header
+        request
+          .extensions()
+          .get::<http_handler::BodyBuffer>()
+          .filter(|body| !body.is_empty())
+          .map(|body| body.len() as i64)
       })
-      .collect();
-
-    // Translate path on async thread
-    let docroot = self.docroot.clone();
-    let translated_path_str = translate_path(&docroot, request.uri().path())?
-      .display()
-      .to_string();
-
-    // Extract request method, query string, and headers
-    let method_str = request.method().as_str().to_string();
-    let query_str = uri.query().unwrap_or("").to_string();
-
-    // Extract content-type and content-length as owned strings before spawn_blocking
-    let content_type_str = headers_map
-      .get("content-type")
-      .or_else(|| headers_map.get("Content-Type"))
-      .cloned();
-
-    let content_length = headers_map
-      .get("content-length")
-      .or_else(|| headers_map.get("Content-Length"))
-      .and_then(|s| s.parse::<i64>().ok())
       .unwrap_or(-1); // -1 means unknown length for streaming requests
 
-    // Clone args as owned Strings to send to blocking thread
-    let args: Vec<String> = self.args.iter().map(|s| s.to_string()).collect();
+    // Everything else the SAPI needs is read from the request itself once it
+    // reaches the worker, so nothing is copied here.
+    let info = RequestInfo {
+      original_uri,
+      path_translated,
+      content_length,
+      args: self.args.clone(),
+    };
 
     // Create streaming response body
     let response_body = request.body().create_response();
     let response_writer = response_body.clone();
 
-    // Channel to receive headers + status + custom headers + logs when ready (send owned data)
-    let (headers_sent_tx, headers_sent_rx) =
-      oneshot::channel::<(u16, String, Vec<(String, String)>, bytes::Bytes)>();
+    // Channel to receive the status, headers and logs once PHP sends headers
+    let (headers_sent_tx, headers_sent_rx) = oneshot::channel::<SentHeaders>();
+    let (body_tx, body_rx) = oneshot::channel::<(bytes::Bytes, Result<(), EmbedRequestError>)>();
 
-    // CRITICAL: Clone Arc<Sapi> to keep it alive while the blocking task runs.
-    // If Embed is dropped before the blocking task completes, we need to prevent
+    // CRITICAL: Clone Arc<Sapi> to keep it alive while the PHP task runs.
+    // If Embed is dropped before the task completes, we need to prevent
     // Sapi::drop() from calling tsrm_shutdown() while PHP operations are in progress.
     let sapi = self.sapi.clone();
+    let output_buffer_size = self.output_buffer_size;
+    let worker_timing = timing.clone();
+    let metrics = self.metrics.clone();
+    let jit = self.jit;
 
-    // Spawn blocking PHP execution - ALL PHP operations happen here
-    let blocking_handle = tokio::task::spawn_blocking(move || {
-      // Keep sapi alive for the duration of the blocking task
-      let _sapi = sapi;
-
-      // Initialize thread-local storage for this worker thread.
-      // This calls ext_php_rs_sapi_per_thread_init() -> ts_resource(0) which sets up
-      // PHP's thread-local storage for the current thread.
-      //
-      // NOTE: php_module_startup() is called ONCE on the main thread when Sapi is created.
-      // Worker threads only need per-thread TLS initialization via ThreadScope, NOT
-      // another php_module_startup call. Calling php_module_startup from multiple threads
-      // concurrently corrupts global state (memory allocator function pointers).
-      let _thread_scope = ThreadScope::new();
-
-      // Setup RequestContext (always streaming from SAPI perspective)
-      // RequestContext::new() will extract the request body's read stream and add it as RequestStream extension
-      let ctx = RequestContext::new(
-        request,
-        docroot.clone(),
-        response_writer.clone(),
-        headers_sent_tx,
-      );
-      RequestContext::set_current(Box::new(ctx));
-
-      // All estrdup calls happen here, inside spawn_blocking, after ThreadScope::new()
-      // has initialized PHP's thread-local storage. These will be freed by efree in
-      // sapi_module_deactivate during request shutdown.
-      let request_uri_c = estrdup(request_uri_str);
-      let path_translated = estrdup(translated_path_str.clone());
-      let request_method = estrdup(method_str);
-      let query_string = estrdup(query_str);
-      let content_type = content_type_str
-        .map(estrdup)
-        .unwrap_or(std::ptr::null_mut());
+    // Queue PHP execution on the worker pool - ALL PHP operations happen there.
+    //
+    // NOTE: php_module_startup() is called ONCE on the main thread when Sapi is created.
+    // Each worker thread initializes its thread-local storage once via ThreadScope when
+    // the pool starts, NOT per request. Calling php_module_startup from multiple threads
+    // concurrently corrupts global state (memory allocator function pointers).
+    let task_rx = self
+      .pool
+      .admit(move || {
+        // Keep sapi alive for the duration of the task
+        let _sapi = sapi;
+        // Count against the tenant's limit until the script has finished
+        let _permit = permit;
 
-      // Prepare argv pointers
-      let argc = args.len() as i32;
-      let mut argv_ptrs: Vec<*mut c_char> = args.iter().map(|s| estrdup(s.as_str())).collect();
+        let timing = worker_timing;
+        timing.record_since(Phase::QueueWait, queued_at);
+        if let Some(thread_init) = pool::take_thread_init() {
+          timing.record(Phase::ThreadInit, thread_init);
+        }
+        if let Some(queue_wait) = timing.get(Phase::QueueWait) {
+          metrics.queue_wait.observe(queue_wait);
+        }
 
-      // Set SAPI globals BEFORE php_request_startup since PHP reads these during initialization
-      {
-        let mut globals = SapiGlobals::get_mut();
-
-        // Reset state
-        globals.options |= ext_php_rs::ffi::SAPI_OPTION_NO_CHDIR as i32;
-        globals.request_info.proto_num = 110;
-        globals.request_info.argc = argc;
-        globals.request_info.argv = argv_ptrs.as_mut_ptr();
-        globals.request_info.headers_read = false;
-        globals.sapi_headers.http_response_code = 200;
-
-        // Set request info from request
-        globals.request_info.request_method = request_method;
-        globals.request_info.query_string = query_string;
-        globals.request_info.path_translated = path_translated;
-        globals.request_info.request_uri = request_uri_c;
-
-        // TODO: Add auth fields
-
-        globals.request_info.content_type = content_type;
-        globals.request_info.content_length = content_length;
-      }
+        // Setup RequestContext (always streaming from SAPI perspective)
+        // RequestContext::new() will extract the request body's read stream and add it as RequestStream extension
+        let mut ctx = RequestContext::new(
+          request,
+          docroot.clone(),
+          response_writer.clone(),
+          headers_sent_tx,
+        );
+        if buffered {
+          ctx.extensions_mut().insert(CapturedOutput::take());
+        } else if output_buffer_size > 0 {
+          ctx
+            .extensions_mut()
+            .insert(OutputBuffer::new(output_buffer_size));
+        }
+        ctx.extensions_mut().insert(timing.clone());
+        ctx.extensions_mut().insert(metrics.clone());
+        if let Some(sessions) = sessions {
+          ctx.extensions_mut().insert(sessions);
+        }
+        if let Some(functions) = functions {
+          ctx.extensions_mut().insert(functions);
+        }
+        RequestContext::set_current(Box::new(ctx));
 
-      let result = try_catch_first(|| {
-        let _request_scope = RequestScope::new()?;
+        // Strings are copied into this worker's request string arena, which is
+        // reset in sapi_module_deactivate during request shutdown.
+        info.apply();
 
-        // Execute PHP script
-        {
-          let mut file_handle = FileHandleScope::new(translated_path_str.clone());
-          try_catch(std::panic::AssertUnwindSafe(|| unsafe {
-            php_execute_script(file_handle.deref_mut())
-          }))
-          .map_err(|_| EmbedRequestError::Bailout)?;
-        }
+        // Tenant INI goes on top of the instance's own, and request INI on top
+        // of both. Nothing is allocated when none have any settings.
+        let ini: Vec<(&str, &str)> = instance_ini
+          .iter()
+          .chain(tenant_ini.iter().flat_map(|ini| ini.iter()))
+          .chain(request_ini.iter().flat_map(|ini| ini.0.iter()))
+          .map(|(name, value)| (name.as_str(), value.as_str()))
+          .collect();
 
-        // Handle exceptions
-        if let Some(err) = ExecutorGlobals::take_exception() {
-          let ex = Error::Exception(err);
-          return Err(EmbedRequestError::Exception(ex.to_string()));
-        }
+        // The timeout counts from here, after waiting in the queue
+        let deadline = Deadline::arm(request_timeout, abort);
+        let sampling = profiler.as_ref().and_then(Profiler::start);
 
-        Ok(())
-        // RequestScope drops here, triggering request shutdown
-        // Output buffering flush happens during shutdown, calling ub_write
-        // RequestContext must still be alive at this point!
-      });
+        // In worker mode this job runs inside php_node_handle_request(), so the
+        // request is dispatched to the worker script's handler instead.
+        let result = match worker::current_handler() {
+          Some(handler) => worker::dispatch(handler, &ini, &timing),
+          None => execute_script(&info.path_translated, &ini, &timing),
+        };
+        drop(sampling);
+        let result = match deadline {
+          Some(deadline) => deadline.result(result),
+          None => result,
+        };
 
-      // Reclaim RequestContext AFTER RequestScope has dropped
-      // This ensures output buffer flush during shutdown can still access the context
-      // Note: reclaim() also shuts down the response stream to signal EOF to consumers
-      let _ctx = RequestContext::reclaim();
+        metrics.record_result(&result);
+        metrics.request_duration.observe(timing.started().elapsed());
+        metrics.record_memory_peak(pool::worker_index(), take_memory_peak());
+        metrics.record_memory_retained(pool::worker_index(), memory_retained());
 
-      // Flatten the result
-      match result {
-        Ok(Ok(())) => Ok(()),
-        Ok(Err(e)) => Err(e),
-        Err(_) => Err(EmbedRequestError::Bailout),
-      }
-    });
+        // All output has been flushed by request shutdown
+        if buffered {
+          let body = RequestContext::current()
+            .and_then(|ctx| ctx.take_captured_output())
+            .unwrap_or_default();
+          let _ = body_tx.send((body, result.clone()));
+        }
 
-    // Wait for headers to be sent (with owned status, mimetype, custom headers, and logs)
-    // The JavaScript code should call req.end() concurrently using Promise.all to avoid deadlock
-    let (status, mime_str, custom_headers, logs) = headers_sent_rx
-      .await
-      .map_err(|_| EmbedRequestError::ResponseBuildError)?;
+        // Reclaim RequestContext AFTER RequestScope has dropped
+        // This ensures output buffer flush during shutdown can still access the context
+        // Note: reclaim() also shuts down the response stream to signal EOF to consumers
+        let _ctx = RequestContext::reclaim();
 
-    // Build response with headers and streaming body (on async thread, using owned data)
-    let mut builder = http_handler::response::Builder::new()
-      .status(status)
-      .header("Content-Type", mime_str);
+        // Refreshed here rather than by a job of its own, so reading metrics
+        // never competes with requests for the queue
+        if jit && metrics.claim_jit_refresh() {
+          if let Ok(Some(status)) = opcache::jit_status() {
+            metrics.record_jit(&status);
+          }
+        }
 
-    // Add custom headers from PHP header() calls
-    for (name, value) in custom_headers {
-      builder = builder.header(name, value);
-    }
+        result
+      })
+      .await?;
 
-    let mut response = builder
+    // Wait for headers to be sent (with owned status, headers and logs)
+    // The JavaScript code should call req.end() concurrently using Promise.all to avoid deadlock
+    // If the task ended without sending headers, such as when it timed out in
+    // the queue, report why rather than a generic build error.
+    let sent = match headers_sent_rx.await {
+      Ok(headers) => headers,
+      Err(_) => {
+        return Err(match task_rx.await {
+          Ok(Err(err)) => err,
+          _ => EmbedRequestError::ResponseBuildError,
+        })
+      }
+    };
+
+    // Build response with streaming body, taking over the headers PHP built
+    let mut response = http_handler::response::Builder::new()
+      .status(sent.status)
       .body(response_body)
       .map_err(|_| EmbedRequestError::ResponseBuildError)?;
+    *response.headers_mut() = sent.headers;
 
     // Store logs in extensions for streaming mode (available but not streamed)
-    if !logs.is_empty() {
+    if let Some(log) = sent.log {
+      response.extensions_mut().insert(log);
+    }
+
+    response.extensions_mut().insert(timing);
+
+    // The script may still be running after sending headers, so wait for the
+    // body it collected and how it ended. A script which failed after sending
+    // headers keeps its partial body, with the error as a ResponseException.
+    if buffered {
+      let (body, result) = body_rx.await.unwrap_or_else(|_| {
+        (
+          bytes::Bytes::new(),
+          Err(EmbedRequestError::ResponseBuildError),
+        )
+      });
       response
         .extensions_mut()
-        .insert(http_handler::ResponseLog::from_bytes(logs));
+        .insert(http_handler::BodyBuffer::from_bytes(body));
+      if let Err(err) = result {
+        response
+          .extensions_mut()
+          .insert(http_handler::ResponseException(err.to_string()));
+      }
+      return Ok(response);
     }
 
-    // Store the blocking task handle to keep it alive while response is consumed
+    // Store the task handle so consumers can observe when the script completes
     response
       .extensions_mut()
       .insert(BlockingTaskHandle(Arc::new(tokio::sync::Mutex::new(Some(
-        blocking_handle,
+        task_rx,
       )))));
 
     Ok(response)
   }
 }
+
+// Request metadata resolved on the async side before the request is queued.
+struct RequestInfo {
+  // REQUEST_URI and QUERY_STRING describe the request before rewriting.
+  original_uri: http_handler::Uri,
+  path_translated: PathBuf,
+  content_length: i64,
+  args: Arc<[String]>,
+}
+
+impl RequestInfo {
+  // Fill in the SAPI request info from this and the current RequestContext,
+  // borrowing each value straight from the request. Must be called before
+  // php_request_startup since PHP reads these during initialization.
+  //
+  // The strings are carved from this thread's request string arena, which
+  // sapi_module_deactivate resets in one go when the request ends.
+  fn apply(&self) {
+    use std::os::unix::ffi::OsStrExt;
+
+    let Some(ctx) = RequestContext::current() else {
+      return;
+    };
+
+    with_request_strings(|arena| {
+      let (argc, argv) = arena.alloc_argv(&self.args);
+
+      let content_type = ctx
+        .headers()
+        .get(http_handler::header::CONTENT_TYPE)
+        .map(|value| arena.alloc_str(value.as_bytes()))
+        .unwrap_or(std::ptr::null_mut());
+
+      let mut globals = SapiGlobals::get_mut();
+
+      // Reset state
+      globals.options |= ext_php_rs::ffi::SAPI_OPTION_NO_CHDIR as i32;
+      globals.request_info.proto_num = 110;
+      globals.request_info.argc = argc;
+      globals.request_info.argv = argv;
+      globals.request_info.headers_read = false;
+      globals.sapi_headers.http_response_code = 200;
+
+      // Set request info from request
+      globals.request_info.request_method = arena.alloc_str(ctx.method().as_str().as_bytes());
+      globals.request_info.query_string =
+        arena.alloc_str(self.original_uri.query().unwrap_or("").as_bytes());
+      globals.request_info.path_translated =
+        arena.alloc_str(self.path_translated.as_os_str().as_bytes());
+      globals.request_info.request_uri = arena.alloc_str(self.original_uri.path().as_bytes());
+
+      // TODO: Add auth fields
+
+      globals.request_info.content_type = content_type;
+      globals.request_info.content_length = self.content_length;
+    });
+  }
+}
+
+/// Run a script in a fresh PHP request on the current worker thread.
+///
+/// The RequestContext and SAPI request info must be set up beforehand.
+fn execute_script(
+  path_translated: &Path,
+  ini: &[(&str, &str)],
+  timing: &RequestTiming,
+) -> Result<(), EmbedRequestError> {
+  let result = try_catch_first(|| {
+    let starting = Instant::now();
+    let request_scope = RequestScope::new()?;
+    let executing = timing.record_since(Phase::RequestStartup, starting);
+
+    let result = (|| {
+      ini::apply(ini.iter().copied())?;
+
+      // Execute PHP script
+      {
+        let mut file_handle = FileHandleScope::new(path_translated);
+        try_catch(std::panic::AssertUnwindSafe(|| unsafe {
+          php_execute_script(file_handle.deref_mut())
+        }))
+        .map_err(|_| EmbedRequestError::Bailout)?;
+      }
+
+      // Handle exceptions
+      if let Some(err) = ExecutorGlobals::take_exception() {
+        let ex = Error::Exception(err);
+        return Err(EmbedRequestError::Exception(ex.to_string()));
+      }
+
+      Ok(())
+    })();
+    let shutting_down = timing.record_since(Phase::Execute, executing);
+
+    // Dropping the RequestScope triggers request shutdown. Output buffering
+    // flush happens during shutdown, calling ub_write, so the RequestContext
+    // must still be alive at this point!
+    drop(request_scope);
+    timing.record_since(Phase::RequestShutdown, shutting_down);
+
+    result
+  });
+
+  // Flatten the result
+  match result {
+    Ok(Ok(())) => Ok(()),
+    Ok(Err(e)) => Err(e),
+    Err(_) => Err(EmbedRequestError::Bailout),
+  }
+}
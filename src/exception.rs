@@ -9,6 +9,35 @@ pub enum EmbedStartError {
 
   /// Failed to initialize SAPI
   SapiNotInitialized,
+
+  /// Failed to start the PHP worker threads
+  WorkerPoolNotStarted,
+
+  /// Worker script not found in the document root
+  WorkerScriptNotFound(String),
+
+  /// Startup INI entries contain a nul byte, or a name or value which cannot
+  /// be represented in INI syntax
+  InvalidIniEntries,
+
+  /// A SAPI is already running with different startup INI entries
+  SapiConfigConflict,
+
+  /// The SAPI was kept resident with different startup INI entries, which
+  /// can not change for the rest of the process
+  ResidentConfigConflict,
+
+  /// Failed to start the shared tokio runtime
+  RuntimeNotStarted,
+
+  /// The shared tokio runtime is already running with different options
+  RuntimeConfigConflict,
+
+  /// A tenant has an invalid route, or tenants were used in worker mode
+  InvalidTenant(String),
+
+  /// A session store was given but PHP was built without sessions
+  SessionsUnavailable,
 }
 
 impl std::fmt::Display for EmbedStartError {
@@ -21,12 +50,35 @@ impl std::fmt::Display for EmbedStartError {
         write!(f, "Failed to identify executable location")
       }
       EmbedStartError::SapiNotInitialized => write!(f, "Failed to initialize SAPI"),
+      EmbedStartError::WorkerPoolNotStarted => write!(f, "Failed to start PHP worker threads"),
+      EmbedStartError::WorkerScriptNotFound(script) => {
+        write!(f, "Worker script not found: {}", script)
+      }
+      EmbedStartError::InvalidIniEntries => write!(f, "Invalid startup INI entries"),
+      EmbedStartError::SapiConfigConflict => write!(
+        f,
+        "PHP is already running with different startup INI settings"
+      ),
+      EmbedStartError::ResidentConfigConflict => write!(
+        f,
+        "PHP was kept running with different startup INI settings, which can not change until the process exits"
+      ),
+      EmbedStartError::RuntimeNotStarted => write!(f, "Failed to start tokio runtime"),
+      EmbedStartError::RuntimeConfigConflict => write!(
+        f,
+        "The tokio runtime is already running with different options"
+      ),
+      EmbedStartError::InvalidTenant(reason) => write!(f, "Invalid tenant: {}", reason),
+      EmbedStartError::SessionsUnavailable => write!(
+        f,
+        "PHP was built without the session extension, so sessions cannot be stored"
+      ),
     }
   }
 }
 
 /// Errors which may occur during the request lifecycle
-#[derive(Debug, PartialEq, Eq, Hash)]
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
 pub enum EmbedRequestError {
   /// SAPI not started
   SapiNotStarted,
@@ -76,6 +128,30 @@ pub enum EmbedRequestError {
 
   /// Error handling request body stream
   RequestBodyError(String),
+
+  /// No PHP worker thread is available to run the request
+  WorkerUnavailable,
+
+  /// The worker queue is full and the request was shed
+  ServiceUnavailable,
+
+  /// The request waited longer than the queue timeout for a worker
+  QueueTimeout,
+
+  /// PHP does not know an INI setting, or refused to change it at runtime
+  IniRejected(String),
+
+  /// The tenant serving the request already has its most requests in flight
+  TenantLimitReached,
+
+  /// The script was stopped for running longer than the request timeout
+  DeadlineExceeded,
+
+  /// The script was stopped because the caller aborted the request
+  Aborted,
+
+  /// The OPcache JIT was requested but PHP could not enable it
+  JitUnavailable,
 }
 
 impl std::fmt::Display for EmbedRequestError {
@@ -114,6 +190,19 @@ impl std::fmt::Display for EmbedRequestError {
       EmbedRequestError::RequestBodyError(e) => {
         write!(f, "Request body error: {}", e)
       }
+      EmbedRequestError::WorkerUnavailable => write!(f, "No PHP worker available"),
+      EmbedRequestError::ServiceUnavailable => write!(f, "PHP worker queue is full"),
+      EmbedRequestError::QueueTimeout => write!(f, "Timed out waiting for a PHP worker"),
+      EmbedRequestError::IniRejected(name) => {
+        write!(f, "PHP rejected INI setting: \"{}\"", name)
+      }
+      EmbedRequestError::TenantLimitReached => write!(f, "Too many requests for this application"),
+      EmbedRequestError::DeadlineExceeded => write!(f, "Request exceeded its deadline"),
+      EmbedRequestError::Aborted => write!(f, "Request was aborted"),
+      EmbedRequestError::JitUnavailable => write!(
+        f,
+        "The OPcache JIT could not be enabled, PHP may be built without JIT support"
+      ),
     }
   }
 }
@@ -2,10 +2,18 @@
 ///
 /// These extensions store request-specific state that needs to be shared
 /// across SAPI callbacks and async boundaries.
-use bytes::Bytes;
+use bytes::{Bytes, BytesMut};
 use http_handler::ResponseBody;
-use std::sync::Arc;
-use tokio::sync::{oneshot, Mutex};
+use std::{
+  cell::RefCell,
+  fmt::Write,
+  sync::{
+    atomic::{AtomicBool, AtomicU64, Ordering},
+    Arc,
+  },
+  time::{Duration, Instant},
+};
+use tokio::sync::Notify;
 
 /// Extension for storing the response body stream
 ///
@@ -20,22 +28,6 @@ impl ResponseStream {
   }
 }
 
-/// Extension for storing the headers sent notification channel
-///
-/// Used to signal when headers are finalized and send them to the response builder.
-/// Contains: (status_code, mime_type, custom_headers, logs)
-#[derive(Clone)]
-pub struct HeadersSentTx(
-  pub Arc<Mutex<Option<oneshot::Sender<(u16, String, Vec<(String, String)>, Bytes)>>>>,
-);
-
-impl HeadersSentTx {
-  /// Create a new HeadersSentTx extension with the given oneshot sender
-  pub fn new(sender: oneshot::Sender<(u16, String, Vec<(String, String)>, Bytes)>) -> Self {
-    Self(Arc::new(Mutex::new(Some(sender))))
-  }
-}
-
 /// Extension for storing the request body stream
 ///
 /// Allows SAPI callbacks to read streaming request body data.
@@ -48,3 +40,335 @@ impl RequestStream {
     Self(body)
   }
 }
+
+/// Extension for storing a fully buffered request body
+///
+/// When present, SAPI callbacks serve the request body straight out of these
+/// bytes, advancing through them as PHP reads, instead of reading the
+/// request stream.
+#[derive(Clone)]
+pub struct BufferedBody(pub Bytes);
+
+impl BufferedBody {
+  /// Create a new BufferedBody extension with the given bytes
+  pub fn new(bytes: Bytes) -> Self {
+    Self(bytes)
+  }
+}
+
+/// Extension for coalescing PHP output before it is written to the response
+/// stream
+///
+/// Output is collected until at least `high_water_mark` bytes are buffered,
+/// so many small writes cost one write to the stream. The allocation is kept
+/// between flushes and reused for the rest of the request.
+pub struct OutputBuffer {
+  buffer: BytesMut,
+  high_water_mark: usize,
+}
+
+impl OutputBuffer {
+  /// Create a new OutputBuffer extension with the given high-water mark
+  pub fn new(high_water_mark: usize) -> Self {
+    Self {
+      buffer: BytesMut::with_capacity(high_water_mark),
+      high_water_mark,
+    }
+  }
+
+  /// Whether a write of `len` bytes should skip the buffer entirely, because
+  /// nothing is buffered and it would reach the high-water mark on its own.
+  pub fn bypass(&self, len: usize) -> bool {
+    self.buffer.is_empty() && len >= self.high_water_mark
+  }
+
+  /// Append output, returning true once the high-water mark is reached.
+  pub fn push(&mut self, bytes: &[u8]) -> bool {
+    self.buffer.extend_from_slice(bytes);
+    self.buffer.len() >= self.high_water_mark
+  }
+
+  /// The currently buffered output.
+  pub fn as_bytes(&self) -> &[u8] {
+    &self.buffer
+  }
+
+  /// Whether any output is buffered.
+  pub fn is_empty(&self) -> bool {
+    self.buffer.is_empty()
+  }
+
+  /// Discard buffered output, keeping the allocation for reuse.
+  pub fn clear(&mut self) {
+    self.buffer.clear();
+  }
+}
+
+/// Extension asking `Embed::handle` to collect the whole response body rather
+/// than streaming it
+///
+/// Output is appended straight into one buffer which is recycled by the
+/// worker thread across requests, skipping the response stream entirely. The
+/// response resolves once the script has finished, with the body in its
+/// `BodyBuffer` extension.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct BufferedResponse;
+
+// Capacity reserved for the output of each buffered request.
+const CAPTURED_OUTPUT_SIZE: usize = 16 * 1024;
+
+// Largest buffer a worker thread keeps for its next buffered request. Larger
+// responses get a buffer of their own rather than pinning one to the thread.
+const CAPTURED_OUTPUT_RETAIN_LIMIT: usize = 1024 * 1024;
+
+thread_local! {
+  // Output buffer recycled between buffered requests on this worker thread.
+  static RECYCLED_OUTPUT: RefCell<BytesMut> = RefCell::new(BytesMut::new());
+}
+
+/// Extension collecting the output of a buffered request
+pub(crate) struct CapturedOutput(pub BytesMut);
+
+impl CapturedOutput {
+  /// Take the output buffer of the current worker thread.
+  ///
+  /// Once the body of the previous request on this thread has been released,
+  /// its allocation is reused here without copying or allocating.
+  pub fn take() -> Self {
+    let mut buffer = RECYCLED_OUTPUT.take();
+    buffer.reserve(CAPTURED_OUTPUT_SIZE);
+    Self(buffer)
+  }
+
+  /// Split off the collected output, handing the rest of the buffer back to
+  /// the worker thread for its next request.
+  pub fn finish(mut self) -> Bytes {
+    let body = self.0.split().freeze();
+    if body.len() <= CAPTURED_OUTPUT_RETAIN_LIMIT {
+      RECYCLED_OUTPUT.set(self.0);
+    }
+    body
+  }
+}
+
+/// Extension for signalling that a request has been aborted by its caller
+///
+/// Writes parked on a slow response consumer are woken when this is aborted,
+/// and any further output from the script is discarded.
+#[derive(Clone, Default)]
+pub struct RequestAbort(Arc<AbortState>);
+
+#[derive(Default)]
+struct AbortState {
+  aborted: AtomicBool,
+  notify: Notify,
+}
+
+impl RequestAbort {
+  /// Create a new RequestAbort extension which has not been aborted
+  pub fn new() -> Self {
+    Self::default()
+  }
+
+  /// Abort the request, waking anything waiting on [`RequestAbort::aborted`]
+  pub fn abort(&self) {
+    self.0.aborted.store(true, Ordering::Release);
+    self.0.notify.notify_waiters();
+  }
+
+  /// Whether the request has been aborted
+  pub fn is_aborted(&self) -> bool {
+    self.0.aborted.load(Ordering::Acquire)
+  }
+
+  /// Wait until the request is aborted
+  pub async fn aborted(&self) {
+    let notified = self.0.notify.notified();
+    let mut notified = std::pin::pin!(notified);
+    notified.as_mut().enable();
+
+    if self.is_aborted() {
+      return;
+    }
+
+    notified.await;
+  }
+}
+
+/// A phase of handling a request, as recorded in [`RequestTiming`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Phase {
+  /// Applying the rewriter to the request.
+  Rewrite,
+  /// Resolving the request path to a script.
+  TranslatePath,
+  /// Waiting in the queue for a free worker.
+  QueueWait,
+  /// Initializing PHP's thread-local storage on the worker. This only happens
+  /// once per worker thread, so it is recorded for the first request on each.
+  ThreadInit,
+  /// Starting the PHP request (`php_request_startup`).
+  RequestStartup,
+  /// Running the script or worker handler.
+  Execute,
+  /// Time from the start of the request until headers were sent.
+  FirstByte,
+  /// Shutting down the PHP request (`php_request_shutdown`).
+  RequestShutdown,
+}
+
+impl Phase {
+  /// Every phase, in the order they happen.
+  pub const ALL: [Phase; 8] = [
+    Phase::Rewrite,
+    Phase::TranslatePath,
+    Phase::QueueWait,
+    Phase::ThreadInit,
+    Phase::RequestStartup,
+    Phase::Execute,
+    Phase::FirstByte,
+    Phase::RequestShutdown,
+  ];
+
+  /// Name of the phase, as used in `Server-Timing` headers.
+  pub fn name(&self) -> &'static str {
+    match self {
+      Phase::Rewrite => "rewrite",
+      Phase::TranslatePath => "translate",
+      Phase::QueueWait => "queue",
+      Phase::ThreadInit => "thread-init",
+      Phase::RequestStartup => "startup",
+      Phase::Execute => "execute",
+      Phase::FirstByte => "first-byte",
+      Phase::RequestShutdown => "shutdown",
+    }
+  }
+}
+
+// Marks a phase which has not been recorded
+const UNRECORDED: u64 = u64::MAX;
+
+/// Extension for recording how long each phase of a request took
+///
+/// Set on the response by `Embed::handle`. Phases up to and including
+/// [`Phase::FirstByte`] are recorded by the time the response is returned,
+/// later ones once the script has finished and the response body has ended.
+///
+/// # Examples
+///
+/// ```
+/// use std::time::Duration;
+/// use php::{Phase, RequestTiming};
+///
+/// let timing = RequestTiming::new();
+/// timing.record(Phase::QueueWait, Duration::from_micros(1500));
+///
+/// assert_eq!(timing.get(Phase::QueueWait), Some(Duration::from_micros(1500)));
+/// assert_eq!(timing.get(Phase::Execute), None);
+/// assert_eq!(timing.server_timing(), "queue;dur=1.500");
+/// ```
+#[derive(Clone)]
+pub struct RequestTiming(Arc<TimingState>);
+
+struct TimingState {
+  started: Instant,
+  nanos: [AtomicU64; Phase::ALL.len()],
+}
+
+impl RequestTiming {
+  /// Create a new RequestTiming extension for a request starting now
+  pub fn new() -> Self {
+    Self(Arc::new(TimingState {
+      started: Instant::now(),
+      nanos: std::array::from_fn(|_| AtomicU64::new(UNRECORDED)),
+    }))
+  }
+
+  /// When the request started
+  pub fn started(&self) -> Instant {
+    self.0.started
+  }
+
+  /// Record how long a phase took
+  pub fn record(&self, phase: Phase, duration: Duration) {
+    let nanos = (duration.as_nanos() as u64).min(UNRECORDED - 1);
+    self.0.nanos[phase as usize].store(nanos, Ordering::Relaxed);
+  }
+
+  /// Record a phase as having run from `since` until now, returning now so
+  /// the next phase can start from it
+  pub fn record_since(&self, phase: Phase, since: Instant) -> Instant {
+    let now = Instant::now();
+    self.record(phase, now.saturating_duration_since(since));
+    now
+  }
+
+  /// How long a phase took, if it has been recorded
+  pub fn get(&self, phase: Phase) -> Option<Duration> {
+    match self.0.nanos[phase as usize].load(Ordering::Relaxed) {
+      UNRECORDED => None,
+      nanos => Some(Duration::from_nanos(nanos)),
+    }
+  }
+
+  /// Format the recorded phases as a `Server-Timing` header value, with
+  /// durations in milliseconds
+  pub fn server_timing(&self) -> String {
+    let mut header = String::new();
+    for phase in Phase::ALL {
+      if let Some(duration) = self.get(phase) {
+        if !header.is_empty() {
+          header.push_str(", ");
+        }
+        let millis = duration.as_secs_f64() * 1000.0;
+        let _ = write!(header, "{};dur={millis:.3}", phase.name());
+      }
+    }
+    header
+  }
+}
+
+impl Default for RequestTiming {
+  fn default() -> Self {
+    Self::new()
+  }
+}
+
+/// Extension for INI settings to apply to a single request
+///
+/// Applied after the instance's own `request_ini` settings, so these take
+/// precedence over them, and restored when the request ends.
+///
+/// # Examples
+///
+/// ```
+/// use php::RequestIni;
+///
+/// let mut request = http_handler::request::Request::builder()
+///   .uri("http://example.com/report.php")
+///   .body(http_handler::RequestBody::new())
+///   .expect("should build request");
+///
+/// request
+///   .extensions_mut()
+///   .insert(RequestIni::new([("memory_limit", "512M")]));
+/// ```
+#[derive(Clone, Debug, Default)]
+pub struct RequestIni(pub Vec<(String, String)>);
+
+impl RequestIni {
+  /// Create a new RequestIni extension with the given settings
+  pub fn new<I, K, V>(settings: I) -> Self
+  where
+    I: IntoIterator<Item = (K, V)>,
+    K: Into<String>,
+    V: Into<String>,
+  {
+    Self(
+      settings
+        .into_iter()
+        .map(|(name, value)| (name.into(), value.into()))
+        .collect(),
+    )
+  }
+}
@@ -0,0 +1,183 @@
+//! Calling functions of the embedding application from PHP.
+//!
+//! Scripts call `node_call($name, $payload)` to run a function given in
+//! [`EmbedOptions::functions`](crate::EmbedOptions::functions), such as one
+//! reaching a service the application already has a client for. The worker
+//! waits for the result like it waits for request and response body I/O, so
+//! the call should be quick to answer or the pool sized for it.
+
+use std::sync::Arc;
+
+use ext_php_rs::types::{ZendHashTable, Zval};
+
+use crate::{options::Shared, RequestContext};
+
+// Deepest nesting of arrays converted in either direction, which also stops
+// converting self-referencing values.
+const MAX_DEPTH: usize = 64;
+
+/// A value passed between PHP and the embedding application.
+///
+/// PHP lists become arrays, and other PHP arrays and objects become objects
+/// with their keys in order. Objects come back to PHP as associative arrays,
+/// as from `json_decode($json, true)`.
+#[derive(Debug, Clone, PartialEq)]
+pub enum HostValue {
+  /// `null`, also used for PHP values which can not be converted.
+  Null,
+  /// A boolean.
+  Bool(bool),
+  /// An integer.
+  Int(i64),
+  /// A float.
+  Float(f64),
+  /// A string. PHP strings which are not valid UTF-8 are converted lossily.
+  String(String),
+  /// A list of values.
+  Array(Vec<HostValue>),
+  /// Keyed values, in order.
+  Object(Vec<(String, HostValue)>),
+}
+
+/// Functions scripts may call through `node_call()`.
+///
+/// Calls are made from the PHP worker threads and block the script until
+/// they return. Errors are thrown in the script as exceptions.
+pub trait HostFunctions: Send + Sync {
+  /// Run the function called `name`.
+  fn call(&self, name: &str, payload: HostValue) -> Result<HostValue, String>;
+}
+
+impl<F> HostFunctions for F
+where
+  F: Fn(&str, HostValue) -> Result<HostValue, String> + Send + Sync,
+{
+  fn call(&self, name: &str, payload: HostValue) -> Result<HostValue, String> {
+    self(name, payload)
+  }
+}
+
+/// Functions of the embedding application available to PHP.
+///
+/// # Examples
+///
+/// ```
+/// use php::{EmbedOptions, Functions, HostValue};
+///
+/// let functions = Functions::new(|name: &str, payload: HostValue| match name {
+///   "echo" => Ok(payload),
+///   _ => Err(format!("Unknown function: {name}")),
+/// });
+///
+/// let options = EmbedOptions {
+///   functions: Some(functions),
+///   ..Default::default()
+/// };
+/// ```
+#[derive(Clone, PartialEq, Eq)]
+pub struct Functions(pub(crate) Shared<dyn HostFunctions>);
+
+impl Functions {
+  /// Make the given functions available.
+  pub fn new<F: HostFunctions + 'static>(functions: F) -> Self {
+    Self(Shared(Arc::new(functions)))
+  }
+}
+
+impl std::fmt::Debug for Functions {
+  fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+    f.debug_struct("Functions").finish_non_exhaustive()
+  }
+}
+
+/// Implementation of `node_call()`.
+pub(crate) fn call(name: &str, payload: Option<&Zval>) -> Result<Zval, String> {
+  let functions = RequestContext::current()
+    .and_then(|ctx| ctx.extensions().get::<Functions>().cloned())
+    .ok_or("No functions are available to this request")?;
+
+  let payload = payload.map_or(HostValue::Null, |zv| from_zval(zv, 0));
+  let result = functions.0.call(name, payload)?;
+
+  into_zval(result, 0)
+}
+
+fn from_zval(zv: &Zval, depth: usize) -> HostValue {
+  if let Some(value) = zv.bool() {
+    return HostValue::Bool(value);
+  }
+  if zv.is_long() {
+    return zv.long().map_or(HostValue::Null, HostValue::Int);
+  }
+  if zv.is_double() {
+    return zv.double().map_or(HostValue::Null, HostValue::Float);
+  }
+  if let Some(value) = zv.zend_str() {
+    return HostValue::String(String::from_utf8_lossy(value.as_bytes()).into_owned());
+  }
+  if depth >= MAX_DEPTH {
+    return HostValue::Null;
+  }
+
+  let table = match (zv.array(), zv.object()) {
+    (Some(array), _) => array,
+    (None, Some(object)) => match object.get_properties() {
+      Ok(properties) => properties,
+      Err(_) => return HostValue::Null,
+    },
+    (None, None) => return HostValue::Null,
+  };
+
+  if zv.is_array() && table.has_sequential_keys() {
+    return HostValue::Array(
+      table
+        .values()
+        .map(|value| from_zval(value, depth + 1))
+        .collect(),
+    );
+  }
+
+  HostValue::Object(
+    table
+      .iter()
+      .map(|(key, value)| (key.to_string(), from_zval(value, depth + 1)))
+      .collect(),
+  )
+}
+
+fn into_zval(value: HostValue, depth: usize) -> Result<Zval, String> {
+  if depth >= MAX_DEPTH {
+    return Err("Result is nested too deeply".into());
+  }
+
+  let mut zv = Zval::new();
+  match value {
+    HostValue::Null => zv.set_null(),
+    HostValue::Bool(value) => zv.set_bool(value),
+    HostValue::Int(value) => zv.set_long(value),
+    HostValue::Float(value) => zv.set_double(value),
+    HostValue::String(value) => zv
+      .set_string(&value, false)
+      .map_err(|err| err.to_string())?,
+    HostValue::Array(values) => {
+      let mut table = ZendHashTable::with_capacity(values.len() as u32);
+      for value in values {
+        table
+          .push(into_zval(value, depth + 1)?)
+          .map_err(|err| err.to_string())?;
+      }
+      zv.set_hashtable(table);
+    }
+    HostValue::Object(entries) => {
+      let mut table = ZendHashTable::with_capacity(entries.len() as u32);
+      for (key, value) in entries {
+        table
+          .insert(key.as_str(), into_zval(value, depth + 1)?)
+          .map_err(|err| err.to_string())?;
+      }
+      zv.set_hashtable(table);
+    }
+  }
+
+  Ok(zv)
+}
@@ -0,0 +1,132 @@
+//! INI overrides, applied either when the engine starts or per request.
+//!
+//! Startup entries are rendered into the SAPI's `ini_entries`, which PHP
+//! parses after `php.ini` and the built-in defaults, so they can change any
+//! setting. Request entries are applied with `zend_alter_ini_entry_chars`
+//! once the request has started, and are restored when it ends.
+
+use std::{
+  collections::BTreeMap,
+  ffi::{c_char, c_int},
+  ops::DerefMut,
+};
+
+use ext_php_rs::{
+  ffi::{zend_alter_ini_entry_chars, zend_restore_ini_entry, ZEND_RESULT_CODE_SUCCESS},
+  types::ZendStr,
+};
+
+use crate::{EmbedRequestError, EmbedStartError};
+
+// Apply overrides with system privileges, as php_admin_value does, during
+// request activation. Settings PHP only allows at startup still reject this.
+const ZEND_INI_SYSTEM: c_int = 1 << 2;
+const ZEND_INI_STAGE_ACTIVATE: c_int = 1 << 2;
+
+/// Render INI settings as startup INI entries, one `name=value` per line.
+///
+/// Values with characters the INI parser treats specially are quoted. Names
+/// and values which could not be represented fail with `InvalidIniEntries`.
+pub(crate) fn startup_entries(ini: &BTreeMap<String, String>) -> Result<String, EmbedStartError> {
+  let mut entries = String::new();
+
+  for (name, value) in ini {
+    let name_ok = !name.is_empty()
+      && name
+        .bytes()
+        .all(|b| b.is_ascii_alphanumeric() || matches!(b, b'.' | b'_' | b'-'));
+    if !name_ok || value.contains(['"', '\n', '\r', '\0']) {
+      return Err(EmbedStartError::InvalidIniEntries);
+    }
+
+    let plain = value
+      .bytes()
+      .all(|b| b.is_ascii_alphanumeric() || matches!(b, b'.' | b'_' | b'-' | b'/' | b':' | b','));
+
+    entries.push_str(name);
+    entries.push('=');
+    if plain {
+      entries.push_str(value);
+    } else {
+      entries.push('"');
+      entries.push_str(value);
+      entries.push('"');
+    }
+    entries.push('\n');
+  }
+
+  Ok(entries)
+}
+
+/// Change INI settings for the current request.
+///
+/// Must be called after the request has started. Fails on the first setting
+/// PHP does not know or refuses to change at runtime.
+pub(crate) fn apply<'a, I>(ini: I) -> Result<(), EmbedRequestError>
+where
+  I: IntoIterator<Item = (&'a str, &'a str)>,
+{
+  for (name, value) in ini {
+    let mut zend_name = ZendStr::new(name, false);
+    let result = unsafe {
+      zend_alter_ini_entry_chars(
+        zend_name.deref_mut(),
+        value.as_ptr() as *const c_char,
+        value.len(),
+        ZEND_INI_SYSTEM,
+        ZEND_INI_STAGE_ACTIVATE,
+      )
+    };
+
+    if result != ZEND_RESULT_CODE_SUCCESS {
+      return Err(EmbedRequestError::IniRejected(name.to_string()));
+    }
+  }
+
+  Ok(())
+}
+
+/// Restore INI settings changed by [`apply`].
+///
+/// Request shutdown does this on its own, this is only needed where a request
+/// ends without it, as in worker mode.
+pub(crate) fn restore<'a, I>(ini: I)
+where
+  I: IntoIterator<Item = (&'a str, &'a str)>,
+{
+  for (name, _) in ini {
+    let mut zend_name = ZendStr::new(name, false);
+    unsafe {
+      zend_restore_ini_entry(zend_name.deref_mut(), ZEND_INI_STAGE_ACTIVATE);
+    }
+  }
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+
+  #[test]
+  fn test_startup_entries() {
+    let ini = BTreeMap::from([
+      ("memory_limit".to_string(), "256M".to_string()),
+      (
+        "error_log".to_string(),
+        "/var/log/php errors.log".to_string(),
+      ),
+    ]);
+
+    assert_eq!(
+      startup_entries(&ini).expect("should render entries"),
+      "error_log=\"/var/log/php errors.log\"\nmemory_limit=256M\n"
+    );
+  }
+
+  #[test]
+  fn test_invalid_startup_entries() {
+    for (name, value) in [("memory_limit", "1\n2"), ("a=b", "1"), ("", "1")] {
+      let ini = BTreeMap::from([(name.to_string(), value.to_string())]);
+      assert!(startup_entries(&ini).is_err());
+    }
+  }
+}
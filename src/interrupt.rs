@@ -0,0 +1,131 @@
+//! The VM interrupt hook shared by request deadlines and the profiler.
+//!
+//! Other threads can not safely touch a running script, so they raise the
+//! worker thread's `EG(vm_interrupt)` flag instead. The VM checks that flag
+//! at function calls and loop back-edges, and then calls the
+//! `zend_interrupt_function` hook installed here on the worker thread
+//! itself, where the script's state may be read or the script stopped.
+
+use std::sync::{
+  atomic::{AtomicBool, Ordering},
+  Mutex, RwLock,
+};
+
+use ext_php_rs::{ffi::zend_execute_data, zend::ExecutorGlobals};
+use tokio::sync::Notify;
+
+use crate::{deadline, profiler};
+
+type InterruptFn = unsafe extern "C" fn(execute_data: *mut zend_execute_data);
+
+extern "C" {
+  static mut zend_interrupt_function: Option<InterruptFn>;
+}
+
+// Hook which was installed before ours, such as by an extension.
+static PREVIOUS: RwLock<Option<InterruptFn>> = RwLock::new(None);
+
+/// Install the interrupt hook.
+///
+/// Called each time the engine has started, as engine startup resets the
+/// hook. Any hook installed by an extension is still called after ours.
+pub(crate) fn register() {
+  unsafe {
+    let installed = zend_interrupt_function;
+    if installed != Some(interrupt as InterruptFn) {
+      *PREVIOUS.write().unwrap_or_else(|e| e.into_inner()) = installed;
+      zend_interrupt_function = Some(interrupt);
+    }
+  }
+}
+
+/// The `EG(vm_interrupt)` flag of a worker thread.
+///
+/// Executor globals live as long as the thread's PHP state, which outlasts
+/// any request on it, so the flag may be raised from any thread while a
+/// request is running.
+pub(crate) struct VmInterrupt(*const AtomicBool);
+
+unsafe impl Send for VmInterrupt {}
+unsafe impl Sync for VmInterrupt {}
+
+impl VmInterrupt {
+  /// The flag of the current worker thread.
+  pub fn current() -> Self {
+    let mut globals = ExecutorGlobals::get_mut();
+    Self(&mut globals.vm_interrupt as *mut _ as *const AtomicBool)
+  }
+
+  /// Ask the VM to call the interrupt hook at its next check.
+  pub fn raise(&self) {
+    unsafe { &*self.0 }.store(true, Ordering::SeqCst);
+  }
+}
+
+/// The VM interrupt of a worker thread, armed for the request running on it.
+///
+/// A task on the async runtime raises the interrupt through it, and the hook
+/// then takes what was raised on the worker thread. Once disarmed at the end
+/// of the request nothing more is raised, and the task is told to stop.
+pub(crate) struct Trigger {
+  vm_interrupt: VmInterrupt,
+  // Held while raising the interrupt, so it can not land on the thread once
+  // the request has moved on.
+  armed: Mutex<bool>,
+  // Set when raised and cleared once taken, so each raise is acted on once
+  // even when the interrupt is raised for something else later.
+  pending: AtomicBool,
+  disarmed: Notify,
+}
+
+impl Trigger {
+  /// Arm the interrupt of the current worker thread.
+  pub fn current() -> Self {
+    Self {
+      vm_interrupt: VmInterrupt::current(),
+      armed: Mutex::new(true),
+      pending: AtomicBool::new(false),
+      disarmed: Notify::new(),
+    }
+  }
+
+  /// Raise the interrupt unless disarmed.
+  pub fn raise(&self) {
+    let armed = self.armed.lock().unwrap_or_else(|e| e.into_inner());
+    if *armed {
+      self.pending.store(true, Ordering::Release);
+      self.vm_interrupt.raise();
+    }
+  }
+
+  /// Whether the interrupt was raised since last taken. Called from the hook.
+  pub fn take(&self) -> bool {
+    self.pending.swap(false, Ordering::Acquire)
+  }
+
+  /// Wait until disarmed.
+  pub async fn disarmed(&self) {
+    self.disarmed.notified().await
+  }
+
+  /// Stop raising the interrupt.
+  pub fn disarm(&self) {
+    *self.armed.lock().unwrap_or_else(|e| e.into_inner()) = false;
+    // Stores a permit, so the task stops even if it was not polled yet
+    self.disarmed.notify_one();
+  }
+}
+
+// Called by the VM on the worker thread once EG(vm_interrupt) was raised.
+// The flag has already been cleared, so one raise may serve several users.
+unsafe extern "C" fn interrupt(execute_data: *mut zend_execute_data) {
+  profiler::sample(execute_data);
+
+  // Does not return when the request must stop
+  deadline::check();
+
+  let previous = *PREVIOUS.read().unwrap_or_else(|e| e.into_inner());
+  if let Some(previous) = previous {
+    previous(execute_data);
+  }
+}
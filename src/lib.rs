@@ -73,14 +73,30 @@
 #[macro_use]
 extern crate napi_derive;
 
+mod backpressure;
+mod cache;
+mod deadline;
 mod embed;
 mod exception;
 mod extensions;
+mod host;
+mod ini;
+mod interrupt;
+mod metrics;
+mod opcache;
+mod options;
+mod pool;
+mod profiler;
 mod request_context;
+mod runtime;
 mod sapi;
 mod scopes;
+mod session;
+mod static_files;
 mod strings;
+mod tenant;
 mod test;
+mod worker;
 
 #[cfg(feature = "napi-support")]
 /// NAPI bindings for exposing PHP to Node.js
@@ -96,8 +112,21 @@ pub use http_handler::{
   Uri as Url,
 };
 
-pub use embed::{Embed, RequestRewriter};
+pub use backpressure::{backpressure_stats, BackpressureStats};
+pub use embed::{Embed, RequestRewriter, WarmupReport};
 pub use exception::{EmbedRequestError, EmbedStartError};
-pub use extensions::{HeadersSentTx, RequestStream, ResponseStream};
-pub use request_context::RequestContext;
+pub use extensions::{
+  BufferedResponse, Phase, RequestAbort, RequestIni, RequestStream, RequestTiming, ResponseStream,
+};
+pub use host::{Functions, HostFunctions, HostValue};
+pub use metrics::{EmbedMetrics, HistogramSnapshot, LATENCY_BUCKETS};
+pub use opcache::JitStatus;
+pub use options::{
+  EmbedOptions, JitMode, OpcacheOptions, ProfilerOptions, StaticFileOptions, TenantOptions,
+};
+pub use pool::PoolStats;
+pub use profiler::Profile;
+pub use request_context::{RequestContext, SentHeaders};
+pub use runtime::RuntimeOptions;
+pub use session::{MemorySessionStore, SessionStore, Sessions};
 pub use test::{MockRoot, MockRootBuilder};
@@ -0,0 +1,542 @@
+//! Counters and histograms describing the requests served by an `Embed`.
+//!
+//! Everything is recorded with relaxed atomics from the worker threads, so
+//! taking a snapshot never waits on a request in progress.
+
+use std::{
+  cell::Cell,
+  fmt::Write,
+  sync::atomic::{AtomicBool, AtomicU64, Ordering},
+  time::{Duration, Instant},
+};
+
+use ext_php_rs::ffi::{zend_memory_peak_usage, zend_memory_usage};
+
+use crate::{EmbedRequestError, JitStatus, PoolStats, RequestContext};
+
+// Least time between reads of the JIT state by the workers.
+const JIT_REFRESH_INTERVAL: Duration = Duration::from_secs(1);
+
+/// Upper bounds of the latency histogram buckets. A final bucket counts
+/// anything slower than the last bound.
+pub const LATENCY_BUCKETS: [Duration; 13] = [
+  Duration::from_millis(1),
+  Duration::from_micros(2_500),
+  Duration::from_millis(5),
+  Duration::from_millis(10),
+  Duration::from_millis(25),
+  Duration::from_millis(50),
+  Duration::from_millis(100),
+  Duration::from_millis(250),
+  Duration::from_millis(500),
+  Duration::from_secs(1),
+  Duration::from_micros(2_500_000),
+  Duration::from_secs(5),
+  Duration::from_secs(10),
+];
+
+thread_local! {
+  // Zend memory peak of the last request to shut down on this thread.
+  static MEMORY_PEAK: Cell<usize> = const { Cell::new(0) };
+}
+
+/// Remember the Zend memory peak of the current request. Must be called
+/// before its memory manager is reset by request shutdown.
+pub(crate) fn sample_memory_peak() {
+  MEMORY_PEAK.set(unsafe { zend_memory_peak_usage(false) });
+}
+
+/// Take the memory peak sampled by the last request on this thread.
+pub(crate) fn take_memory_peak() -> usize {
+  MEMORY_PEAK.take()
+}
+
+/// Size of the Zend heap held by the current thread. Sampled after a request
+/// has shut down, this is what the thread keeps between requests.
+pub(crate) fn memory_retained() -> usize {
+  unsafe { zend_memory_usage(true) }
+}
+
+#[derive(Default)]
+pub(crate) struct Histogram {
+  buckets: [AtomicU64; LATENCY_BUCKETS.len() + 1],
+  sum_nanos: AtomicU64,
+}
+
+impl Histogram {
+  pub fn observe(&self, duration: Duration) {
+    let bucket = LATENCY_BUCKETS
+      .iter()
+      .position(|bound| duration <= *bound)
+      .unwrap_or(LATENCY_BUCKETS.len());
+
+    self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+    self
+      .sum_nanos
+      .fetch_add(duration.as_nanos() as u64, Ordering::Relaxed);
+  }
+
+  fn snapshot(&self) -> HistogramSnapshot {
+    let counts: Vec<u64> = self
+      .buckets
+      .iter()
+      .map(|bucket| bucket.load(Ordering::Relaxed))
+      .collect();
+
+    HistogramSnapshot {
+      count: counts.iter().sum(),
+      counts,
+      sum: Duration::from_nanos(self.sum_nanos.load(Ordering::Relaxed)),
+    }
+  }
+}
+
+/// Counters for one `Embed`, shared with its worker threads.
+pub(crate) struct Metrics {
+  pub requests: AtomicU64,
+  pub bailouts: AtomicU64,
+  pub exceptions: AtomicU64,
+  pub deadlines_exceeded: AtomicU64,
+  pub not_found: AtomicU64,
+  pub static_files: AtomicU64,
+  pub bytes_in: AtomicU64,
+  pub bytes_out: AtomicU64,
+  pub request_duration: Histogram,
+  pub queue_wait: Histogram,
+  memory_peak: Box<[AtomicU64]>,
+  memory_retained: Box<[AtomicU64]>,
+  jit_sampled: AtomicBool,
+  jit_enabled: AtomicBool,
+  jit_on: AtomicBool,
+  jit_buffer_size: AtomicU64,
+  jit_buffer_free: AtomicU64,
+  created: Instant,
+  // Milliseconds since created after which the JIT state is read again
+  jit_refresh_at: AtomicU64,
+}
+
+impl Metrics {
+  pub fn new(workers: usize) -> Self {
+    Self {
+      requests: AtomicU64::new(0),
+      bailouts: AtomicU64::new(0),
+      exceptions: AtomicU64::new(0),
+      deadlines_exceeded: AtomicU64::new(0),
+      not_found: AtomicU64::new(0),
+      static_files: AtomicU64::new(0),
+      bytes_in: AtomicU64::new(0),
+      bytes_out: AtomicU64::new(0),
+      request_duration: Histogram::default(),
+      queue_wait: Histogram::default(),
+      memory_peak: (0..workers.max(1)).map(|_| AtomicU64::new(0)).collect(),
+      memory_retained: (0..workers.max(1)).map(|_| AtomicU64::new(0)).collect(),
+      jit_sampled: AtomicBool::new(false),
+      jit_enabled: AtomicBool::new(false),
+      jit_on: AtomicBool::new(false),
+      jit_buffer_size: AtomicU64::new(0),
+      jit_buffer_free: AtomicU64::new(0),
+      created: Instant::now(),
+      jit_refresh_at: AtomicU64::new(0),
+    }
+  }
+
+  /// Count a request which has finished running on a worker.
+  pub fn record_result(&self, result: &Result<(), EmbedRequestError>) {
+    self.requests.fetch_add(1, Ordering::Relaxed);
+    match result {
+      Err(EmbedRequestError::Bailout) => &self.bailouts,
+      Err(EmbedRequestError::Exception(_)) => &self.exceptions,
+      Err(EmbedRequestError::DeadlineExceeded) => &self.deadlines_exceeded,
+      _ => return,
+    }
+    .fetch_add(1, Ordering::Relaxed);
+  }
+
+  /// Count a request which failed before reaching a worker.
+  pub fn record_error(&self, err: &EmbedRequestError) {
+    if let EmbedRequestError::ScriptNotFound(_) = err {
+      self.not_found.fetch_add(1, Ordering::Relaxed);
+    }
+  }
+
+  /// Count a request answered with a static file, without a worker.
+  pub fn record_static_file(&self) {
+    self.static_files.fetch_add(1, Ordering::Relaxed);
+  }
+
+  /// Raise the memory peak seen by a worker thread.
+  pub fn record_memory_peak(&self, worker: usize, bytes: usize) {
+    if let Some(peak) = self.memory_peak.get(worker) {
+      peak.fetch_max(bytes as u64, Ordering::Relaxed);
+    }
+  }
+
+  /// Record the Zend heap a worker thread kept after its last request.
+  pub fn record_memory_retained(&self, worker: usize, bytes: usize) {
+    if let Some(retained) = self.memory_retained.get(worker) {
+      retained.store(bytes as u64, Ordering::Relaxed);
+    }
+  }
+
+  /// Record the latest JIT state reported by OPcache.
+  pub fn record_jit(&self, status: &JitStatus) {
+    self.jit_enabled.store(status.enabled, Ordering::Relaxed);
+    self.jit_on.store(status.on, Ordering::Relaxed);
+    self
+      .jit_buffer_size
+      .store(status.buffer_size, Ordering::Relaxed);
+    self
+      .jit_buffer_free
+      .store(status.buffer_free, Ordering::Relaxed);
+    self.jit_sampled.store(true, Ordering::Release);
+  }
+
+  /// Whether the JIT state is due to be read again. Only one caller is told
+  /// so in each refresh interval.
+  pub fn claim_jit_refresh(&self) -> bool {
+    let now = self.created.elapsed().as_millis() as u64;
+    let due = self.jit_refresh_at.load(Ordering::Relaxed);
+    now >= due
+      && self
+        .jit_refresh_at
+        .compare_exchange(
+          due,
+          now + JIT_REFRESH_INTERVAL.as_millis() as u64,
+          Ordering::Relaxed,
+          Ordering::Relaxed,
+        )
+        .is_ok()
+  }
+
+  pub fn snapshot(&self, pool: PoolStats) -> EmbedMetrics {
+    EmbedMetrics {
+      requests: self.requests.load(Ordering::Relaxed),
+      bailouts: self.bailouts.load(Ordering::Relaxed),
+      exceptions: self.exceptions.load(Ordering::Relaxed),
+      deadlines_exceeded: self.deadlines_exceeded.load(Ordering::Relaxed),
+      not_found: self.not_found.load(Ordering::Relaxed),
+      static_files: self.static_files.load(Ordering::Relaxed),
+      running: pool.running,
+      queued: pool.queued,
+      bytes_in: self.bytes_in.load(Ordering::Relaxed),
+      bytes_out: self.bytes_out.load(Ordering::Relaxed),
+      request_duration: self.request_duration.snapshot(),
+      queue_wait: self.queue_wait.snapshot(),
+      memory_peak: self
+        .memory_peak
+        .iter()
+        .map(|peak| peak.load(Ordering::Relaxed))
+        .collect(),
+      memory_retained: self
+        .memory_retained
+        .iter()
+        .map(|retained| retained.load(Ordering::Relaxed))
+        .collect(),
+      request_contexts: RequestContext::live(),
+      jit: self.jit_sampled.load(Ordering::Acquire).then(|| JitStatus {
+        enabled: self.jit_enabled.load(Ordering::Relaxed),
+        on: self.jit_on.load(Ordering::Relaxed),
+        buffer_size: self.jit_buffer_size.load(Ordering::Relaxed),
+        buffer_free: self.jit_buffer_free.load(Ordering::Relaxed),
+      }),
+    }
+  }
+}
+
+/// Counts of requests falling in each of the [`LATENCY_BUCKETS`].
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct HistogramSnapshot {
+  /// Number of observations in each bucket, not cumulative. The last entry
+  /// counts observations above the largest bound.
+  pub counts: Vec<u64>,
+
+  /// Total number of observations.
+  pub count: u64,
+
+  /// Sum of all observations.
+  pub sum: Duration,
+}
+
+/// A snapshot of the metrics for one `Embed`.
+///
+/// # Examples
+///
+/// ```no_run
+/// # use std::env::current_dir;
+/// # use php::Embed;
+/// # let embed = Embed::new(current_dir().unwrap(), None).unwrap();
+/// let metrics = embed.metrics();
+/// println!("{} requests, {} bailouts", metrics.requests, metrics.bailouts);
+/// print!("{}", metrics.to_prometheus());
+/// ```
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct EmbedMetrics {
+  /// Requests which ran on a worker to completion.
+  pub requests: u64,
+
+  /// Requests which ended in a PHP bailout, such as a fatal error.
+  pub bailouts: u64,
+
+  /// Requests which ended with an uncaught exception.
+  pub exceptions: u64,
+
+  /// Requests stopped for running longer than the request timeout.
+  pub deadlines_exceeded: u64,
+
+  /// Requests for which no script was found.
+  pub not_found: u64,
+
+  /// Requests answered with a static file, without a worker.
+  pub static_files: u64,
+
+  /// Requests currently running on a worker.
+  pub running: usize,
+
+  /// Requests waiting for a worker.
+  pub queued: usize,
+
+  /// Request body bytes read by PHP.
+  pub bytes_in: u64,
+
+  /// Response body bytes written by PHP.
+  pub bytes_out: u64,
+
+  /// Time from receiving each request until its script finished.
+  pub request_duration: HistogramSnapshot,
+
+  /// Time each request waited for a worker.
+  pub queue_wait: HistogramSnapshot,
+
+  /// Highest Zend memory peak of any request, for each worker thread.
+  pub memory_peak: Vec<u64>,
+
+  /// Zend heap held by each worker thread after its last request.
+  pub memory_retained: Vec<u64>,
+
+  /// Request contexts alive across the whole process, see
+  /// [`RequestContext::live`].
+  pub request_contexts: usize,
+
+  /// Latest state of the OPcache JIT, when it is enabled for this instance.
+  /// Read by the workers after requests at most once a second, so it may
+  /// trail while the instance is idle.
+  pub jit: Option<JitStatus>,
+}
+
+impl EmbedMetrics {
+  /// Render these metrics in the Prometheus text exposition format.
+  pub fn to_prometheus(&self) -> String {
+    let mut out = String::new();
+
+    let counters = [
+      (
+        "php_requests_total",
+        "Requests which ran on a worker.",
+        self.requests,
+      ),
+      (
+        "php_request_bailouts_total",
+        "Requests which ended in a bailout.",
+        self.bailouts,
+      ),
+      (
+        "php_request_exceptions_total",
+        "Requests which ended with an uncaught exception.",
+        self.exceptions,
+      ),
+      (
+        "php_request_deadlines_exceeded_total",
+        "Requests stopped for running past the request timeout.",
+        self.deadlines_exceeded,
+      ),
+      (
+        "php_requests_not_found_total",
+        "Requests for which no script was found.",
+        self.not_found,
+      ),
+      (
+        "php_static_files_total",
+        "Requests answered with a static file.",
+        self.static_files,
+      ),
+      (
+        "php_request_body_bytes_total",
+        "Request body bytes read by PHP.",
+        self.bytes_in,
+      ),
+      (
+        "php_response_body_bytes_total",
+        "Response body bytes written by PHP.",
+        self.bytes_out,
+      ),
+    ];
+    for (name, help, value) in counters {
+      let _ = writeln!(
+        out,
+        "# HELP {name} {help}\n# TYPE {name} counter\n{name} {value}"
+      );
+    }
+
+    let gauges = [
+      (
+        "php_workers_running",
+        "Requests currently running on a worker.",
+        self.running,
+      ),
+      (
+        "php_requests_queued",
+        "Requests waiting for a worker.",
+        self.queued,
+      ),
+      (
+        "php_request_contexts",
+        "Request contexts alive in the process.",
+        self.request_contexts,
+      ),
+    ];
+    for (name, help, value) in gauges {
+      let _ = writeln!(
+        out,
+        "# HELP {name} {help}\n# TYPE {name} gauge\n{name} {value}"
+      );
+    }
+
+    write_histogram(
+      &mut out,
+      "php_request_duration_seconds",
+      "Time from receiving a request until its script finished.",
+      &self.request_duration,
+    );
+    write_histogram(
+      &mut out,
+      "php_queue_wait_seconds",
+      "Time a request waited for a worker.",
+      &self.queue_wait,
+    );
+
+    let name = "php_worker_memory_peak_bytes";
+    let _ = writeln!(
+      out,
+      "# HELP {name} Highest Zend memory peak of a request on each worker.\n# TYPE {name} gauge"
+    );
+    for (worker, peak) in self.memory_peak.iter().enumerate() {
+      let _ = writeln!(out, "{name}{{worker=\"{worker}\"}} {peak}");
+    }
+
+    let name = "php_worker_memory_retained_bytes";
+    let _ = writeln!(
+      out,
+      "# HELP {name} Zend heap held by each worker after its last request.\n# TYPE {name} gauge"
+    );
+    for (worker, retained) in self.memory_retained.iter().enumerate() {
+      let _ = writeln!(out, "{name}{{worker=\"{worker}\"}} {retained}");
+    }
+
+    if let Some(jit) = &self.jit {
+      let gauges = [
+        (
+          "php_jit_on",
+          "Whether the JIT is compiling code.",
+          jit.on as u64,
+        ),
+        (
+          "php_jit_buffer_size_bytes",
+          "Size of the buffer for JIT compiled code.",
+          jit.buffer_size,
+        ),
+        (
+          "php_jit_buffer_used_bytes",
+          "Bytes of the JIT buffer holding compiled code.",
+          jit.buffer_size.saturating_sub(jit.buffer_free),
+        ),
+      ];
+      for (name, help, value) in gauges {
+        let _ = writeln!(
+          out,
+          "# HELP {name} {help}\n# TYPE {name} gauge\n{name} {value}"
+        );
+      }
+    }
+
+    out
+  }
+}
+
+fn write_histogram(out: &mut String, name: &str, help: &str, histogram: &HistogramSnapshot) {
+  let _ = writeln!(out, "# HELP {name} {help}\n# TYPE {name} histogram");
+
+  let mut cumulative = 0;
+  for (bound, count) in LATENCY_BUCKETS.iter().zip(&histogram.counts) {
+    cumulative += count;
+    let le = bound.as_secs_f64();
+    let _ = writeln!(out, "{name}_bucket{{le=\"{le}\"}} {cumulative}");
+  }
+
+  let _ = writeln!(
+    out,
+    "{name}_bucket{{le=\"+Inf\"}} {}\n{name}_sum {}\n{name}_count {}",
+    histogram.count,
+    histogram.sum.as_secs_f64(),
+    histogram.count
+  );
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+
+  #[test]
+  fn test_histogram_buckets() {
+    let histogram = Histogram::default();
+    histogram.observe(Duration::from_micros(500));
+    histogram.observe(Duration::from_millis(1));
+    histogram.observe(Duration::from_millis(30));
+    histogram.observe(Duration::from_secs(60));
+
+    let snapshot = histogram.snapshot();
+    assert_eq!(snapshot.count, 4);
+    assert_eq!(snapshot.counts[0], 2);
+    assert_eq!(snapshot.counts[5], 1);
+    assert_eq!(snapshot.counts[LATENCY_BUCKETS.len()], 1);
+  }
+
+  #[test]
+  fn test_prometheus_histogram_is_cumulative() {
+    let metrics = Metrics::new(2);
+    metrics.request_duration.observe(Duration::from_millis(3));
+    metrics.request_duration.observe(Duration::from_millis(30));
+    metrics.record_memory_peak(1, 2048);
+
+    let text = metrics.snapshot(PoolStats::default()).to_prometheus();
+    assert!(text.contains("php_request_duration_seconds_bucket{le=\"0.005\"} 1\n"));
+    assert!(text.contains("php_request_duration_seconds_bucket{le=\"0.05\"} 2\n"));
+    assert!(text.contains("php_request_duration_seconds_bucket{le=\"+Inf\"} 2\n"));
+    assert!(text.contains("php_worker_memory_peak_bytes{worker=\"1\"} 2048\n"));
+    assert!(!text.contains("php_jit_"));
+  }
+
+  #[test]
+  fn test_claim_jit_refresh_once_per_interval() {
+    let metrics = Metrics::new(1);
+    assert!(metrics.claim_jit_refresh());
+    assert!(!metrics.claim_jit_refresh());
+  }
+
+  #[test]
+  fn test_jit_gauges() {
+    let metrics = Metrics::new(1);
+    metrics.record_jit(&JitStatus {
+      enabled: true,
+      on: true,
+      buffer_size: 4096,
+      buffer_free: 1024,
+    });
+
+    let snapshot = metrics.snapshot(PoolStats::default());
+    assert_eq!(snapshot.jit.map(|jit| jit.on), Some(true));
+
+    let text = snapshot.to_prometheus();
+    assert!(text.contains("php_jit_on 1\n"));
+    assert!(text.contains("php_jit_buffer_used_bytes 3072\n"));
+  }
+}
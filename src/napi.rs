@@ -1,16 +1,30 @@
-use std::sync::Arc;
+use std::{collections::HashMap, sync::Arc, time::Duration};
 
 use napi::bindgen_prelude::*;
-use napi::{Env, Error, Result, Task};
+use napi::threadsafe_function::ThreadsafeFunction;
+use napi::{check_status, sys, Env, Error, Result, Status};
 
-use crate::sapi::fallback_handle;
-use crate::{Embed, EmbedRequestError, Handler, RequestRewriter};
+use crate::extensions::RequestAbort;
+use crate::{
+  backpressure_stats, BufferedResponse, Embed, EmbedMetrics, EmbedOptions, EmbedRequestError,
+  Functions, Handler, HistogramSnapshot, HostFunctions, HostValue, JitMode, JitStatus,
+  OpcacheOptions, ProfilerOptions, RequestRewriter, RequestTiming, RuntimeOptions, SessionStore,
+  Sessions, StaticFileOptions, TenantOptions, LATENCY_BUCKETS,
+};
 use crate::{Request, Response};
 use http_handler::napi::{Request as PhpRequest, Response as PhpResponse};
 use http_rewriter::napi::Rewriter as NapiRewriter;
 
+// Hand napi-rs the shared runtime before it starts its own, which happens when
+// the addon is registered. No PHP instance exists yet, so the runtime can only
+// be configured through the environment.
+#[napi_derive::module_init]
+fn init_runtime() {
+  let _ = crate::runtime::init(RuntimeOptions::from_env());
+}
+
 /// Options for creating a new PHP instance.
-#[napi(object)]
+#[napi(object, object_to_js = false)]
 #[derive(Default)]
 pub struct PhpOptions {
   /// The command-line arguments for the PHP instance.
@@ -21,6 +35,579 @@ pub struct PhpOptions {
   pub throw_request_errors: Option<bool>,
   /// Request rewriter
   pub rewriter: Option<Reference<NapiRewriter>>,
+  /// Number of PHP worker threads. Defaults to the available parallelism.
+  pub workers: Option<u32>,
+  /// Maximum number of requests waiting for a free worker thread.
+  pub queue_size: Option<u32>,
+  /// Milliseconds a request may wait for a free worker before failing with a
+  /// 503 response.
+  pub queue_timeout: Option<u32>,
+  /// Milliseconds a script may run on a worker before it is stopped with a
+  /// 504 response.
+  pub request_timeout: Option<u32>,
+  /// Respond with 503 as soon as the queue is full, instead of waiting.
+  pub shed_load: Option<bool>,
+  /// Worker script, relative to the docroot, to boot once per worker thread.
+  pub worker: Option<String>,
+  /// Enable and configure OPcache.
+  pub opcache: Option<PhpOpcacheOptions>,
+  /// Bytes of output to coalesce before writing to the response. Zero writes
+  /// output through immediately.
+  pub output_buffer_size: Option<u32>,
+  /// Milliseconds to remember which script a request path resolves to. Zero,
+  /// the default, resolves every request against the filesystem.
+  pub path_cache_ttl: Option<u32>,
+  /// Remember what each request is rewritten to, keyed by its method, URL and
+  /// headers. Only safe when rewrite rules depend on nothing but the request
+  /// and the filesystem.
+  pub cache_rewrites: Option<bool>,
+  /// Thread counts of the tokio runtime shared by all PHP instances.
+  pub runtime: Option<PhpRuntimeOptions>,
+  /// Add a Server-Timing header describing where request time was spent.
+  pub server_timing: Option<bool>,
+  /// INI settings applied when the PHP engine starts. All PHP instances alive
+  /// at the same time must use the same settings.
+  pub ini: Option<HashMap<String, String>>,
+  /// INI settings applied at the start of every request to this instance.
+  pub request_ini: Option<HashMap<String, String>>,
+  /// Applications served from their own docroots, routed by host or prefix.
+  pub tenants: Option<Vec<PhpTenantOptions>>,
+  /// Keep PHP sessions in memory shared by all worker threads, instead of
+  /// files on disk.
+  pub sessions: Option<bool>,
+  /// Keep PHP sessions in a store implemented in JavaScript, such as one
+  /// backed by Redis. Takes precedence over `sessions`.
+  pub session_store: Option<PhpSessionStore>,
+  /// Serve files which are not PHP scripts straight from the docroot,
+  /// without involving a worker thread.
+  pub static_files: Option<PhpStaticFileOptions>,
+  /// Functions scripts may call with `node_call($name, $payload)`. Each one
+  /// is given the payload and must return a promise of the result.
+  #[napi(ts_type = "Record<string, (payload: any) => Promise<any>>")]
+  pub functions: Option<HashMap<String, PhpFunction>>,
+  /// Keep the PHP engine running after every instance has been garbage
+  /// collected, so later instances start faster. Later instances with
+  /// different startup `ini` then throw.
+  pub keep_engine: Option<bool>,
+  /// Sample the PHP call stacks of requests, to be read with `profile()`.
+  pub profiler: Option<PhpProfilerOptions>,
+}
+
+/// A JavaScript function scripts may call through `node_call()`.
+pub type PhpFunction =
+  ThreadsafeFunction<HostValue, Promise<HostValue>, HostValue, Status, false, true>;
+
+// Functions given to a PHP instance, called like a JavaScript session store
+// by waiting for their promises on the PHP worker thread.
+struct JsFunctions(HashMap<String, PhpFunction>);
+
+impl HostFunctions for JsFunctions {
+  fn call(&self, name: &str, payload: HostValue) -> std::result::Result<HostValue, String> {
+    let function = self
+      .0
+      .get(name)
+      .ok_or_else(|| format!("Unknown function: {name}"))?;
+
+    crate::runtime::handle()
+      .block_on(async { function.call_async(payload).await?.await })
+      .map_err(|err| err.reason.clone())
+  }
+}
+
+// Deepest nesting of JavaScript values converted for PHP, which also stops
+// converting objects referencing themselves.
+const MAX_VALUE_DEPTH: usize = 64;
+
+impl ToNapiValue for HostValue {
+  unsafe fn to_napi_value(env: sys::napi_env, value: Self) -> Result<sys::napi_value> {
+    match value {
+      HostValue::Null => Null::to_napi_value(env, Null),
+      HostValue::Bool(value) => bool::to_napi_value(env, value),
+      HostValue::Int(value) => i64::to_napi_value(env, value),
+      HostValue::Float(value) => f64::to_napi_value(env, value),
+      HostValue::String(value) => String::to_napi_value(env, value),
+      HostValue::Array(values) => Vec::<HostValue>::to_napi_value(env, values),
+      HostValue::Object(entries) => {
+        let mut object = std::ptr::null_mut();
+        check_status!(sys::napi_create_object(env, &mut object))?;
+        for (key, value) in entries {
+          let key = String::to_napi_value(env, key)?;
+          let value = HostValue::to_napi_value(env, value)?;
+          check_status!(sys::napi_set_property(env, object, key, value))?;
+        }
+        Ok(object)
+      }
+    }
+  }
+}
+
+impl FromNapiValue for HostValue {
+  unsafe fn from_napi_value(env: sys::napi_env, value: sys::napi_value) -> Result<Self> {
+    host_value(env, value, 0)
+  }
+}
+
+unsafe fn host_value(
+  env: sys::napi_env,
+  value: sys::napi_value,
+  depth: usize,
+) -> Result<HostValue> {
+  let mut value_type = 0;
+  check_status!(sys::napi_typeof(env, value, &mut value_type))?;
+
+  Ok(match value_type {
+    sys::ValueType::napi_boolean => HostValue::Bool(bool::from_napi_value(env, value)?),
+    sys::ValueType::napi_number => {
+      let number = f64::from_napi_value(env, value)?;
+      // Numbers which are whole and exact come back to PHP as integers
+      if number.fract() == 0.0 && number.abs() < (1u64 << 53) as f64 {
+        HostValue::Int(number as i64)
+      } else {
+        HostValue::Float(number)
+      }
+    }
+    sys::ValueType::napi_string => HostValue::String(String::from_napi_value(env, value)?),
+    sys::ValueType::napi_object if depth < MAX_VALUE_DEPTH => {
+      let mut is_array = false;
+      check_status!(sys::napi_is_array(env, value, &mut is_array))?;
+
+      if is_array {
+        let mut len = 0;
+        check_status!(sys::napi_get_array_length(env, value, &mut len))?;
+        let mut values = Vec::with_capacity(len as usize);
+        for index in 0..len {
+          let mut element = std::ptr::null_mut();
+          check_status!(sys::napi_get_element(env, value, index, &mut element))?;
+          values.push(host_value(env, element, depth + 1)?);
+        }
+        HostValue::Array(values)
+      } else {
+        let mut keys = std::ptr::null_mut();
+        check_status!(sys::napi_get_property_names(env, value, &mut keys))?;
+        let mut len = 0;
+        check_status!(sys::napi_get_array_length(env, keys, &mut len))?;
+        let mut entries = Vec::with_capacity(len as usize);
+        for index in 0..len {
+          let mut key = std::ptr::null_mut();
+          check_status!(sys::napi_get_element(env, keys, index, &mut key))?;
+          let mut property = std::ptr::null_mut();
+          check_status!(sys::napi_get_property(env, value, key, &mut property))?;
+          entries.push((
+            String::from_napi_value(env, key)?,
+            host_value(env, property, depth + 1)?,
+          ));
+        }
+        HostValue::Object(entries)
+      }
+    }
+    // undefined, functions, symbols and bigints have no PHP equivalent
+    _ => HostValue::Null,
+  })
+}
+
+/// Options for serving static files from the docroot.
+#[napi(object)]
+#[derive(Default)]
+pub struct PhpStaticFileOptions {
+  /// Extensions of the files to serve, without the dot. Defaults to common web
+  /// assets. PHP scripts, including `.phtml` and `.inc` files, are never
+  /// served.
+  pub extensions: Option<Vec<String>>,
+  /// Largest file to keep in memory, in bytes. Defaults to 64 KiB.
+  pub max_cached_size: Option<u32>,
+  /// `Cache-Control` header to send with every file.
+  pub cache_control: Option<String>,
+}
+
+impl From<PhpStaticFileOptions> for StaticFileOptions {
+  fn from(options: PhpStaticFileOptions) -> Self {
+    let defaults = StaticFileOptions::default();
+    StaticFileOptions {
+      extensions: options.extensions.unwrap_or(defaults.extensions),
+      max_cached_size: options
+        .max_cached_size
+        .map_or(defaults.max_cached_size, u64::from),
+      cache_control: options.cache_control,
+    }
+  }
+}
+
+/// Options for a single call to handleRequest.
+#[napi(object)]
+#[derive(Default)]
+pub struct PhpHandleOptions {
+  /// Read the request body from `request.write()` and `request.end()` while
+  /// the response is pending, unless a body was given up front.
+  pub stream_body: Option<bool>,
+}
+
+/// Options for sampling the PHP call stacks of requests.
+#[napi(object)]
+#[derive(Default)]
+pub struct PhpProfilerOptions {
+  /// Milliseconds between samples of a profiled request. Defaults to 10.
+  pub interval_ms: Option<u32>,
+  /// Profile one in every this many requests. Defaults to 1, profiling all.
+  pub every_nth_request: Option<u32>,
+}
+
+impl From<PhpProfilerOptions> for ProfilerOptions {
+  fn from(options: PhpProfilerOptions) -> Self {
+    let defaults = ProfilerOptions::default();
+    ProfilerOptions {
+      interval: options
+        .interval_ms
+        .map_or(defaults.interval, |ms| Duration::from_millis(ms as u64)),
+      every_nth_request: options
+        .every_nth_request
+        .unwrap_or(defaults.every_nth_request),
+    }
+  }
+}
+
+/// PHP call stacks sampled from requests.
+#[napi(object)]
+pub struct PhpProfile {
+  /// Stacks sampled.
+  pub samples: i64,
+  /// Requests which were profiled.
+  pub requests: i64,
+  /// Sampled stacks in the folded format, one `stack count` per line with
+  /// frames separated by `;`, as read by flame graph tools.
+  pub folded: String,
+}
+
+/// Session storage implemented in JavaScript.
+///
+/// Each function must return a promise. PHP waits for it to settle, so the
+/// store cannot be used with `handleRequestSync`, which blocks the thread
+/// the promise would settle on.
+#[napi(object, object_to_js = false)]
+pub struct PhpSessionStore {
+  /// Get the data of a session, or `null` when it does not exist.
+  #[napi(ts_type = "(id: string) => Promise<Buffer | null | undefined>")]
+  pub read: ThreadsafeFunction<String, Promise<Option<Buffer>>, String, Status, false, true>,
+  /// Store the data of a session for `ttl` seconds.
+  #[napi(ts_type = "(id: string, data: Buffer, ttl: number) => Promise<void>")]
+  pub write: ThreadsafeFunction<
+    FnArgs<(String, Buffer, u32)>,
+    Promise<()>,
+    FnArgs<(String, Buffer, u32)>,
+    Status,
+    false,
+    true,
+  >,
+  /// Remove a session.
+  #[napi(ts_type = "(id: string) => Promise<void>")]
+  pub destroy: ThreadsafeFunction<String, Promise<()>, String, Status, false, true>,
+}
+
+// Calls into a JavaScript session store wait for its promises on the PHP
+// worker thread. Failures read as a missing session and skip writes, as files
+// which cannot be read or written do for PHP's own handler.
+impl SessionStore for PhpSessionStore {
+  fn read(&self, id: &str) -> Option<bytes::Bytes> {
+    crate::runtime::handle()
+      .block_on(async { self.read.call_async(id.to_string()).await?.await })
+      .ok()
+      .flatten()
+      .map(|data| bytes::Bytes::copy_from_slice(&data))
+  }
+
+  fn write(&self, id: &str, data: bytes::Bytes, ttl: Duration) {
+    let args = (
+      id.to_string(),
+      Buffer::from(data.to_vec()),
+      ttl.as_secs() as u32,
+    );
+    let _ =
+      crate::runtime::handle().block_on(async { self.write.call_async(args.into()).await?.await });
+  }
+
+  fn destroy(&self, id: &str) {
+    let _ = crate::runtime::handle()
+      .block_on(async { self.destroy.call_async(id.to_string()).await?.await });
+  }
+}
+
+/// An application served by a PHP instance from its own docroot.
+#[napi(object)]
+#[derive(Default)]
+pub struct PhpTenantOptions {
+  /// Host to serve, ignoring the port. Matches any host when unset.
+  pub host: Option<String>,
+  /// Path prefix to serve, stripped before resolving the script. Matches any
+  /// path when unset.
+  pub prefix: Option<String>,
+  /// Document root of this application.
+  pub docroot: String,
+  /// INI settings applied at the start of every request to this application.
+  pub request_ini: Option<HashMap<String, String>>,
+  /// Most requests which may be queued or running at once before further
+  /// requests fail with a 503 response.
+  pub max_requests: Option<u32>,
+}
+
+/// Options for the tokio runtime shared by all PHP instances.
+///
+/// The runtime starts when the addon is loaded, configured by the
+/// `PHP_NODE_RUNTIME_WORKERS` and `PHP_NODE_RUNTIME_BLOCKING_THREADS`
+/// environment variables. Values given here must match the running runtime.
+#[napi(object)]
+#[derive(Default)]
+pub struct PhpRuntimeOptions {
+  /// Number of async worker threads.
+  pub worker_threads: Option<u32>,
+  /// Maximum number of threads for blocking tasks.
+  pub max_blocking_threads: Option<u32>,
+}
+
+/// OPcache options for a PHP instance.
+///
+/// These are applied when the PHP engine starts, so all PHP instances alive
+/// at the same time must use the same settings.
+#[napi(object)]
+#[derive(Default)]
+pub struct PhpOpcacheOptions {
+  /// Shared memory size in megabytes.
+  pub memory_consumption: Option<u32>,
+  /// Maximum number of cached scripts.
+  pub max_accelerated_files: Option<u32>,
+  /// Check scripts for changes on disk.
+  pub validate_timestamps: Option<bool>,
+  /// Seconds between timestamp checks.
+  pub revalidate_freq: Option<u32>,
+  /// Script, relative to the docroot, to preload at engine startup.
+  pub preload: Option<String>,
+  /// User to run the preload script as when running as root.
+  pub preload_user: Option<String>,
+  /// Scripts, relative to the docroot, to compile into the cache at startup.
+  pub warm: Option<Vec<String>>,
+  /// JIT mode, either `'tracing'` or `'function'`. Off when unset.
+  pub jit: Option<String>,
+  /// Memory for JIT compiled code in megabytes. Defaults to 64.
+  pub jit_buffer_size: Option<u32>,
+}
+
+/// Counters describing how requests are admitted to the PHP worker threads.
+#[napi(object)]
+pub struct PhpPoolStats {
+  /// Requests waiting for a worker.
+  pub queued: u32,
+  /// Requests currently running on a worker.
+  pub running: u32,
+  /// Requests which started running on a worker.
+  pub started: i64,
+  /// Requests rejected because the queue was full.
+  pub rejected: i64,
+  /// Requests dropped because they waited longer than the queue timeout.
+  pub timed_out: i64,
+  /// Total milliseconds started requests spent waiting for a worker.
+  pub wait_time_ms: f64,
+  /// Worker threads ready to take requests.
+  pub ready: u32,
+  /// Worker threads in the pool.
+  pub workers: u32,
+}
+
+/// Outcome of warming up a PHP instance.
+#[napi(object)]
+pub struct PhpWarmupReport {
+  /// Worker threads ready to serve requests.
+  pub ready: u32,
+  /// Worker threads in the pool. Fewer are ready when some did not finish
+  /// starting within 30 seconds.
+  pub workers: u32,
+  /// Scripts compiled into the opcode cache.
+  pub compiled: u32,
+  /// Milliseconds spent warming up.
+  pub duration_ms: f64,
+}
+
+/// Counters describing how often PHP workers were blocked on slow consumers.
+#[napi(object)]
+pub struct PhpBackpressureStats {
+  /// Writes which had to wait for the consumer to read before completing.
+  pub parked_writes: i64,
+  /// Total milliseconds workers spent parked on those writes.
+  pub parked_time_ms: f64,
+  /// Writes dropped because the request was aborted.
+  pub aborted_writes: i64,
+}
+
+/// Counts of observations in each latency bucket.
+#[napi(object)]
+pub struct PhpHistogram {
+  /// Upper bound of each bucket, in milliseconds.
+  pub bounds_ms: Vec<f64>,
+  /// Observations in each bucket, not cumulative. The last entry counts
+  /// observations above the largest bound.
+  pub counts: Vec<i64>,
+  /// Total number of observations.
+  pub count: i64,
+  /// Sum of all observations, in milliseconds.
+  pub sum_ms: f64,
+}
+
+/// State of the OPcache JIT.
+#[napi(object)]
+pub struct PhpJitStatus {
+  /// Whether the JIT was enabled at startup.
+  pub enabled: bool,
+  /// Whether the JIT is currently compiling code.
+  pub on: bool,
+  /// Size of the buffer for compiled code, in bytes.
+  pub buffer_size: i64,
+  /// Bytes of the buffer not yet holding compiled code.
+  pub buffer_free: i64,
+}
+
+/// Request counters, latency histograms and memory peaks of a PHP instance.
+#[napi(object)]
+pub struct PhpMetrics {
+  /// Requests which ran on a worker to completion.
+  pub requests: i64,
+  /// Requests which ended in a PHP bailout, such as a fatal error.
+  pub bailouts: i64,
+  /// Requests which ended with an uncaught exception.
+  pub exceptions: i64,
+  /// Requests stopped for running longer than the request timeout.
+  pub deadlines_exceeded: i64,
+  /// Requests for which no script was found.
+  pub not_found: i64,
+  /// Requests answered with a static file, without a worker.
+  pub static_files: i64,
+  /// Requests currently running on a worker.
+  pub running: u32,
+  /// Requests waiting for a worker.
+  pub queued: u32,
+  /// Request body bytes read by PHP.
+  pub bytes_in: i64,
+  /// Response body bytes written by PHP.
+  pub bytes_out: i64,
+  /// Time from receiving each request until its script finished.
+  pub request_duration: PhpHistogram,
+  /// Time each request waited for a worker.
+  pub queue_wait: PhpHistogram,
+  /// Highest Zend memory peak of any request, in bytes, per worker thread.
+  pub memory_peak: Vec<i64>,
+  /// Zend heap held by each worker thread after its last request, in bytes.
+  pub memory_retained: Vec<i64>,
+  /// Request contexts alive across all PHP instances in the process.
+  pub request_contexts: u32,
+  /// Latest state of the OPcache JIT, when it is enabled.
+  pub jit: Option<PhpJitStatus>,
+}
+
+impl From<HistogramSnapshot> for PhpHistogram {
+  fn from(histogram: HistogramSnapshot) -> Self {
+    PhpHistogram {
+      bounds_ms: LATENCY_BUCKETS
+        .iter()
+        .map(|bound| bound.as_secs_f64() * 1000.0)
+        .collect(),
+      counts: histogram.counts.into_iter().map(|n| n as i64).collect(),
+      count: histogram.count as i64,
+      sum_ms: histogram.sum.as_secs_f64() * 1000.0,
+    }
+  }
+}
+
+impl From<JitStatus> for PhpJitStatus {
+  fn from(status: JitStatus) -> Self {
+    PhpJitStatus {
+      enabled: status.enabled,
+      on: status.on,
+      buffer_size: status.buffer_size as i64,
+      buffer_free: status.buffer_free as i64,
+    }
+  }
+}
+
+impl From<EmbedMetrics> for PhpMetrics {
+  fn from(metrics: EmbedMetrics) -> Self {
+    PhpMetrics {
+      requests: metrics.requests as i64,
+      bailouts: metrics.bailouts as i64,
+      exceptions: metrics.exceptions as i64,
+      deadlines_exceeded: metrics.deadlines_exceeded as i64,
+      not_found: metrics.not_found as i64,
+      static_files: metrics.static_files as i64,
+      running: metrics.running as u32,
+      queued: metrics.queued as u32,
+      bytes_in: metrics.bytes_in as i64,
+      bytes_out: metrics.bytes_out as i64,
+      request_duration: metrics.request_duration.into(),
+      queue_wait: metrics.queue_wait.into(),
+      memory_peak: metrics.memory_peak.into_iter().map(|n| n as i64).collect(),
+      memory_retained: metrics
+        .memory_retained
+        .into_iter()
+        .map(|n| n as i64)
+        .collect(),
+      request_contexts: metrics.request_contexts as u32,
+      jit: metrics.jit.map(Into::into),
+    }
+  }
+}
+
+impl From<PhpTenantOptions> for TenantOptions {
+  fn from(options: PhpTenantOptions) -> Self {
+    TenantOptions {
+      host: options.host,
+      prefix: options.prefix,
+      docroot: options.docroot.into(),
+      request_ini: options
+        .request_ini
+        .unwrap_or_default()
+        .into_iter()
+        .collect(),
+      max_requests: options.max_requests.map(|n| n as usize),
+    }
+  }
+}
+
+impl From<PhpRuntimeOptions> for RuntimeOptions {
+  fn from(options: PhpRuntimeOptions) -> Self {
+    RuntimeOptions {
+      worker_threads: options.worker_threads.map(|n| n as usize),
+      max_blocking_threads: options.max_blocking_threads.map(|n| n as usize),
+    }
+  }
+}
+
+impl TryFrom<PhpOpcacheOptions> for OpcacheOptions {
+  type Error = Error;
+
+  fn try_from(options: PhpOpcacheOptions) -> Result<Self> {
+    let jit = match options.jit.as_deref() {
+      None => None,
+      Some("tracing") => Some(JitMode::Tracing),
+      Some("function") => Some(JitMode::Function),
+      Some(mode) => {
+        return Err(Error::from_reason(format!(
+          "Unknown JIT mode '{mode}', expected 'tracing' or 'function'"
+        )))
+      }
+    };
+
+    Ok(OpcacheOptions {
+      memory_consumption: options.memory_consumption,
+      max_accelerated_files: options.max_accelerated_files,
+      validate_timestamps: options.validate_timestamps,
+      revalidate_freq: options.revalidate_freq,
+      preload: options.preload.map(Into::into),
+      preload_user: options.preload_user,
+      warm: options
+        .warm
+        .unwrap_or_default()
+        .into_iter()
+        .map(Into::into)
+        .collect(),
+      jit,
+      jit_buffer_size: options.jit_buffer_size,
+    })
+  }
 }
 
 /// A PHP instance.
@@ -44,6 +631,10 @@ pub struct PhpOptions {
 pub struct PhpRuntime {
   embed: Arc<Embed>,
   throw_request_errors: bool,
+  server_timing: bool,
+  // Option calling into JavaScript from the workers, whose promises can not
+  // settle while handleRequestSync blocks the thread.
+  sync_conflict: Option<&'static str>,
 }
 
 #[napi]
@@ -60,17 +651,32 @@ impl PhpRuntime {
   /// ```
   #[napi(constructor)]
   pub fn new(options: Option<PhpOptions>) -> Result<Self> {
-    // Register our fallback runtime with napi-rs so async tasks use the same runtime.
-    // This must be called before napi-rs creates its own runtime.
-    napi::bindgen_prelude::create_custom_tokio_runtime(
-      tokio::runtime::Runtime::new().expect("Failed to create tokio runtime"),
-    );
-
     let PhpOptions {
       docroot,
       argv,
       throw_request_errors,
       rewriter,
+      workers,
+      queue_size,
+      queue_timeout,
+      request_timeout,
+      shed_load,
+      worker,
+      opcache,
+      output_buffer_size,
+      path_cache_ttl,
+      cache_rewrites,
+      runtime,
+      server_timing,
+      ini,
+      request_ini,
+      tenants,
+      sessions,
+      session_store,
+      static_files,
+      functions,
+      keep_engine,
+      profiler,
     } = options.unwrap_or_default();
 
     let docroot = docroot
@@ -90,20 +696,67 @@ impl PhpRuntime {
       None
     };
 
-    let embed = match argv {
-      Some(argv) => Embed::new_with_argv(docroot, rewriter, argv),
-      None => Embed::new(docroot, rewriter),
+    let mut embed_options = EmbedOptions::default();
+    if let Some(workers) = workers {
+      embed_options.workers = workers as usize;
+      embed_options.queue_size = embed_options.workers * 8;
     }
-    .map_err(|err| Error::from_reason(err.to_string()))?;
+    if let Some(queue_size) = queue_size {
+      embed_options.queue_size = queue_size as usize;
+    }
+    embed_options.queue_timeout =
+      queue_timeout.map(|timeout| std::time::Duration::from_millis(timeout as u64));
+    embed_options.request_timeout =
+      request_timeout.map(|timeout| std::time::Duration::from_millis(timeout as u64));
+    embed_options.shed_load = shed_load.unwrap_or_default();
+    embed_options.worker = worker.map(Into::into);
+    embed_options.opcache = opcache.map(TryInto::try_into).transpose()?;
+    if let Some(output_buffer_size) = output_buffer_size {
+      embed_options.output_buffer_size = output_buffer_size as usize;
+    }
+    if let Some(path_cache_ttl) = path_cache_ttl {
+      embed_options.path_cache_ttl = std::time::Duration::from_millis(path_cache_ttl as u64);
+    }
+    embed_options.cache_rewrites = cache_rewrites.unwrap_or_default();
+    embed_options.runtime = runtime.map(Into::into).unwrap_or_default();
+    embed_options.ini = ini.unwrap_or_default().into_iter().collect();
+    embed_options.request_ini = request_ini.unwrap_or_default().into_iter().collect();
+    embed_options.tenants = tenants
+      .unwrap_or_default()
+      .into_iter()
+      .map(Into::into)
+      .collect();
+    let sync_conflict = match (&session_store, &functions) {
+      (Some(_), _) => Some("sessionStore"),
+      (None, Some(_)) => Some("functions"),
+      (None, None) => None,
+    };
+    embed_options.sessions = match session_store {
+      Some(store) => Some(Sessions::new(store)),
+      None => sessions.unwrap_or_default().then(Sessions::memory),
+    };
+    embed_options.static_files = static_files.map(Into::into);
+    embed_options.functions = functions.map(|functions| Functions::new(JsFunctions(functions)));
+    embed_options.keep_engine = keep_engine.unwrap_or_default();
+    embed_options.profiler = profiler.map(Into::into);
+
+    let embed = Embed::new_with_options(docroot, rewriter, argv.unwrap_or_default(), embed_options)
+      .map_err(|err| Error::from_reason(err.to_string()))?;
 
     Ok(Self {
       embed: Arc::new(embed),
       throw_request_errors: throw_request_errors.unwrap_or_default(),
+      server_timing: server_timing.unwrap_or_default(),
+      sync_conflict,
     })
   }
 
   /// Handle a PHP request.
   ///
+  /// With `streamBody`, a request without a body given up front reads its
+  /// body from `request.write()` and `request.end()`, which must be called
+  /// while the response is pending. Otherwise the body is closed for it.
+  ///
   /// # Examples
   ///
   /// ```js
@@ -120,24 +773,35 @@ impl PhpRuntime {
   /// console.log(response.status);
   /// console.log(response.body);
   /// ```
-  #[napi]
-  pub fn handle_request(
+  #[napi(ts_return_type = "Promise<unknown>")]
+  pub fn handle_request<'env>(
     &self,
+    env: &'env Env,
     request: PhpRequest,
     signal: Option<AbortSignal>,
-  ) -> AsyncTask<PhpRequestTask> {
-    AsyncTask::with_optional_signal(
-      PhpRequestTask {
-        throw_request_errors: self.throw_request_errors,
-        embed: self.embed.clone(),
-        request: Some(request.into_inner()),
-      },
-      signal,
-    )
+    options: Option<PhpHandleOptions>,
+  ) -> Result<PromiseRaw<'env, PhpResponse>> {
+    let request = with_abort(request.into_inner(), signal.as_ref());
+    let abort = request.extensions().get::<RequestAbort>().cloned();
+    let stream_body = options.unwrap_or_default().stream_body.unwrap_or_default();
+    let response = handle_buffered(
+      self.embed.clone(),
+      request,
+      self.throw_request_errors,
+      self.server_timing,
+      stream_body,
+    );
+
+    env.spawn_future_with_callback(abortable(response, abort), |_env, response| {
+      Ok(Into::<PhpResponse>::into(response))
+    })
   }
 
   /// Handle a PHP request synchronously.
   ///
+  /// Fails when `sessionStore` or `functions` is set, as their promises could
+  /// never settle while this blocks the thread.
+  ///
   /// # Examples
   ///
   /// ```js
@@ -156,13 +820,21 @@ impl PhpRuntime {
   /// ```
   #[napi]
   pub fn handle_request_sync(&self, request: PhpRequest) -> Result<PhpResponse> {
-    let mut task = PhpRequestTask {
-      throw_request_errors: self.throw_request_errors,
-      embed: self.embed.clone(),
-      request: Some(request.into_inner()),
-    };
+    if let Some(option) = self.sync_conflict {
+      return Err(Error::from_reason(format!(
+        "handleRequestSync can not be used with the {option} option"
+      )));
+    }
 
-    task.compute().map(Into::<PhpResponse>::into)
+    crate::runtime::handle()
+      .block_on(handle_buffered(
+        self.embed.clone(),
+        request.into_inner(),
+        self.throw_request_errors,
+        self.server_timing,
+        false,
+      ))
+      .map(Into::<PhpResponse>::into)
   }
 
   /// Handle a streaming PHP request.
@@ -191,257 +863,348 @@ impl PhpRuntime {
   ///   console.log('Chunk:', chunk.toString());
   /// }
   /// ```
-  #[napi]
-  pub fn handle_stream(
+  #[napi(ts_return_type = "Promise<unknown>")]
+  pub fn handle_stream<'env>(
     &self,
+    env: &'env Env,
     request: PhpRequest,
     signal: Option<AbortSignal>,
-  ) -> AsyncTask<PhpStreamTask> {
-    AsyncTask::with_optional_signal(
-      PhpStreamTask {
-        throw_request_errors: self.throw_request_errors,
-        embed: self.embed.clone(),
-        request: Some(request.into_inner()),
-      },
-      signal,
-    )
+  ) -> Result<PromiseRaw<'env, Object<'static>>> {
+    let request = with_abort(request.into_inner(), signal.as_ref());
+    let abort = request.extensions().get::<RequestAbort>().cloned();
+    let response = handle_streaming(
+      self.embed.clone(),
+      request,
+      self.throw_request_errors,
+      self.server_timing,
+    );
+
+    env.spawn_future_with_callback(abortable(response, abort), |env, response| {
+      Into::<PhpResponse>::into(response).make_streamable(*env)
+    })
   }
-}
 
-/// Task container to run a PHP request in a worker thread.
-pub struct PhpRequestTask {
-  embed: Arc<Embed>,
-  request: Option<Request>,
-  throw_request_errors: bool,
-}
+  /// Compile scripts into the opcode cache without executing them.
+  ///
+  /// Paths are relative to the docroot. Resolves with the number of scripts
+  /// compiled, which is zero if OPcache is not enabled.
+  ///
+  /// # Examples
+  ///
+  /// ```js
+  /// const php = new Php({
+  ///   docroot: process.cwd(),
+  ///   opcache: { validateTimestamps: false }
+  /// });
+  ///
+  /// await php.warmOpcache(['index.php', 'src/app.php']);
+  /// ```
+  #[napi(ts_return_type = "Promise<number>")]
+  pub fn warm_opcache<'env>(
+    &self,
+    env: &'env Env,
+    scripts: Vec<String>,
+  ) -> Result<PromiseRaw<'env, u32>> {
+    let embed = self.embed.clone();
+    let compiled = async move {
+      embed
+        .warm_opcache(&scripts)
+        .await
+        .map_err(|err| Error::from_reason(err.to_string()))
+    };
 
-#[napi]
-impl Task for PhpRequestTask {
-  type Output = Response;
-  type JsValue = PhpResponse;
-
-  // Handle the PHP request in the worker thread.
-  fn compute(&mut self) -> Result<Self::Output> {
-    let request = self
-      .request
-      .take()
-      .ok_or_else(|| Error::from_reason("Request already consumed"))?;
-
-    // Extract body buffer and body handle before moving request
-    let body_buffer_data: Option<bytes::Bytes> =
-      if let Some(buf) = request.extensions().get::<http_handler::BodyBuffer>() {
-        if !buf.is_empty() {
-          Some(bytes::Bytes::copy_from_slice(buf.as_bytes()))
-        } else {
-          None
-        }
-      } else {
-        None
-      };
-    let request_body = request.body().clone();
+    env.spawn_future_with_callback(compiled, |_env, compiled| Ok(compiled as u32))
+  }
 
-    // Write request body concurrently with handle() to avoid thread pool exhaustion
-    // If a BodyBuffer is present, write and close the stream automatically
-    // Otherwise, JavaScript code must call request.end() to close the stream
-    let _write_handle = fallback_handle().spawn(async move {
-      use tokio::io::AsyncWriteExt;
+  /// Wait until every worker thread is ready to serve requests, then compile
+  /// the given scripts into the opcode cache.
+  ///
+  /// Paths are relative to the docroot. The first call also waits for the
+  /// `opcache.warm` scripts, and rejects if they failed to compile or if the
+  /// `opcache.jit` could not be enabled. Call this before taking traffic so
+  /// the first requests do not pay for startup.
+  ///
+  /// # Examples
+  ///
+  /// ```js
+  /// const php = new Php({ worker: 'worker.php', keepEngine: true });
+  ///
+  /// const { ready, workers } = await php.warmup(['index.php']);
+  /// ```
+  #[napi(ts_return_type = "Promise<PhpWarmupReport>")]
+  pub fn warmup<'env>(
+    &self,
+    env: &'env Env,
+    scripts: Option<Vec<String>>,
+  ) -> Result<PromiseRaw<'env, PhpWarmupReport>> {
+    let embed = self.embed.clone();
+    let scripts = scripts.unwrap_or_default();
+    let report = async move {
+      embed
+        .warmup(&scripts)
+        .await
+        .map_err(|err| Error::from_reason(err.to_string()))
+    };
 
-      let mut body = request_body;
+    env.spawn_future_with_callback(report, |_env, report| {
+      Ok(PhpWarmupReport {
+        ready: report.ready as u32,
+        workers: report.workers as u32,
+        compiled: report.compiled as u32,
+        duration_ms: report.elapsed.as_secs_f64() * 1000.0,
+      })
+    })
+  }
 
-      // If there's a BodyBuffer extension, write it (if not empty)
-      if let Some(data) = body_buffer_data {
-        let _ = body.write_all(&data).await;
-      }
+  /// Get counters describing how requests to this PHP instance are admitted to
+  /// its worker threads.
+  ///
+  /// # Examples
+  ///
+  /// ```js
+  /// const php = new Php({ queueTimeout: 1000, shedLoad: true });
+  ///
+  /// const { queued, running, rejected } = php.poolStats();
+  /// ```
+  #[napi]
+  pub fn pool_stats(&self) -> PhpPoolStats {
+    let stats = self.embed.pool_stats();
+    PhpPoolStats {
+      queued: stats.queued as u32,
+      running: stats.running as u32,
+      started: stats.started as i64,
+      rejected: stats.rejected as i64,
+      timed_out: stats.timed_out as i64,
+      wait_time_ms: stats.wait_time.as_secs_f64() * 1000.0,
+      ready: stats.ready as u32,
+      workers: stats.workers as u32,
+    }
+  }
 
-      // Always close the stream, even when there's no body
-      let _ = body.shutdown().await;
-    });
-
-    // Call handle() which returns a streaming response
-    // We need to buffer it here for handleRequest/handleRequestSync backward compatibility
-    // Use fallback_handle() to avoid deadlocks in spawn_blocking contexts
-    let mut result = fallback_handle().block_on(async {
-      use http_body_util::BodyExt;
-
-      let response = self.embed.handle(request).await?;
-
-      // Buffer the streaming body for backward compatibility
-      let (parts, body) = response.into_parts();
-
-      // Collect body chunks, capturing any exceptions sent through the stream
-      let mut body_buffer = bytes::BytesMut::new();
-      let mut exception: Option<String> = None;
-
-      let mut stream = body;
-      loop {
-        match stream.frame().await {
-          Some(frame_result) => match frame_result {
-            Ok(frame) => {
-              if let Ok(data) = frame.into_data() {
-                body_buffer.extend_from_slice(&data);
-              }
-            }
-            Err(e) => {
-              exception = Some(e.to_string());
-              break;
-            }
-          },
-          None => break,
-        }
-      }
+  /// Get the PHP call stacks sampled from requests to this instance, and
+  /// optionally start over. Empty unless the `profiler` option is set.
+  ///
+  /// # Examples
+  ///
+  /// ```js
+  /// const php = new Php({ profiler: { intervalMs: 5, everyNthRequest: 10 } });
+  ///
+  /// // Later, write out the stacks for a flame graph tool
+  /// const { folded } = php.profile(true);
+  /// ```
+  #[napi]
+  pub fn profile(&self, reset: Option<bool>) -> PhpProfile {
+    let profile = self.embed.profile(reset.unwrap_or_default());
+    PhpProfile {
+      samples: profile.samples as i64,
+      requests: profile.requests as i64,
+      folded: profile.folded(),
+    }
+  }
 
-      let mut response = Response::from_parts(parts, http_handler::ResponseBody::new());
+  /// Get request counters, latency histograms and memory peaks for this PHP
+  /// instance.
+  ///
+  /// # Examples
+  ///
+  /// ```js
+  /// const php = new Php();
+  ///
+  /// const { requests, bailouts, requestDuration } = php.metrics();
+  /// ```
+  #[napi]
+  pub fn metrics(&self) -> PhpMetrics {
+    self.embed.metrics().into()
+  }
 
-      // Add buffered body to extensions
-      response
-        .extensions_mut()
-        .insert(http_handler::BodyBuffer::from_bytes(body_buffer.freeze()));
-
-      // Add exception to extensions if one occurred
-      if let Some(ex) = exception {
-        response
-          .extensions_mut()
-          .insert(http_handler::ResponseException(ex));
-      }
+  /// Render the metrics for this PHP instance in the Prometheus text format.
+  ///
+  /// # Examples
+  ///
+  /// ```js
+  /// const php = new Php();
+  ///
+  /// app.get('/metrics', (req, res) => res.type('text/plain').send(php.prometheusMetrics()));
+  /// ```
+  #[napi]
+  pub fn prometheus_metrics(&self) -> String {
+    self.embed.metrics().to_prometheus()
+  }
 
-      Ok::<_, EmbedRequestError>(response)
-    });
-
-    // Translate the various error types into HTTP error responses
-    if !self.throw_request_errors {
-      result = result.or_else(|err| {
-        let (mut response, body_content) = match err {
-          EmbedRequestError::ScriptNotFound(_script_name) => (
-            http_handler::response::Builder::new()
-              .status(404)
-              .body(http_handler::ResponseBody::new())
-              .unwrap(),
-            "Not Found",
-          ),
-          _ => (
-            http_handler::response::Builder::new()
-              .status(500)
-              .body(http_handler::ResponseBody::new())
-              .unwrap(),
-            "Internal Server Error",
-          ),
-        };
-
-        // Add body content as BodyBuffer extension
-        response
-          .extensions_mut()
-          .insert(http_handler::BodyBuffer::from_bytes(body_content));
-
-        Ok(response)
-      })
+  /// Get counters describing how often PHP workers were blocked writing
+  /// output to slow response consumers, across all PHP instances.
+  ///
+  /// # Examples
+  ///
+  /// ```js
+  /// const { parkedWrites, parkedTimeMs } = Php.backpressureStats();
+  /// ```
+  #[napi]
+  pub fn backpressure_stats() -> PhpBackpressureStats {
+    let stats = backpressure_stats();
+    PhpBackpressureStats {
+      parked_writes: stats.parked_writes as i64,
+      parked_time_ms: stats.parked_time.as_secs_f64() * 1000.0,
+      aborted_writes: stats.aborted_writes as i64,
     }
-
-    result.map_err(|err| Error::from_reason(err.to_string()))
   }
+}
 
-  // Handle converting the PHP response to a JavaScript response in the main thread.
-  fn resolve(&mut self, _env: Env, output: Self::Output) -> Result<Self::JsValue> {
-    Ok(Into::<PhpResponse>::into(output))
+// Let an AbortSignal interrupt the request even after it has started running,
+// including while its output is waiting on a slow consumer.
+fn with_abort(mut request: Request, signal: Option<&AbortSignal>) -> Request {
+  if let Some(signal) = signal {
+    let abort = RequestAbort::new();
+    request.extensions_mut().insert(abort.clone());
+    signal.on_abort(move || abort.abort());
   }
+  request
 }
 
-/// Task container to run a PHP streaming request in a worker thread.
-pub struct PhpStreamTask {
+// Handle a request and buffer the whole response body, for handleRequest and
+// handleRequestSync. Only handleRequest may leave the request body to be
+// written from JavaScript, when asked to, as handleRequestSync blocks the
+// thread doing so.
+async fn handle_buffered(
   embed: Arc<Embed>,
-  request: Option<Request>,
+  mut request: Request,
   throw_request_errors: bool,
+  server_timing: bool,
+  stream_body: bool,
+) -> Result<Response> {
+  use tokio::io::AsyncWriteExt;
+
+  // A body given up front stays in its BodyBuffer extension and is served to
+  // PHP directly from those bytes, so the stream only needs closing. Closing
+  // it even when there is no body keeps reads from waiting on JavaScript.
+  // A streamed body is read by PHP as it arrives, and uploads are written to
+  // temporary files part by part rather than held in memory.
+  if !(stream_body && !has_body_buffer(&request)) {
+    let mut request_body = request.body().clone();
+    let _ = request_body.shutdown().await;
+  }
+
+  // PHP writes the body straight into a buffer recycled by its worker, which
+  // arrives in the BodyBuffer extension once the script has finished.
+  request.extensions_mut().insert(BufferedResponse);
+
+  let result = embed.handle(request).await.map(|mut response| {
+    // The body has ended, so every phase has been recorded by now
+    if server_timing {
+      add_server_timing(&mut response);
+    }
+    response
+  });
+
+  // A script which failed after sending headers still has a response, with
+  // the error in its ResponseException extension.
+  if throw_request_errors {
+    if let Some(exception) = result.as_ref().ok().and_then(|response| {
+      response
+        .extensions()
+        .get::<http_handler::ResponseException>()
+    }) {
+      return Err(Error::from_reason(exception.0.clone()));
+    }
+  }
+
+  error_response(result, throw_request_errors)
 }
 
-#[napi]
-impl Task for PhpStreamTask {
-  type Output = Response;
-  type JsValue = Object<'static>;
-
-  // Handle the PHP streaming request in the worker thread.
-  fn compute(&mut self) -> Result<Self::Output> {
-    // Take ownership of the request to preserve the body channels
-    let request = self
-      .request
-      .take()
-      .ok_or_else(|| Error::from_reason("Request already consumed"))?;
-
-    // Extract body buffer and body handle before moving request
-    let body_buffer_data: Option<bytes::Bytes> =
-      if let Some(buf) = request.extensions().get::<http_handler::BodyBuffer>() {
-        if !buf.is_empty() {
-          Some(bytes::Bytes::copy_from_slice(buf.as_bytes()))
-        } else {
-          None
-        }
-      } else {
-        None
-      };
-    let has_body_buffer = body_buffer_data.is_some();
-    let request_body = request.body().clone();
-
-    // Write request body concurrently with handle() to avoid thread pool exhaustion
-    // If a BodyBuffer is present, write and close the stream automatically
-    // Otherwise, JavaScript code must call request.end() to close the stream
-    let _write_handle = fallback_handle().spawn(async move {
-      use tokio::io::AsyncWriteExt;
-
-      let mut body = request_body;
-
-      // If body was provided in constructor (BodyBuffer exists), write it and close the stream
-      if let Some(data) = body_buffer_data {
-        let _ = body.write_all(&data).await;
-      }
-      // Close the stream if body was fully provided
-      if has_body_buffer {
-        let _ = body.shutdown().await;
-      }
-      // If no BodyBuffer, JavaScript will write via req.write() and close via req.end()
-      // Don't touch the stream here to avoid "broken pipe" errors
-    });
-
-    // Use fallback_handle() to avoid deadlocks in spawn_blocking contexts
-    let mut result = fallback_handle().block_on(async {
-      // Let write task run concurrently with handle()
-      self.embed.handle(request).await
-    });
-
-    // Translate the various error types into HTTP error responses
-    if !self.throw_request_errors {
-      result = result.or_else(|err| {
-        let (mut response, body_content) = match err {
-          EmbedRequestError::ScriptNotFound(_script_name) => (
-            http_handler::response::Builder::new()
-              .status(404)
-              .body(http_handler::ResponseBody::new())
-              .unwrap(),
-            "Not Found",
-          ),
-          _ => (
-            http_handler::response::Builder::new()
-              .status(500)
-              .body(http_handler::ResponseBody::new())
-              .unwrap(),
-            "Internal Server Error",
-          ),
-        };
-
-        // Store body content in BodyBuffer extension
-        response
-          .extensions_mut()
-          .insert(http_handler::BodyBuffer::from_bytes(bytes::Bytes::from(
-            body_content,
-          )));
-
-        Ok(response)
-      });
+// Handle a request, resolving as soon as headers are sent with the body still
+// streaming, for handleStream.
+async fn handle_streaming(
+  embed: Arc<Embed>,
+  request: Request,
+  throw_request_errors: bool,
+  server_timing: bool,
+) -> Result<Response> {
+  use tokio::io::AsyncWriteExt;
+
+  // A body given up front stays in its BodyBuffer extension and is served to
+  // PHP directly from those bytes, so the stream only needs closing.
+  // Otherwise, JavaScript writes via req.write() and closes via req.end(), so
+  // don't touch the stream here to avoid "broken pipe" errors.
+  if has_body_buffer(&request) {
+    let mut request_body = request.body().clone();
+    let _ = request_body.shutdown().await;
+  }
+
+  // Only phases up to the first byte are known before the body is streamed
+  let result = embed.handle(request).await.map(|mut response| {
+    if server_timing {
+      add_server_timing(&mut response);
     }
+    response
+  });
+  error_response(result, throw_request_errors)
+}
+
+// Whether a request body was given up front.
+fn has_body_buffer(request: &Request) -> bool {
+  request
+    .extensions()
+    .get::<http_handler::BodyBuffer>()
+    .is_some_and(|buf| !buf.is_empty())
+}
+
+// Append the phases recorded so far to the response as a Server-Timing header.
+fn add_server_timing(response: &mut Response) {
+  let Some(timing) = response.extensions().get::<RequestTiming>() else {
+    return;
+  };
 
-    result.map_err(|e| Error::from_reason(e.to_string()))
+  if let Ok(value) = http_handler::HeaderValue::from_str(&timing.server_timing()) {
+    response.headers_mut().append("server-timing", value);
   }
+}
+
+// Translate the various error types into HTTP error responses, unless request
+// errors should be thrown.
+fn error_response(
+  result: std::result::Result<Response, EmbedRequestError>,
+  throw_request_errors: bool,
+) -> Result<Response> {
+  let err = match result {
+    Ok(response) => return Ok(response),
+    Err(err) if throw_request_errors => return Err(Error::from_reason(err.to_string())),
+    Err(err) => err,
+  };
+
+  let (status, body_content) = match err {
+    EmbedRequestError::ScriptNotFound(_script_name) => (404, "Not Found"),
+    EmbedRequestError::ServiceUnavailable
+    | EmbedRequestError::QueueTimeout
+    | EmbedRequestError::TenantLimitReached => (503, "Service Unavailable"),
+    EmbedRequestError::DeadlineExceeded => (504, "Gateway Timeout"),
+    _ => (500, "Internal Server Error"),
+  };
+
+  let mut response = http_handler::response::Builder::new()
+    .status(status)
+    .body(http_handler::ResponseBody::new())
+    .map_err(|err| Error::from_reason(err.to_string()))?;
+
+  // Add body content as BodyBuffer extension
+  response
+    .extensions_mut()
+    .insert(http_handler::BodyBuffer::from_bytes(body_content));
+
+  Ok(response)
+}
+
+// Reject with an AbortError if the request is aborted before it resolves. The
+// PHP side observes the same abort through the RequestAbort extension.
+async fn abortable<F>(future: F, abort: Option<RequestAbort>) -> Result<Response>
+where
+  F: std::future::Future<Output = Result<Response>>,
+{
+  let Some(abort) = abort else {
+    return future.await;
+  };
 
-  // Handle converting the PHP response to a JavaScript response in the main thread.
-  fn resolve(&mut self, env: Env, output: Self::Output) -> Result<Self::JsValue> {
-    let response: PhpResponse = Into::<PhpResponse>::into(output);
-    response.make_streamable(env)
+  tokio::select! {
+    result = future => result,
+    _ = abort.aborted() => Err(Error::new(Status::Cancelled, "AbortError".to_string())),
   }
 }
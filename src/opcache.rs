@@ -0,0 +1,108 @@
+use std::path::PathBuf;
+
+use ext_php_rs::{
+  types::ZendCallable,
+  zend::{try_catch, try_catch_first, ExecutorGlobals},
+};
+
+use crate::{scopes::RequestScope, worker, EmbedRequestError};
+
+/// Compile scripts into the opcode cache without executing them.
+///
+/// Runs on a worker thread. Outside of worker mode a request is started to
+/// compile within, in worker mode the worker script's request is used.
+/// Returns the number of scripts which were compiled successfully.
+pub(crate) fn compile(scripts: &[PathBuf]) -> Result<usize, EmbedRequestError> {
+  if worker::current_handler().is_some() {
+    return Ok(compile_all(scripts));
+  }
+
+  try_catch_first(|| {
+    let _request_scope = RequestScope::new()?;
+    Ok(compile_all(scripts))
+  })
+  .unwrap_or(Err(EmbedRequestError::Bailout))
+}
+
+/// State of the OPcache JIT, as reported by `opcache_get_status()`.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct JitStatus {
+  /// Whether the JIT was enabled at startup.
+  pub enabled: bool,
+
+  /// Whether the JIT is currently compiling code.
+  pub on: bool,
+
+  /// Size of the buffer for compiled code, in bytes.
+  pub buffer_size: u64,
+
+  /// Bytes of the buffer not yet holding compiled code.
+  pub buffer_free: u64,
+}
+
+/// Get the state of the JIT from OPcache.
+///
+/// Runs on a worker thread, like [`compile`]. Returns `None` when OPcache is
+/// not loaded.
+pub(crate) fn jit_status() -> Result<Option<JitStatus>, EmbedRequestError> {
+  if worker::current_handler().is_some() {
+    return Ok(read_jit_status());
+  }
+
+  try_catch_first(|| {
+    let _request_scope = RequestScope::new()?;
+    Ok(read_jit_status())
+  })
+  .unwrap_or(Err(EmbedRequestError::Bailout))
+}
+
+fn read_jit_status() -> Option<JitStatus> {
+  let get_status = ZendCallable::try_from_name("opcache_get_status").ok()?;
+  let status = try_catch(std::panic::AssertUnwindSafe(|| {
+    get_status.try_call(vec![&false]).ok()
+  }))
+  .ok()
+  .flatten()?;
+  ExecutorGlobals::take_exception();
+
+  // Without a jit entry, PHP was built without JIT support
+  let Some(jit) = status.array().and_then(|status| status.get("jit")) else {
+    return Some(JitStatus::default());
+  };
+  let jit = jit.array()?;
+
+  let flag = |key: &str| jit.get(key).and_then(|v| v.bool()).unwrap_or(false);
+  let bytes = |key: &str| jit.get(key).and_then(|v| v.long()).unwrap_or(0).max(0) as u64;
+
+  Some(JitStatus {
+    enabled: flag("enabled"),
+    on: flag("on"),
+    buffer_size: bytes("buffer_size"),
+    buffer_free: bytes("buffer_free"),
+  })
+}
+
+fn compile_all(scripts: &[PathBuf]) -> usize {
+  let Ok(compile_file) = ZendCallable::try_from_name("opcache_compile_file") else {
+    return 0;
+  };
+
+  scripts
+    .iter()
+    .filter(|script| {
+      let path = script.display().to_string();
+      let compiled = try_catch(std::panic::AssertUnwindSafe(|| {
+        compile_file
+          .try_call(vec![&path])
+          .is_ok_and(|result| result.bool().unwrap_or(false))
+      }))
+      .unwrap_or(false);
+
+      // Compile errors are reported as exceptions, which must not leak into
+      // the next script or request.
+      ExecutorGlobals::take_exception();
+
+      compiled
+    })
+    .count()
+}
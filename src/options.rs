@@ -0,0 +1,468 @@
+use std::{
+  collections::BTreeMap, ops::Deref, path::PathBuf, sync::Arc, thread::available_parallelism,
+  time::Duration,
+};
+
+use crate::{Functions, RuntimeOptions, Sessions};
+
+/// Options for constructing an [`Embed`](crate::Embed) instance.
+///
+/// # Examples
+///
+/// ```
+/// use php::EmbedOptions;
+///
+/// let options = EmbedOptions {
+///   workers: 4,
+///   ..Default::default()
+/// };
+///
+/// assert_eq!(options.workers, 4);
+/// ```
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct EmbedOptions {
+  /// Number of PHP worker threads.
+  ///
+  /// Each worker initializes PHP's thread-local storage once and then serves
+  /// requests until the `Embed` is dropped.
+  pub workers: usize,
+
+  /// Maximum number of requests waiting for a free worker.
+  ///
+  /// When the queue is full, `Embed::handle` waits for a slot to free up
+  /// rather than spawning more threads.
+  pub queue_size: usize,
+
+  /// Longest a request may wait for a free worker before failing with
+  /// `QueueTimeout`. Waits indefinitely when unset.
+  pub queue_timeout: Option<Duration>,
+
+  /// Longest a script may run once it reaches a worker before it is stopped
+  /// with a fatal error, failing with `DeadlineExceeded`. Runs indefinitely
+  /// when unset.
+  ///
+  /// Scripts are also stopped when their [`RequestAbort`](crate::RequestAbort)
+  /// is aborted. Either is noticed the next time the script calls a function
+  /// or loops, so time spent within one call such as `sleep()` runs on.
+  pub request_timeout: Option<Duration>,
+
+  /// Fail requests with `ServiceUnavailable` as soon as the queue is full,
+  /// rather than waiting for space in it.
+  pub shed_load: bool,
+
+  /// Worker script to boot once per worker thread, relative to the docroot.
+  ///
+  /// When set, every request is dispatched into this long-lived script through
+  /// `php_node_handle_request()` instead of executing the requested file, so
+  /// application bootstrapping only happens once per worker.
+  pub worker: Option<PathBuf>,
+
+  /// Enable and configure the OPcache extension.
+  ///
+  /// OPcache settings are applied when the PHP engine starts, which happens once
+  /// per process while any `Embed` is alive. All instances alive at the same
+  /// time must agree on these settings.
+  pub opcache: Option<OpcacheOptions>,
+
+  /// Bytes of PHP output to coalesce before writing to the response stream.
+  ///
+  /// Output is also written out on `flush()` and at the end of the request.
+  /// Set to zero to write every chunk of output through immediately.
+  pub output_buffer_size: usize,
+
+  /// How long to remember which script a request path resolves to.
+  ///
+  /// Only scripts which were found are cached, so new scripts are served
+  /// right away, but removed ones may not be noticed until this passes. Zero,
+  /// the default, resolves every request against the filesystem.
+  pub path_cache_ttl: Duration,
+
+  /// Remember what each request is rewritten to.
+  ///
+  /// Entries are keyed by the method, full URI and headers, and expire after
+  /// `path_cache_ttl`, like the path cache. Rules matching on or rewriting
+  /// headers are cached correctly, but requests differing in any header, such
+  /// as a cookie, do not share entries. Only enable this when rewrite rules
+  /// depend on nothing but the request and the filesystem.
+  pub cache_rewrites: bool,
+
+  /// Options for the tokio runtime shared by all `Embed` instances.
+  pub runtime: RuntimeOptions,
+
+  /// INI settings applied when the PHP engine starts, overriding the built-in
+  /// defaults and any OPcache options.
+  ///
+  /// The engine is shared by every `Embed` in the process, so all instances
+  /// alive at the same time must agree on these, like OPcache settings.
+  pub ini: BTreeMap<String, String>,
+
+  /// INI settings applied at the start of every request to this instance,
+  /// such as `memory_limit`.
+  ///
+  /// These only last for the request, so instances sharing the engine may
+  /// use different values. Settings PHP only reads at startup must go in
+  /// `ini` instead, and fail the request with `IniRejected` here.
+  pub request_ini: BTreeMap<String, String>,
+
+  /// Applications served from their own docroots, routed by host or path
+  /// prefix.
+  ///
+  /// Requests go to the first matching tenant, or to the instance's own
+  /// docroot when none match. Tenants share the workers, the PHP engine and
+  /// the opcode cache. They are not supported in worker mode.
+  pub tenants: Vec<TenantOptions>,
+
+  /// Keep PHP sessions in this store instead of files on disk.
+  ///
+  /// Requests to this instance use the `php_node` save handler, which does
+  /// not lock sessions, so concurrent requests of the same user are not
+  /// serialized. The last request to finish writes the session.
+  pub sessions: Option<Sessions>,
+
+  /// Serve files which are not PHP scripts straight from the docroot,
+  /// without involving a worker.
+  ///
+  /// Without this, every file a request resolves to is run as a PHP script.
+  pub static_files: Option<StaticFileOptions>,
+
+  /// Functions scripts of this instance may call through `node_call()`.
+  pub functions: Option<Functions>,
+
+  /// Keep the PHP engine running for the rest of the process, even once
+  /// every `Embed` has been dropped.
+  ///
+  /// Otherwise the engine shuts down with the last instance and starts again
+  /// with the next one. Its startup settings can then no longer change, and
+  /// later instances with different `ini` fail with `ResidentConfigConflict`.
+  pub keep_engine: bool,
+
+  /// Sample the PHP call stacks of requests to this instance, to be read
+  /// back with [`Embed::profile`](crate::Embed::profile).
+  pub profiler: Option<ProfilerOptions>,
+}
+
+impl Default for EmbedOptions {
+  fn default() -> Self {
+    let workers = available_parallelism().map(|n| n.get()).unwrap_or(1);
+
+    Self {
+      workers,
+      queue_size: workers * 8,
+      queue_timeout: None,
+      request_timeout: None,
+      shed_load: false,
+      worker: None,
+      opcache: None,
+      output_buffer_size: 8 * 1024,
+      path_cache_ttl: Duration::ZERO,
+      cache_rewrites: false,
+      runtime: RuntimeOptions::default(),
+      ini: BTreeMap::new(),
+      request_ini: BTreeMap::new(),
+      tenants: Vec::new(),
+      sessions: None,
+      static_files: None,
+      functions: None,
+      keep_engine: false,
+      profiler: None,
+    }
+  }
+}
+
+/// Options for sampling the PHP call stacks of requests.
+///
+/// # Examples
+///
+/// ```
+/// use std::time::Duration;
+/// use php::{EmbedOptions, ProfilerOptions};
+///
+/// let options = EmbedOptions {
+///   profiler: Some(ProfilerOptions {
+///     interval: Duration::from_millis(5),
+///     every_nth_request: 10,
+///   }),
+///   ..Default::default()
+/// };
+///
+/// assert!(options.profiler.is_some());
+/// ```
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ProfilerOptions {
+  /// Time between samples of a profiled request, at least a millisecond.
+  ///
+  /// Samples are taken the next time the script calls a function or loops,
+  /// so time spent within one call such as `sleep()` is not sampled.
+  pub interval: Duration,
+
+  /// Profile one in every this many requests, so `1` profiles them all.
+  /// Requests which are not profiled cost nothing.
+  pub every_nth_request: u32,
+}
+
+impl Default for ProfilerOptions {
+  fn default() -> Self {
+    Self {
+      interval: Duration::from_millis(10),
+      every_nth_request: 1,
+    }
+  }
+}
+
+// Web assets served by default, leaving out data files such as `.json`, `.sql`
+// and `.txt` which applications often keep beside their scripts.
+const STATIC_FILE_EXTENSIONS: &[&str] = &[
+  "html", "htm", "css", "js", "mjs", "map", "svg", "png", "jpg", "jpeg", "gif", "webp", "avif",
+  "ico", "woff", "woff2", "ttf", "otf", "wasm", "pdf", "mp3", "mp4", "webm",
+];
+
+/// Options for serving static files from the docroot.
+///
+/// # Examples
+///
+/// ```
+/// use php::{EmbedOptions, StaticFileOptions};
+///
+/// let options = EmbedOptions {
+///   static_files: Some(StaticFileOptions {
+///     extensions: vec!["css".into(), "js".into(), "png".into()],
+///     cache_control: Some("public, max-age=3600".into()),
+///     ..Default::default()
+///   }),
+///   ..Default::default()
+/// };
+///
+/// assert!(options.static_files.is_some());
+/// ```
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct StaticFileOptions {
+  /// Extensions of the files to serve, without the dot and ignoring case.
+  /// Defaults to common web assets, such as stylesheets, scripts, images and
+  /// fonts. When empty, no file is served.
+  ///
+  /// Scripts PHP may run, such as `.php`, `.phtml` and `.inc` files, are never
+  /// served even when listed, nor are files and directories whose names start
+  /// with a dot.
+  pub extensions: Vec<String>,
+
+  /// Largest file to keep in memory, in bytes. Cached files are served for
+  /// `path_cache_ttl` without checking the filesystem, larger files are read
+  /// for every request. Set to zero to cache nothing.
+  pub max_cached_size: u64,
+
+  /// `Cache-Control` header to send with every file.
+  pub cache_control: Option<String>,
+}
+
+impl Default for StaticFileOptions {
+  fn default() -> Self {
+    Self {
+      extensions: STATIC_FILE_EXTENSIONS
+        .iter()
+        .map(|ext| ext.to_string())
+        .collect(),
+      max_cached_size: 64 * 1024,
+      cache_control: None,
+    }
+  }
+}
+
+/// An application served by a shared `Embed` from its own docroot.
+///
+/// # Examples
+///
+/// ```
+/// use php::{EmbedOptions, TenantOptions};
+///
+/// let options = EmbedOptions {
+///   tenants: vec![TenantOptions {
+///     host: Some("blog.example.com".into()),
+///     docroot: "/srv/blog".into(),
+///     max_requests: Some(16),
+///     ..Default::default()
+///   }],
+///   ..Default::default()
+/// };
+///
+/// assert_eq!(options.tenants.len(), 1);
+/// ```
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct TenantOptions {
+  /// Host to serve, compared without the port and ignoring case. Matches any
+  /// host when unset.
+  pub host: Option<String>,
+
+  /// Path prefix to serve, matched on whole path segments. It is stripped
+  /// before resolving the script, so `/blog/index.php` runs `index.php`.
+  /// Matches any path when unset.
+  pub prefix: Option<String>,
+
+  /// Document root of this application.
+  pub docroot: PathBuf,
+
+  /// INI settings applied to every request for this application, on top of
+  /// the instance's `request_ini`.
+  pub request_ini: BTreeMap<String, String>,
+
+  /// Most requests of this application which may be queued or running at
+  /// once. Further requests fail with `TenantLimitReached`, so one busy
+  /// application cannot take every worker.
+  pub max_requests: Option<usize>,
+}
+
+/// Options for the OPcache extension.
+///
+/// # Examples
+///
+/// ```
+/// use php::OpcacheOptions;
+///
+/// let opcache = OpcacheOptions {
+///   memory_consumption: Some(256),
+///   validate_timestamps: Some(false),
+///   ..Default::default()
+/// };
+///
+/// assert!(opcache.ini_entries().contains("opcache.memory_consumption=256"));
+/// ```
+///
+/// Enable the tracing JIT for CPU-bound code:
+///
+/// ```
+/// use php::{JitMode, OpcacheOptions};
+///
+/// let opcache = OpcacheOptions {
+///   jit: Some(JitMode::Tracing),
+///   jit_buffer_size: Some(128),
+///   ..Default::default()
+/// };
+///
+/// assert!(opcache.ini_entries().contains("opcache.jit=tracing"));
+/// assert!(opcache.ini_entries().contains("opcache.jit_buffer_size=128M"));
+/// ```
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct OpcacheOptions {
+  /// Shared memory size in megabytes (`opcache.memory_consumption`).
+  pub memory_consumption: Option<u32>,
+
+  /// Maximum number of cached scripts (`opcache.max_accelerated_files`).
+  pub max_accelerated_files: Option<u32>,
+
+  /// Check scripts for changes on disk (`opcache.validate_timestamps`).
+  ///
+  /// Disable in production when files do not change while running.
+  pub validate_timestamps: Option<bool>,
+
+  /// Seconds between timestamp checks (`opcache.revalidate_freq`).
+  pub revalidate_freq: Option<u32>,
+
+  /// Script, relative to the docroot, to preload at engine startup
+  /// (`opcache.preload`).
+  pub preload: Option<PathBuf>,
+
+  /// User to run the preload script as when running as root
+  /// (`opcache.preload_user`).
+  pub preload_user: Option<String>,
+
+  /// Scripts, relative to the docroot, to compile into the cache when the
+  /// `Embed` is constructed. Compiled in the background, and reported by
+  /// [`Embed::warmup`](crate::Embed::warmup).
+  pub warm: Vec<PathBuf>,
+
+  /// Compile hot code to machine code (`opcache.jit`). Off when unset.
+  ///
+  /// [`Embed::warmup`](crate::Embed::warmup) fails with `JitUnavailable` if
+  /// PHP could not enable the JIT, such as when it was built without JIT
+  /// support.
+  pub jit: Option<JitMode>,
+
+  /// Memory for JIT compiled code in megabytes (`opcache.jit_buffer_size`).
+  /// Defaults to 64 when `jit` is set.
+  pub jit_buffer_size: Option<u32>,
+}
+
+/// How the OPcache JIT selects code to compile.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum JitMode {
+  /// Compile the hot paths traced through running code. Usually the fastest
+  /// for long-running, CPU-bound code.
+  Tracing,
+
+  /// Compile whole functions once they are called often.
+  Function,
+}
+
+impl JitMode {
+  /// The `opcache.jit` value for this mode.
+  pub fn as_str(&self) -> &'static str {
+    match self {
+      JitMode::Tracing => "tracing",
+      JitMode::Function => "function",
+    }
+  }
+}
+
+impl OpcacheOptions {
+  /// Render these options as INI entries to apply at engine startup.
+  pub fn ini_entries(&self) -> String {
+    let mut ini = vec![
+      "zend_extension=opcache".to_string(),
+      "opcache.enable=1".to_string(),
+      "opcache.enable_cli=1".to_string(),
+    ];
+
+    if let Some(size) = self.memory_consumption {
+      ini.push(format!("opcache.memory_consumption={size}"));
+    }
+    if let Some(files) = self.max_accelerated_files {
+      ini.push(format!("opcache.max_accelerated_files={files}"));
+    }
+    if let Some(validate) = self.validate_timestamps {
+      ini.push(format!("opcache.validate_timestamps={}", validate as u8));
+    }
+    if let Some(freq) = self.revalidate_freq {
+      ini.push(format!("opcache.revalidate_freq={freq}"));
+    }
+    if let Some(preload) = &self.preload {
+      ini.push(format!("opcache.preload=\"{}\"", preload.display()));
+    }
+    if let Some(user) = &self.preload_user {
+      ini.push(format!("opcache.preload_user={user}"));
+    }
+    if let Some(jit) = self.jit {
+      let buffer_size = self.jit_buffer_size.unwrap_or(64);
+      ini.push(format!("opcache.jit={}", jit.as_str()));
+      ini.push(format!("opcache.jit_buffer_size={buffer_size}M"));
+    }
+
+    ini.join("\n")
+  }
+}
+
+/// Implementation given in options, such as a session store.
+///
+/// Options are equal when they share the same implementation, as there is no
+/// other way to tell whether two of them behave alike.
+pub(crate) struct Shared<T: ?Sized>(pub(crate) Arc<T>);
+
+impl<T: ?Sized> Clone for Shared<T> {
+  fn clone(&self) -> Self {
+    Self(self.0.clone())
+  }
+}
+
+impl<T: ?Sized> Deref for Shared<T> {
+  type Target = Arc<T>;
+
+  fn deref(&self) -> &Self::Target {
+    &self.0
+  }
+}
+
+impl<T: ?Sized> PartialEq for Shared<T> {
+  fn eq(&self, other: &Self) -> bool {
+    Arc::ptr_eq(&self.0, &other.0)
+  }
+}
+
+impl<T: ?Sized> Eq for Shared<T> {}
@@ -0,0 +1,484 @@
+use std::{
+  cell::{Cell, RefCell},
+  panic::{catch_unwind, AssertUnwindSafe},
+  path::PathBuf,
+  sync::{
+    atomic::{AtomicU64, AtomicUsize, Ordering},
+    Arc, Mutex,
+  },
+  thread::JoinHandle,
+  time::{Duration, Instant},
+};
+
+use tokio::sync::{
+  mpsc::{self, error::TrySendError},
+  oneshot, Notify,
+};
+
+use crate::{sapi::Sapi, scopes::ThreadScope, worker, EmbedRequestError, EmbedStartError};
+
+/// A unit of work to run on a PHP worker thread.
+pub(crate) type Job = Box<dyn FnOnce() + Send + 'static>;
+
+pub(crate) type JobReceiver = Arc<Mutex<mpsc::Receiver<Job>>>;
+
+thread_local! {
+  // How long this worker took to initialize PHP's thread-local storage, until
+  // it is taken by the first request to run on it.
+  static THREAD_INIT: Cell<Option<Duration>> = const { Cell::new(None) };
+
+  // Index of this worker thread within its pool.
+  static WORKER_INDEX: Cell<usize> = const { Cell::new(0) };
+
+  // Counters of the pool this worker belongs to, until it has been counted
+  // as ready to take requests.
+  static PENDING_READY: RefCell<Option<Arc<Counters>>> = const { RefCell::new(None) };
+}
+
+/// A fixed-size pool of threads which each hold initialized PHP thread-local
+/// storage for their entire lifetime.
+///
+/// Jobs are pulled from a bounded queue, so a burst of requests waits for a
+/// free worker instead of growing the number of threads without limit.
+///
+/// Requests are admitted through [`WorkerPool::admit`], which can shed load
+/// when the queue is full and drop requests that waited too long.
+pub(crate) struct WorkerPool {
+  sender: Option<mpsc::Sender<Job>>,
+  threads: Vec<JoinHandle<()>>,
+  admission: Admission,
+  counters: Arc<Counters>,
+}
+
+/// How requests are admitted when every worker is busy.
+#[derive(Debug, Clone, Copy, Default)]
+pub(crate) struct Admission {
+  /// Longest a request may wait, for queue space and then for a worker.
+  pub queue_timeout: Option<Duration>,
+
+  /// Reject requests immediately when the queue is full, instead of waiting.
+  pub shed_load: bool,
+}
+
+/// Counters describing how requests are admitted to the worker pool.
+///
+/// # Examples
+///
+/// ```no_run
+/// # use std::env::current_dir;
+/// # use php::Embed;
+/// # let embed = Embed::new(current_dir().unwrap(), None).unwrap();
+/// let stats = embed.pool_stats();
+/// println!("{} queued, {} running", stats.queued, stats.running);
+/// ```
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct PoolStats {
+  /// Requests waiting for a worker, including those waiting for queue space.
+  pub queued: usize,
+
+  /// Requests currently running on a worker.
+  pub running: usize,
+
+  /// Requests which started running on a worker.
+  pub started: u64,
+
+  /// Requests rejected because the queue was full.
+  pub rejected: u64,
+
+  /// Requests dropped because they waited longer than the queue timeout.
+  pub timed_out: u64,
+
+  /// Total time started requests spent waiting for a worker.
+  pub wait_time: Duration,
+
+  /// Worker threads which have initialized PHP and, in worker mode, booted
+  /// the worker script, so they can take requests.
+  pub ready: usize,
+
+  /// Worker threads in the pool.
+  pub workers: usize,
+}
+
+#[derive(Default)]
+struct Counters {
+  ready: AtomicUsize,
+  ready_changed: Notify,
+  queued: AtomicUsize,
+  running: AtomicUsize,
+  started: AtomicU64,
+  rejected: AtomicU64,
+  timed_out: AtomicU64,
+  wait_nanos: AtomicU64,
+}
+
+// Decrements the running count when a job finishes, even if it panics.
+struct RunningGuard(Arc<Counters>);
+
+impl Drop for RunningGuard {
+  fn drop(&mut self) {
+    self.0.running.fetch_sub(1, Ordering::Relaxed);
+  }
+}
+
+impl WorkerPool {
+  /// Start `workers` threads sharing a queue of at most `queue_size` jobs.
+  ///
+  /// When a worker script is given, each thread boots that script once and
+  /// jobs are dispatched into it through `php_node_handle_request()` rather
+  /// than being run directly.
+  pub fn new(
+    sapi: Arc<Sapi>,
+    workers: usize,
+    queue_size: usize,
+    admission: Admission,
+    worker_script: Option<PathBuf>,
+  ) -> Result<Self, EmbedStartError> {
+    let (sender, receiver) = mpsc::channel::<Job>(queue_size.max(1));
+    let receiver: JobReceiver = Arc::new(Mutex::new(receiver));
+
+    let mut pool = WorkerPool {
+      sender: Some(sender),
+      threads: Vec::with_capacity(workers.max(1)),
+      admission,
+      counters: Arc::default(),
+    };
+
+    for i in 0..workers.max(1) {
+      let receiver = receiver.clone();
+      let sapi = sapi.clone();
+      let worker_script = worker_script.clone();
+      let counters = pool.counters.clone();
+
+      let thread = std::thread::Builder::new()
+        .name(format!("php-worker-{i}"))
+        .spawn(move || worker_loop(i, sapi, receiver, worker_script, counters))
+        .map_err(|_| EmbedStartError::WorkerPoolNotStarted)?;
+
+      pool.threads.push(thread);
+    }
+
+    Ok(pool)
+  }
+
+  /// Queue a job to run on the next free worker.
+  ///
+  /// Waits asynchronously while the queue is full. The returned receiver
+  /// resolves with the job's return value once it has run.
+  pub async fn spawn<F, R>(&self, job: F) -> Result<oneshot::Receiver<R>, EmbedRequestError>
+  where
+    F: FnOnce() -> R + Send + 'static,
+    R: Send + 'static,
+  {
+    let sender = self
+      .sender
+      .as_ref()
+      .ok_or(EmbedRequestError::WorkerUnavailable)?;
+
+    let (tx, rx) = oneshot::channel();
+    let job: Job = Box::new(move || {
+      let _ = tx.send(job());
+    });
+
+    sender
+      .send(job)
+      .await
+      .map_err(|_| EmbedRequestError::WorkerUnavailable)?;
+
+    Ok(rx)
+  }
+
+  /// Admit a request job to the queue, applying the admission policy.
+  ///
+  /// With load shedding, a full queue fails immediately with
+  /// `ServiceUnavailable`. Otherwise this waits for space, up to the queue
+  /// timeout if one is set. A job still queued when the timeout passes is not
+  /// run, and its receiver resolves with `QueueTimeout` instead.
+  pub async fn admit<F, R>(
+    &self,
+    job: F,
+  ) -> Result<oneshot::Receiver<Result<R, EmbedRequestError>>, EmbedRequestError>
+  where
+    F: FnOnce() -> Result<R, EmbedRequestError> + Send + 'static,
+    R: Send + 'static,
+  {
+    let sender = self
+      .sender
+      .as_ref()
+      .ok_or(EmbedRequestError::WorkerUnavailable)?;
+
+    let queued_at = Instant::now();
+    let deadline = self
+      .admission
+      .queue_timeout
+      .map(|timeout| queued_at + timeout);
+    let counters = self.counters.clone();
+
+    let (tx, rx) = oneshot::channel();
+    let job: Job = Box::new(move || {
+      counters.queued.fetch_sub(1, Ordering::Relaxed);
+
+      if deadline.is_some_and(|deadline| Instant::now() > deadline) {
+        counters.timed_out.fetch_add(1, Ordering::Relaxed);
+        let _ = tx.send(Err(EmbedRequestError::QueueTimeout));
+        return;
+      }
+
+      let waited = queued_at.elapsed().as_nanos() as u64;
+      counters.wait_nanos.fetch_add(waited, Ordering::Relaxed);
+      counters.started.fetch_add(1, Ordering::Relaxed);
+      counters.running.fetch_add(1, Ordering::Relaxed);
+      let _running = RunningGuard(counters);
+
+      let _ = tx.send(job());
+    });
+
+    self.counters.queued.fetch_add(1, Ordering::Relaxed);
+
+    let sent = match sender.try_send(job) {
+      Ok(()) => Ok(()),
+      Err(TrySendError::Closed(_)) => Err(EmbedRequestError::WorkerUnavailable),
+      Err(TrySendError::Full(_)) if self.admission.shed_load => {
+        Err(EmbedRequestError::ServiceUnavailable)
+      }
+      Err(TrySendError::Full(job)) => match deadline {
+        Some(deadline) => tokio::time::timeout_at(deadline.into(), sender.send(job))
+          .await
+          .map_err(|_| EmbedRequestError::QueueTimeout)
+          .and_then(|sent| sent.map_err(|_| EmbedRequestError::WorkerUnavailable)),
+        None => sender
+          .send(job)
+          .await
+          .map_err(|_| EmbedRequestError::WorkerUnavailable),
+      },
+    };
+
+    if let Err(err) = sent {
+      self.counters.queued.fetch_sub(1, Ordering::Relaxed);
+      match err {
+        EmbedRequestError::ServiceUnavailable => &self.counters.rejected,
+        EmbedRequestError::QueueTimeout => &self.counters.timed_out,
+        _ => return Err(err),
+      }
+      .fetch_add(1, Ordering::Relaxed);
+      return Err(err);
+    }
+
+    Ok(rx)
+  }
+
+  /// Get a snapshot of the admission counters.
+  pub fn stats(&self) -> PoolStats {
+    let counters = &self.counters;
+    PoolStats {
+      queued: counters.queued.load(Ordering::Relaxed),
+      running: counters.running.load(Ordering::Relaxed),
+      started: counters.started.load(Ordering::Relaxed),
+      rejected: counters.rejected.load(Ordering::Relaxed),
+      timed_out: counters.timed_out.load(Ordering::Relaxed),
+      wait_time: Duration::from_nanos(counters.wait_nanos.load(Ordering::Relaxed)),
+      ready: counters.ready.load(Ordering::Acquire),
+      workers: self.threads.len(),
+    }
+  }
+
+  /// Wait until every worker is ready to take requests, or `timeout` passes.
+  /// Returns how many workers are ready.
+  pub async fn wait_ready(&self, timeout: Duration) -> usize {
+    let counters = &self.counters;
+    let workers = self.threads.len();
+
+    let all_ready = async {
+      loop {
+        let changed = counters.ready_changed.notified();
+        if counters.ready.load(Ordering::Acquire) >= workers {
+          return;
+        }
+        changed.await;
+      }
+    };
+    let _ = tokio::time::timeout(timeout, all_ready).await;
+
+    counters.ready.load(Ordering::Acquire)
+  }
+
+  /// Queue a job without waiting, failing if the queue is currently full.
+  pub fn try_spawn<F, R>(&self, job: F) -> Result<oneshot::Receiver<R>, EmbedRequestError>
+  where
+    F: FnOnce() -> R + Send + 'static,
+    R: Send + 'static,
+  {
+    let sender = self
+      .sender
+      .as_ref()
+      .ok_or(EmbedRequestError::WorkerUnavailable)?;
+
+    let (tx, rx) = oneshot::channel();
+    let job: Job = Box::new(move || {
+      let _ = tx.send(job());
+    });
+
+    sender
+      .try_send(job)
+      .map_err(|_| EmbedRequestError::WorkerUnavailable)?;
+
+    Ok(rx)
+  }
+}
+
+impl Drop for WorkerPool {
+  fn drop(&mut self) {
+    // Closing the queue lets each worker drain the remaining jobs and exit,
+    // which runs its ThreadScope cleanup before the Sapi can be shut down.
+    self.sender.take();
+
+    for thread in self.threads.drain(..) {
+      let _ = thread.join();
+    }
+  }
+}
+
+fn worker_loop(
+  index: usize,
+  sapi: Arc<Sapi>,
+  receiver: JobReceiver,
+  worker_script: Option<PathBuf>,
+  counters: Arc<Counters>,
+) {
+  WORKER_INDEX.set(index);
+  PENDING_READY.set(Some(counters));
+
+  // NOTE: Declaration order matters here. The ThreadScope must be dropped
+  // before this thread releases its reference to the Sapi.
+  let _sapi = sapi;
+  let started = Instant::now();
+  let _thread_scope = ThreadScope::new();
+  THREAD_INIT.set(Some(started.elapsed()));
+
+  // Worker scripts are ready once they first ask for a request
+  if let Some(script) = worker_script {
+    worker::run(&script, &receiver);
+    return;
+  }
+
+  mark_ready();
+
+  while let Some(job) = next_job(&receiver) {
+    // A panicking job drops its result sender, which the waiting request
+    // observes as an error. The worker itself stays available.
+    let _ = catch_unwind(AssertUnwindSafe(job));
+  }
+}
+
+/// Take how long the current worker thread took to initialize, if no earlier
+/// request on this thread has taken it already.
+pub(crate) fn take_thread_init() -> Option<Duration> {
+  THREAD_INIT.take()
+}
+
+/// Count the current worker thread as ready to take requests. Only the first
+/// call on each thread has any effect.
+pub(crate) fn mark_ready() {
+  if let Some(counters) = PENDING_READY.take() {
+    counters.ready.fetch_add(1, Ordering::Release);
+    counters.ready_changed.notify_waiters();
+  }
+}
+
+/// Index of the current worker thread within its pool.
+pub(crate) fn worker_index() -> usize {
+  WORKER_INDEX.get()
+}
+
+pub(crate) fn next_job(receiver: &JobReceiver) -> Option<Job> {
+  receiver
+    .lock()
+    .unwrap_or_else(|poisoned| poisoned.into_inner())
+    .blocking_recv()
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+  use crate::sapi::ensure_sapi;
+  use std::collections::HashSet;
+
+  #[test]
+  fn test_jobs_share_fixed_threads() {
+    let sapi = ensure_sapi().expect("should start sapi");
+    let pool = WorkerPool::new(sapi, 2, 4, Admission::default(), None).expect("should start pool");
+
+    let names = tokio_test::block_on(async {
+      let mut receivers = Vec::new();
+      for _ in 0..16 {
+        let rx = pool
+          .spawn(|| std::thread::current().name().map(str::to_string))
+          .await
+          .expect("should queue job");
+        receivers.push(rx);
+      }
+
+      let mut names = HashSet::new();
+      for rx in receivers {
+        names.insert(rx.await.expect("should run job"));
+      }
+      names
+    });
+
+    assert!(names.len() <= 2);
+    assert!(names.iter().all(|name| name
+      .as_deref()
+      .is_some_and(|n| n.starts_with("php-worker-"))));
+  }
+
+  #[test]
+  fn test_wait_ready() {
+    let sapi = ensure_sapi().expect("should start sapi");
+    let pool = WorkerPool::new(sapi, 3, 4, Admission::default(), None).expect("should start pool");
+
+    let ready = tokio_test::block_on(pool.wait_ready(Duration::from_secs(10)));
+    assert_eq!(ready, 3);
+    assert_eq!(pool.stats().ready, pool.stats().workers);
+  }
+
+  #[test]
+  fn test_full_queue_sheds_load() {
+    let sapi = ensure_sapi().expect("should start sapi");
+    let admission = Admission {
+      shed_load: true,
+      ..Default::default()
+    };
+    let pool = WorkerPool::new(sapi, 1, 1, admission, None).expect("should start pool");
+
+    let (release_tx, release_rx) = std::sync::mpsc::channel::<()>();
+    let (started_tx, started_rx) = std::sync::mpsc::channel::<()>();
+
+    tokio_test::block_on(async {
+      // Occupy the only worker, then fill the only queue slot.
+      let running = pool
+        .admit(move || {
+          let _ = started_tx.send(());
+          let _ = release_rx.recv();
+          Ok(())
+        })
+        .await
+        .expect("should admit running job");
+      started_rx.recv().expect("job should start");
+
+      let queued = pool.admit(|| Ok(())).await.expect("should queue job");
+
+      assert_eq!(
+        pool.admit(|| Ok(())).await.err(),
+        Some(EmbedRequestError::ServiceUnavailable)
+      );
+
+      let stats = pool.stats();
+      assert_eq!(stats.queued, 1);
+      assert_eq!(stats.running, 1);
+      assert_eq!(stats.rejected, 1);
+
+      release_tx.send(()).expect("should release worker");
+      assert_eq!(running.await, Ok(Ok(())));
+      assert_eq!(queued.await, Ok(Ok(())));
+    });
+  }
+}
@@ -0,0 +1,323 @@
+//! Sampling profiler for the PHP code run by an `Embed`.
+//!
+//! Tools like perf only see the engine's C frames, not the PHP functions it
+//! is running. While a profiled request runs, a ticker on the async runtime
+//! raises the worker thread's VM interrupt every sampling interval. The
+//! interrupt hook then walks `EG(current_execute_data)` on the worker thread
+//! and counts the call stack it finds. Stacks are kept per instance and
+//! exported in the folded format read by flame graph tools.
+
+use std::{
+  cell::RefCell,
+  collections::HashMap,
+  fmt::Write,
+  sync::{
+    atomic::{AtomicU64, Ordering},
+    Arc, Mutex,
+  },
+  time::Duration,
+};
+
+use ext_php_rs::ffi::{zend_execute_data, zend_string};
+
+use crate::{interrupt::Trigger, ProfilerOptions};
+
+// Most distinct stacks kept. Samples of further stacks are counted together,
+// so code with endless distinct stacks can not grow the profile without limit.
+const MAX_STACKS: usize = 10_000;
+
+// Stack samples are counted under once MAX_STACKS is reached.
+const OTHER_STACKS: &str = "[other]";
+
+// Deepest stack recorded, counting from the innermost frame.
+const MAX_FRAMES: usize = 256;
+
+// zend_function.type of functions written in PHP.
+const ZEND_USER_FUNCTION: u8 = 2;
+
+thread_local! {
+  // Sampling of the request running on this worker thread.
+  static CURRENT: RefCell<Option<Arc<Sampler>>> = const { RefCell::new(None) };
+}
+
+/// Call stacks sampled from the requests of an `Embed`.
+///
+/// # Examples
+///
+/// ```
+/// use php::Profile;
+///
+/// let profile = Profile {
+///   samples: 3,
+///   requests: 1,
+///   stacks: vec![
+///     ("/srv/index.php;render".into(), 2),
+///     ("/srv/index.php".into(), 1),
+///   ],
+/// };
+///
+/// assert_eq!(profile.folded(), "/srv/index.php;render 2\n/srv/index.php 1\n");
+/// ```
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct Profile {
+  /// Stacks sampled.
+  pub samples: u64,
+
+  /// Requests which were profiled.
+  pub requests: u64,
+
+  /// Each distinct stack, outermost frame first and separated by `;`, with
+  /// the number of times it was sampled. Most sampled first.
+  pub stacks: Vec<(String, u64)>,
+}
+
+impl Profile {
+  /// Render the stacks in the folded format, one `stack count` per line, as
+  /// read by `flamegraph.pl`, speedscope and similar tools.
+  pub fn folded(&self) -> String {
+    let mut out = String::new();
+    for (stack, count) in &self.stacks {
+      let _ = writeln!(out, "{stack} {count}");
+    }
+    out
+  }
+}
+
+/// Sampled stacks of one `Embed`, shared with its worker threads.
+pub(crate) struct Profiler {
+  interval: Duration,
+  every_nth_request: u64,
+  seen: AtomicU64,
+  requests: AtomicU64,
+  samples: AtomicU64,
+  stacks: Mutex<HashMap<Box<str>, u64>>,
+}
+
+impl Profiler {
+  pub fn new(options: ProfilerOptions) -> Self {
+    Self {
+      interval: options.interval.max(Duration::from_millis(1)),
+      every_nth_request: options.every_nth_request.max(1) as u64,
+      seen: AtomicU64::new(0),
+      requests: AtomicU64::new(0),
+      samples: AtomicU64::new(0),
+      stacks: Mutex::new(HashMap::new()),
+    }
+  }
+
+  /// Start sampling the request about to run on this thread, if it is one of
+  /// those to profile. Sampling stops when the result is dropped.
+  pub fn start(self: &Arc<Self>) -> Option<Sampling> {
+    if self.seen.fetch_add(1, Ordering::Relaxed) % self.every_nth_request != 0 {
+      return None;
+    }
+    self.requests.fetch_add(1, Ordering::Relaxed);
+
+    let sampler = Arc::new(Sampler {
+      profiler: self.clone(),
+      trigger: Trigger::current(),
+    });
+
+    let ticking = sampler.clone();
+    crate::runtime::handle().spawn(async move {
+      let mut ticks = tokio::time::interval(ticking.profiler.interval);
+      ticks.set_missed_tick_behavior(tokio::time::MissedTickBehavior::Skip);
+      // The first tick completes immediately
+      ticks.tick().await;
+
+      loop {
+        tokio::select! {
+          _ = ticking.trigger.disarmed() => break,
+          _ = ticks.tick() => ticking.trigger.raise(),
+        }
+      }
+    });
+
+    CURRENT.with(|current| *current.borrow_mut() = Some(sampler.clone()));
+    Some(Sampling(sampler))
+  }
+
+  /// Get the stacks sampled so far, optionally starting over.
+  pub fn snapshot(&self, reset: bool) -> Profile {
+    let mut stacks = self.stacks.lock().unwrap_or_else(|e| e.into_inner());
+    let (samples, requests) = if reset {
+      (
+        self.samples.swap(0, Ordering::Relaxed),
+        self.requests.swap(0, Ordering::Relaxed),
+      )
+    } else {
+      (
+        self.samples.load(Ordering::Relaxed),
+        self.requests.load(Ordering::Relaxed),
+      )
+    };
+
+    let mut stacks: Vec<(String, u64)> = if reset {
+      stacks
+        .drain()
+        .map(|(stack, count)| (stack.into(), count))
+        .collect()
+    } else {
+      stacks
+        .iter()
+        .map(|(stack, count)| (stack.to_string(), *count))
+        .collect()
+    };
+    stacks.sort_unstable_by(|a, b| b.1.cmp(&a.1).then_with(|| a.0.cmp(&b.0)));
+
+    Profile {
+      samples,
+      requests,
+      stacks,
+    }
+  }
+
+  fn record(&self, stack: String) {
+    let mut stacks = self.stacks.lock().unwrap_or_else(|e| e.into_inner());
+    self.samples.fetch_add(1, Ordering::Relaxed);
+
+    if let Some(count) = stacks.get_mut(stack.as_str()) {
+      *count += 1;
+      return;
+    }
+
+    let key = if stacks.len() < MAX_STACKS {
+      stack.into_boxed_str()
+    } else {
+      OTHER_STACKS.into()
+    };
+    *stacks.entry(key).or_default() += 1;
+  }
+}
+
+// Sampling of one request, shared by the worker thread and its ticker.
+struct Sampler {
+  profiler: Arc<Profiler>,
+  trigger: Trigger,
+}
+
+/// Sampling of the request running on the current worker thread. Stops when
+/// dropped.
+pub(crate) struct Sampling(Arc<Sampler>);
+
+impl Drop for Sampling {
+  fn drop(&mut self) {
+    self.0.trigger.disarm();
+    CURRENT.with(|current| current.borrow_mut().take());
+  }
+}
+
+/// Record the stack of the script running on this thread if a sample is due.
+/// Called from the VM interrupt hook.
+pub(crate) unsafe fn sample(execute_data: *mut zend_execute_data) {
+  let Some(sampler) = CURRENT.with(|current| current.borrow().clone()) else {
+    return;
+  };
+  if !sampler.trigger.take() {
+    return;
+  }
+
+  if let Some(stack) = folded_stack(execute_data) {
+    sampler.profiler.record(stack);
+  }
+}
+
+// Name every frame from the given one outwards, and join them outermost
+// first. Frames which can not be named, such as the engine's own dummy
+// frames, are skipped.
+unsafe fn folded_stack(mut execute_data: *mut zend_execute_data) -> Option<String> {
+  let mut frames = Vec::new();
+  while let Some(frame) = execute_data.as_ref() {
+    if frames.len() == MAX_FRAMES {
+      break;
+    }
+    if let Some(name) = frame_name(frame) {
+      frames.push(name);
+    }
+    execute_data = frame.prev_execute_data;
+  }
+
+  if frames.is_empty() {
+    return None;
+  }
+
+  let mut stack = String::new();
+  for (i, name) in frames.iter().rev().enumerate() {
+    if i > 0 {
+      stack.push(';');
+    }
+    // Separators of the folded format may not appear within a frame
+    stack.extend(name.chars().map(|c| match c {
+      ';' => ':',
+      '\n' | '\r' => ' ',
+      c => c,
+    }));
+  }
+  Some(stack)
+}
+
+// Functions are named with their class, and the top level code of a file by
+// the file's path.
+unsafe fn frame_name(frame: &zend_execute_data) -> Option<String> {
+  let func = frame.func.as_ref()?;
+  let common = &func.common;
+
+  let Some(name) = zend_str(common.function_name) else {
+    if func.type_ != ZEND_USER_FUNCTION {
+      return None;
+    }
+    return zend_str(func.op_array.filename);
+  };
+
+  match common.scope.as_ref().and_then(|scope| zend_str(scope.name)) {
+    Some(class) => Some(format!("{class}::{name}")),
+    None => Some(name),
+  }
+}
+
+unsafe fn zend_str(string: *mut zend_string) -> Option<String> {
+  let string = string.as_ref()?;
+  Some(String::from_utf8_lossy(string.as_bytes()).into_owned())
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+
+  fn profiler() -> Profiler {
+    Profiler::new(ProfilerOptions::default())
+  }
+
+  #[test]
+  fn test_snapshot_orders_stacks() {
+    let profiler = profiler();
+    profiler.record("main;a".into());
+    profiler.record("main;b".into());
+    profiler.record("main;b".into());
+
+    let profile = profiler.snapshot(false);
+    assert_eq!(profile.samples, 3);
+    assert_eq!(profile.folded(), "main;b 2\nmain;a 1\n");
+  }
+
+  #[test]
+  fn test_snapshot_reset() {
+    let profiler = profiler();
+    profiler.record("main".into());
+
+    assert_eq!(profiler.snapshot(true).samples, 1);
+    assert_eq!(profiler.snapshot(false), Profile::default());
+  }
+
+  #[test]
+  fn test_record_caps_stacks() {
+    let profiler = profiler();
+    for i in 0..MAX_STACKS + 2 {
+      profiler.record(format!("main;f{i}"));
+    }
+
+    let profile = profiler.snapshot(false);
+    assert_eq!(profile.stacks.len(), MAX_STACKS + 1);
+    assert_eq!(profile.stacks[0], (OTHER_STACKS.to_string(), 2));
+  }
+}
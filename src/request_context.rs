@@ -2,45 +2,68 @@
 ///
 /// This wrapper stores the minimal non-Clone state that cannot be moved to extensions:
 /// - The Request itself (for Deref access)
-/// - The response Builder (non-Clone, cannot use std::mem::replace pattern)
-/// - The request Receiver (non-Clone, single ownership)
+/// - The headers sent notification (non-Clone, single ownership)
 ///
 /// All shareable state is stored in Request extensions:
 /// - DocumentRoot (http-handler) - docroot path
 /// - ResponseLog (http-handler) - log buffer
-/// - BodyBuffer (http-handler) - request body buffer
+/// - BufferedBody (custom) - fully buffered request body, if one was given
 /// - ResponseStream (custom) - response body stream
+/// - OutputBuffer (custom) - coalesced output not yet written to the stream
+/// - CapturedOutput (custom) - whole response body of a buffered request
+/// - RequestAbort (custom) - abort signal from the caller, if one was given
 /// - RequestStream (custom) - request body stream
-/// - HeadersSentTx (custom) - headers sent notification
 use bytes::Bytes;
-use ext_php_rs::zend::SapiGlobals;
+use ext_php_rs::zend::{ProcessGlobals, SapiGlobals};
 use http_handler::extensions::{BodyBuffer, DocumentRoot, ResponseLog};
 use http_handler::types::Request;
-use http_handler::RequestExt;
+use http_handler::{HeaderMap, RequestExt};
 use std::ffi::c_void;
 use std::ops::{Deref, DerefMut};
 use std::path::Path;
+use std::sync::atomic::{AtomicUsize, Ordering};
 use tokio::sync::oneshot;
 
-use crate::extensions::{HeadersSentTx, RequestStream, ResponseStream};
+use crate::extensions::{
+  BufferedBody, CapturedOutput, OutputBuffer, RequestAbort, RequestStream, ResponseStream,
+};
+
+// Number of RequestContexts which have not been dropped yet.
+static LIVE: AtomicUsize = AtomicUsize::new(0);
+
+/// Status, headers and logs of a response, sent once PHP sends its headers.
+#[derive(Debug)]
+pub struct SentHeaders {
+  /// HTTP status code.
+  pub status: u16,
+
+  /// Response headers, including `Content-Type`.
+  pub headers: HeaderMap,
+
+  /// Messages logged before the headers were sent, if there were any.
+  pub log: Option<ResponseLog>,
+}
 
 /// The request context for the PHP SAPI.
 ///
 /// This is a minimal wrapper around Request that provides Deref/DerefMut access.
-/// All state is stored in Request extensions.
-pub struct RequestContext(Request);
+/// All shareable state is stored in Request extensions.
+pub struct RequestContext {
+  request: Request,
+  headers_sent: Option<oneshot::Sender<SentHeaders>>,
+}
 
 impl Deref for RequestContext {
   type Target = Request;
 
   fn deref(&self) -> &Self::Target {
-    &self.0
+    &self.request
   }
 }
 
 impl DerefMut for RequestContext {
   fn deref_mut(&mut self) -> &mut Self::Target {
-    &mut self.0
+    &mut self.request
   }
 }
 
@@ -54,7 +77,7 @@ impl RequestContext {
     mut request: Request,
     docroot: P,
     response_body: http_handler::ResponseBody,
-    headers_sent_tx: oneshot::Sender<(u16, String, Vec<(String, String)>, Bytes)>,
+    headers_sent: oneshot::Sender<SentHeaders>,
   ) -> Self
   where
     P: AsRef<Path>,
@@ -69,21 +92,37 @@ impl RequestContext {
 
     request.extensions_mut().insert(ResponseLog::new());
 
-    request.extensions_mut().insert(BodyBuffer::new());
+    // A body given up front is served to PHP directly from its bytes, skipping
+    // the request stream entirely.
+    if let Some(body) = request.extensions_mut().remove::<BodyBuffer>() {
+      if !body.is_empty() {
+        request
+          .extensions_mut()
+          .insert(BufferedBody::new(body.into_bytes_mut().freeze()));
+      }
+    }
 
     request
       .extensions_mut()
       .insert(ResponseStream::new(response_body));
 
-    request
-      .extensions_mut()
-      .insert(HeadersSentTx::new(headers_sent_tx));
-
     request
       .extensions_mut()
       .insert(RequestStream::new(request_body));
 
-    Self(request)
+    LIVE.fetch_add(1, Ordering::Relaxed);
+    Self {
+      request,
+      headers_sent: Some(headers_sent),
+    }
+  }
+
+  /// Number of request contexts alive in the process.
+  ///
+  /// Every context is dropped once its request has finished on a worker, so
+  /// a count which keeps growing while the process is idle points to a leak.
+  pub fn live() -> usize {
+    LIVE.load(Ordering::Relaxed)
   }
 
   /// Sets the current request context for the PHP SAPI.
@@ -127,36 +166,150 @@ impl RequestContext {
     Some(unsafe { Box::from_raw(ptr as *mut RequestContext) })
   }
 
-  /// Signal that headers have been sent with status, mimetype, headers, and logs (streaming mode).
-  pub fn signal_headers_sent_with_data(
-    &mut self,
-    status: u16,
-    mimetype: String,
-    headers: Vec<(String, String)>,
-    logs: Bytes,
-  ) {
-    if let Some(headers_sent_tx) = self.extensions_mut().get_mut::<HeadersSentTx>() {
-      if let Ok(mut guard) = headers_sent_tx.0.try_lock() {
-        if let Some(tx) = guard.take() {
-          let _ = tx.send((status, mimetype, headers, logs));
-        }
+  /// Signal that headers have been sent, handing over the status, headers
+  /// and the log collected so far. Only the first call has any effect.
+  pub fn signal_headers_sent(&mut self, status: u16, headers: HeaderMap) {
+    let Some(headers_sent) = self.headers_sent.take() else {
+      return;
+    };
+
+    // The log is moved out rather than copied, later messages have no
+    // response left to go to.
+    let log = self
+      .extensions_mut()
+      .remove::<ResponseLog>()
+      .filter(|log| !log.as_bytes().is_empty());
+
+    let _ = headers_sent.send(SentHeaders {
+      status,
+      headers,
+      log,
+    });
+  }
+
+  /// Write PHP output to the response stream.
+  ///
+  /// When an OutputBuffer extension is present, small writes are coalesced and
+  /// only reach the stream once its high-water mark is reached. Buffered
+  /// requests collect all output in their CapturedOutput extension instead.
+  /// Returns false if the response stream could not be written to.
+  pub fn write_output(&mut self, bytes: &[u8]) -> bool {
+    if self.extensions().get::<CapturedOutput>().is_some() {
+      return self.capture_output(bytes);
+    }
+
+    let Some(body) = self
+      .extensions()
+      .get::<ResponseStream>()
+      .map(|s| s.0.clone())
+    else {
+      return true;
+    };
+    let abort = self.extensions().get::<RequestAbort>().cloned();
+
+    let Some(output) = self.extensions_mut().get_mut::<OutputBuffer>() else {
+      return write_stream(body, bytes, abort.as_ref());
+    };
+
+    if output.bypass(bytes.len()) {
+      return write_stream(body, bytes, abort.as_ref());
+    }
+
+    if !output.push(bytes) {
+      return true;
+    }
+
+    let written = write_stream(body, output.as_bytes(), abort.as_ref());
+    output.clear();
+    written
+  }
+
+  // Append to the captured body, discarding output once the caller aborted.
+  fn capture_output(&mut self, bytes: &[u8]) -> bool {
+    if self
+      .extensions()
+      .get::<RequestAbort>()
+      .is_some_and(RequestAbort::is_aborted)
+    {
+      // PHP_CONNECTION_ABORTED
+      ProcessGlobals::get_mut().connection_status |= 1;
+      return false;
+    }
+
+    if let Some(captured) = self.extensions_mut().get_mut::<CapturedOutput>() {
+      captured.0.extend_from_slice(bytes);
+    }
+    true
+  }
+
+  /// Take the body collected for a buffered request.
+  pub(crate) fn take_captured_output(&mut self) -> Option<Bytes> {
+    self
+      .extensions_mut()
+      .remove::<CapturedOutput>()
+      .map(CapturedOutput::finish)
+  }
+
+  /// Write any coalesced output through to the response stream.
+  pub fn flush_output(&mut self) -> bool {
+    let Some(body) = self
+      .extensions()
+      .get::<ResponseStream>()
+      .map(|s| s.0.clone())
+    else {
+      return true;
+    };
+    let abort = self.extensions().get::<RequestAbort>().cloned();
+
+    match self.extensions_mut().get_mut::<OutputBuffer>() {
+      Some(output) if !output.is_empty() => {
+        let written = write_stream(body, output.as_bytes(), abort.as_ref());
+        output.clear();
+        written
       }
+      _ => true,
     }
   }
 
   /// Shutdown the response stream to signal EOF to response body consumers.
+  /// Any coalesced output is written first.
   /// This blocks until the shutdown is complete to avoid use-after-free.
   pub fn shutdown_response_stream(&mut self) {
     use tokio::io::AsyncWriteExt;
 
+    self.flush_output();
+
     if let Some(response_stream) = self.extensions().get::<ResponseStream>() {
       let mut body = response_stream.0.clone();
       // IMPORTANT: We must wait for shutdown to complete before returning.
       // Previously this was spawned without waiting, which caused use-after-free:
       // the async task could access memory after RequestContext was dropped.
-      crate::sapi::fallback_handle().block_on(async move {
+      crate::runtime::handle().block_on(async move {
         let _ = body.shutdown().await;
       });
     }
   }
 }
+
+// Write to the response body, parking while the consumer is behind. Once the
+// request is aborted, scripts can observe it through connection_aborted().
+fn write_stream(
+  body: http_handler::ResponseBody,
+  bytes: &[u8],
+  abort: Option<&RequestAbort>,
+) -> bool {
+  let written = crate::backpressure::write(body, bytes, abort);
+
+  if !written && abort.is_some_and(RequestAbort::is_aborted) {
+    // PHP_CONNECTION_ABORTED
+    ProcessGlobals::get_mut().connection_status |= 1;
+  }
+
+  written
+}
+
+impl Drop for RequestContext {
+  fn drop(&mut self) {
+    LIVE.fetch_sub(1, Ordering::Relaxed);
+  }
+}
@@ -0,0 +1,150 @@
+//! The tokio runtime shared by every [`Embed`](crate::Embed) in the process.
+//!
+//! SAPI callbacks block on it from PHP worker threads to drive request and
+//! response streams. With the napi feature it is also handed to napi-rs, so
+//! promises returned to JavaScript are driven by the same threads.
+
+use once_cell::sync::OnceCell;
+use tokio::runtime::{Builder, Handle, Runtime};
+
+use crate::EmbedStartError;
+
+/// Options for the tokio runtime shared by all `Embed` instances.
+///
+/// The runtime is started once per process, by the first `Embed` to be
+/// constructed or the first SAPI callback to need it. Later instances must
+/// leave these unset or agree with the running runtime.
+///
+/// # Examples
+///
+/// ```
+/// use php::{EmbedOptions, RuntimeOptions};
+///
+/// let options = EmbedOptions {
+///   runtime: RuntimeOptions {
+///     worker_threads: Some(2),
+///     ..Default::default()
+///   },
+///   ..Default::default()
+/// };
+///
+/// assert_eq!(options.runtime.worker_threads, Some(2));
+/// ```
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct RuntimeOptions {
+  /// Number of async worker threads. Defaults to one per core.
+  pub worker_threads: Option<usize>,
+
+  /// Maximum number of threads for blocking tasks. Defaults to tokio's limit.
+  pub max_blocking_threads: Option<usize>,
+}
+
+impl RuntimeOptions {
+  /// Read options from the `PHP_NODE_RUNTIME_WORKERS` and
+  /// `PHP_NODE_RUNTIME_BLOCKING_THREADS` environment variables.
+  pub fn from_env() -> Self {
+    let var = |name: &str| std::env::var(name).ok().and_then(|v| v.parse().ok());
+
+    Self {
+      worker_threads: var("PHP_NODE_RUNTIME_WORKERS"),
+      max_blocking_threads: var("PHP_NODE_RUNTIME_BLOCKING_THREADS"),
+    }
+  }
+
+  // Whether these options ask for anything the running runtime doesn't have.
+  fn conflicts_with(&self, running: &RuntimeOptions) -> bool {
+    let differs = |requested: Option<usize>, running: Option<usize>| {
+      requested.is_some() && requested != running
+    };
+
+    differs(self.worker_threads, running.worker_threads)
+      || differs(self.max_blocking_threads, running.max_blocking_threads)
+  }
+}
+
+struct Shared {
+  handle: Handle,
+  options: RuntimeOptions,
+}
+
+static SHARED: OnceCell<Shared> = OnceCell::new();
+
+// Keeps the runtime alive when it isn't owned by napi-rs.
+#[cfg(not(feature = "napi-support"))]
+static OWNED: OnceCell<Runtime> = OnceCell::new();
+
+/// Start the shared runtime with the given options, or check that the one
+/// already running is compatible with them.
+pub(crate) fn init(options: RuntimeOptions) -> Result<&'static Handle, EmbedStartError> {
+  let shared = SHARED.get_or_try_init(|| start(options))?;
+
+  if options.conflicts_with(&shared.options) {
+    return Err(EmbedStartError::RuntimeConfigConflict);
+  }
+
+  Ok(&shared.handle)
+}
+
+/// Get the shared runtime, starting it with default options if needed.
+pub(crate) fn handle() -> &'static Handle {
+  &SHARED
+    .get_or_try_init(|| start(RuntimeOptions::default()))
+    .expect("should start tokio runtime")
+    .handle
+}
+
+fn start(options: RuntimeOptions) -> Result<Shared, EmbedStartError> {
+  let mut builder = Builder::new_multi_thread();
+  builder.enable_all().thread_name("php-node-runtime");
+
+  if let Some(threads) = options.worker_threads {
+    builder.worker_threads(threads.max(1));
+  }
+  if let Some(threads) = options.max_blocking_threads {
+    builder.max_blocking_threads(threads.max(1));
+  }
+
+  let runtime = builder
+    .build()
+    .map_err(|_| EmbedStartError::RuntimeNotStarted)?;
+  let handle = runtime.handle().clone();
+  adopt(runtime);
+
+  Ok(Shared { handle, options })
+}
+
+#[cfg(feature = "napi-support")]
+fn adopt(runtime: Runtime) {
+  napi::bindgen_prelude::create_custom_tokio_runtime(runtime);
+}
+
+#[cfg(not(feature = "napi-support"))]
+fn adopt(runtime: Runtime) {
+  let _ = OWNED.set(runtime);
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+
+  #[test]
+  fn test_conflicting_options() {
+    let running = RuntimeOptions {
+      worker_threads: Some(2),
+      max_blocking_threads: None,
+    };
+
+    assert!(!RuntimeOptions::default().conflicts_with(&running));
+    assert!(!running.conflicts_with(&running));
+    assert!(RuntimeOptions {
+      worker_threads: Some(4),
+      ..Default::default()
+    }
+    .conflicts_with(&running));
+    assert!(RuntimeOptions {
+      max_blocking_threads: Some(8),
+      ..Default::default()
+    }
+    .conflicts_with(&running));
+  }
+}
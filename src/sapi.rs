@@ -1,51 +1,53 @@
 use std::{
   collections::HashMap,
   env::current_exe,
-  ffi::{c_char, c_int, c_void, CStr},
-  sync::{Arc, RwLock, Weak},
+  ffi::{c_char, c_int, c_void, CStr, CString},
+  sync::{atomic::Ordering, Arc, RwLock, Weak},
 };
 
 use bytes::Buf;
 
 use ext_php_rs::{
-  alloc::{efree, estrdup},
+  alloc::efree,
   builders::SapiBuilder,
   embed::{ext_php_rs_sapi_shutdown, ext_php_rs_sapi_startup, SapiModule},
   // exception::register_error_observer,
   ffi::{
-    php_module_shutdown, php_module_startup, php_register_variable, sapi_headers_struct,
+    php_module_shutdown, php_module_startup, php_register_variable_safe, sapi_headers_struct,
     sapi_send_headers, sapi_shutdown, sapi_startup, ZEND_RESULT_CODE_SUCCESS,
   },
   prelude::*,
+  types::Zval,
   zend::{SapiGlobals, SapiHeader},
 };
 
 use once_cell::sync::OnceCell;
 
-use crate::{extensions::ResponseStream, EmbedRequestError, EmbedStartError, RequestContext};
-use http_handler::extensions::{BodyBuffer, ResponseLog};
-use http_handler::RequestExt;
+use crate::{
+  extensions::{BufferedBody, Phase, RequestTiming},
+  metrics::Metrics,
+  strings::{estrndup, with_request_strings},
+  EmbedStartError, RequestContext,
+};
+use http_handler::extensions::ResponseLog;
+use http_handler::{header, HeaderMap, HeaderName, HeaderValue, RequestExt};
 use once_cell::sync::Lazy;
 
-// Fallback runtime for sapi callbacks running in blocking context
-static FALLBACK_RUNTIME: Lazy<tokio::runtime::Runtime> = Lazy::new(|| {
-  tokio::runtime::Builder::new_multi_thread()
-    .enable_all()
-    .build()
-    .expect("Failed to create Tokio runtime")
-});
-
-pub(crate) fn fallback_handle() -> &'static tokio::runtime::Handle {
-  FALLBACK_RUNTIME.handle()
-}
-
 // This is a helper to ensure that PHP is initialized and deinitialized at the
 // appropriate times.
 #[derive(Debug)]
-pub(crate) struct Sapi(RwLock<Box<SapiModule>>);
+pub(crate) struct Sapi {
+  module: RwLock<Box<SapiModule>>,
+
+  // INI entries parsed at startup after php.ini, like `php -d`. The module
+  // holds a pointer to this string, so it must live as long as the module.
+  ini_entries: CString,
+}
 
 impl Sapi {
-  pub fn new() -> Result<Self, EmbedStartError> {
+  pub fn new(ini_entries: &str) -> Result<Self, EmbedStartError> {
+    let ini_entries = CString::new(ini_entries).map_err(|_| EmbedStartError::InvalidIniEntries)?;
+
     let exe_loc = current_exe()
       .map(|p| p.display().to_string())
       .map_err(|_| EmbedStartError::ExeLocationNotFound)?;
@@ -71,6 +73,9 @@ impl Sapi {
     sapi.php_ini_path_override = std::ptr::null_mut();
     sapi.php_ini_ignore_cwd = 1;
     sapi.additional_functions = std::ptr::null();
+    if !ini_entries.as_bytes().is_empty() {
+      sapi.ini_entries = ini_entries.as_ptr() as *mut c_char;
+    }
     // sapi.phpinfo_as_text = 1;
 
     let mut boxed = Box::new(sapi);
@@ -100,13 +105,21 @@ impl Sapi {
     //   }
     // });
 
-    Ok(Sapi(RwLock::new(boxed)))
+    Ok(Sapi {
+      module: RwLock::new(boxed),
+      ini_entries,
+    })
+  }
+
+  /// INI entries this SAPI was started with.
+  pub fn ini_entries(&self) -> &CStr {
+    &self.ini_entries
   }
 }
 
 impl Drop for Sapi {
   fn drop(&mut self) {
-    let sapi = &mut self.0.write().unwrap();
+    let sapi = &mut self.module.write().unwrap();
     if let Some(shutdown) = sapi.shutdown {
       unsafe {
         shutdown(sapi.as_mut());
@@ -122,39 +135,64 @@ impl Drop for Sapi {
 
 pub(crate) static SAPI_INIT: OnceCell<RwLock<Weak<Sapi>>> = OnceCell::new();
 
+// Engine kept running for the rest of the process once an instance asked for
+// it, so later instances start without paying for engine startup again.
+static RESIDENT: OnceCell<Arc<Sapi>> = OnceCell::new();
+
+/// Keep the running SAPI alive after every `Embed` using it has been dropped.
+pub(crate) fn keep_resident(sapi: &Arc<Sapi>) {
+  let _ = RESIDENT.set(sapi.clone());
+}
+
 pub fn ensure_sapi() -> Result<Arc<Sapi>, EmbedStartError> {
+  ensure_sapi_with_ini("")
+}
+
+/// Get the running SAPI, or start one with the given startup INI entries.
+///
+/// Startup INI can only be applied when the engine starts, so this fails if a
+/// SAPI is already running with different entries, including one kept
+/// resident after its instances were dropped.
+pub fn ensure_sapi_with_ini(ini_entries: &str) -> Result<Arc<Sapi>, EmbedStartError> {
   let weak_sapi = SAPI_INIT.get_or_try_init(|| Ok(RwLock::new(Weak::new())))?;
 
+  let check = |sapi: Arc<Sapi>| {
+    if sapi.ini_entries().to_bytes() == ini_entries.as_bytes() {
+      Ok(sapi)
+    } else if RESIDENT
+      .get()
+      .is_some_and(|resident| Arc::ptr_eq(resident, &sapi))
+    {
+      // Unlike other conflicts, this one never clears
+      Err(EmbedStartError::ResidentConfigConflict)
+    } else {
+      Err(EmbedStartError::SapiConfigConflict)
+    }
+  };
+
   if let Some(sapi) = weak_sapi
     .read()
     .map_err(|_| EmbedStartError::SapiNotInitialized)?
     .upgrade()
   {
-    return Ok(sapi);
+    return check(sapi);
   }
 
   let mut rwlock = weak_sapi
     .write()
     .map_err(|_| EmbedStartError::SapiNotInitialized)?;
 
-  let sapi = Sapi::new().map(Arc::new)?;
+  // Another thread may have started the SAPI while waiting for the lock.
+  if let Some(sapi) = rwlock.upgrade() {
+    return check(sapi);
+  }
+
+  let sapi = Sapi::new(ini_entries).map(Arc::new)?;
   *rwlock = Arc::downgrade(&sapi);
 
   Ok(sapi)
 }
 
-fn get_sapi() -> Result<Arc<Sapi>, EmbedRequestError> {
-  if let Some(sapi) = SAPI_INIT.get() {
-    if let Ok(read) = sapi.read() {
-      if let Some(upgraded) = read.upgrade() {
-        return Ok(upgraded);
-      }
-    }
-  }
-
-  Err(EmbedRequestError::SapiNotStarted)
-}
-
 //
 // Sapi functions
 //
@@ -198,7 +236,12 @@ pub extern "C" fn sapi_cli_ini_defaults(ht: *mut ext_php_rs::types::ZendHashTabl
 pub extern "C" fn sapi_module_startup(
   sapi_module: *mut SapiModule,
 ) -> ext_php_rs::ffi::zend_result {
-  unsafe { php_module_startup(sapi_module, get_module()) }
+  let result = unsafe { php_module_startup(sapi_module, get_module()) };
+  if result == ZEND_RESULT_CODE_SUCCESS {
+    crate::session::register();
+    crate::interrupt::register();
+  }
+  result
 }
 
 #[no_mangle]
@@ -223,23 +266,27 @@ pub extern "C" fn sapi_module_shutdown(
 pub extern "C" fn sapi_module_deactivate() -> c_int {
   let mut globals = SapiGlobals::get_mut();
 
-  for i in 0..globals.request_info.argc {
-    maybe_efree(unsafe { *globals.request_info.argv.offset(i as isize) }.cast::<u8>());
-  }
+  // Pointers are cleared as worker mode reactivates SAPI between requests,
+  // and sapi_activate reads some of these before they are replaced.
+  let info = &mut globals.request_info;
+  info.argc = 0;
+  info.argv = std::ptr::null_mut();
+  info.request_method = std::ptr::null();
+  info.content_type = std::ptr::null();
+  info.query_string = std::ptr::null_mut();
+  info.request_uri = std::ptr::null_mut();
+  info.path_translated = std::ptr::null_mut();
 
-  globals.request_info.argc = 0;
-  globals.request_info.argv = std::ptr::null_mut();
+  // Those all pointed into the request string arena, released all at once.
+  // PHP fills the auth fields itself and the cookie data comes from
+  // read_cookies, so those are still owned by the Zend allocator.
+  with_request_strings(|arena| arena.reset());
 
-  maybe_efree(globals.request_info.request_method as *mut u8);
-  maybe_efree(globals.request_info.content_type as *mut u8);
-  maybe_efree(globals.request_info.query_string.cast::<u8>());
-  maybe_efree(globals.request_info.request_uri.cast::<u8>());
-  maybe_efree(globals.request_info.path_translated.cast::<u8>());
-  maybe_efree(globals.request_info.auth_user.cast::<u8>());
-  maybe_efree(globals.request_info.auth_password.cast::<u8>());
-  maybe_efree(globals.request_info.auth_digest.cast::<u8>());
+  maybe_efree(std::mem::replace(&mut info.auth_user, std::ptr::null_mut()).cast::<u8>());
+  maybe_efree(std::mem::replace(&mut info.auth_password, std::ptr::null_mut()).cast::<u8>());
+  maybe_efree(std::mem::replace(&mut info.auth_digest, std::ptr::null_mut()).cast::<u8>());
 
-  maybe_efree(globals.request_info.cookie_data.cast::<u8>());
+  maybe_efree(std::mem::replace(&mut info.cookie_data, std::ptr::null_mut()).cast::<u8>());
 
   ZEND_RESULT_CODE_SUCCESS
 }
@@ -254,8 +301,6 @@ fn maybe_efree(ptr: *mut u8) {
 
 #[no_mangle]
 pub extern "C" fn sapi_module_ub_write(str: *const c_char, str_length: usize) -> usize {
-  use tokio::io::AsyncWriteExt;
-
   if str.is_null() || str_length == 0 {
     return 0;
   }
@@ -269,30 +314,29 @@ pub extern "C" fn sapi_module_ub_write(str: *const c_char, str_length: usize) ->
   }
 
   let bytes = unsafe { std::slice::from_raw_parts(str as *const u8, str_length) };
-  let len = bytes.len();
-
-  if let Some(ctx) = RequestContext::current() {
-    // Get ResponseStream from extensions
-    if let Some(response_stream) = ctx.extensions().get::<ResponseStream>() {
-      // Clone body to avoid holding ctx reference
-      let mut body = response_stream.0.clone();
-
-      // Use block_on to write asynchronously
-      let result = fallback_handle().block_on(async { body.write_all(bytes).await });
 
-      match result {
-        Ok(_) => return len,
-        Err(_) => return 0, // Write error
-      }
-    }
+  let Some(ctx) = RequestContext::current() else {
+    return str_length;
+  };
+  if !ctx.write_output(bytes) {
+    return 0; // Write error
   }
 
-  len
+  if let Some(metrics) = ctx.extensions().get::<Arc<Metrics>>() {
+    metrics
+      .bytes_out
+      .fetch_add(str_length as u64, Ordering::Relaxed);
+  }
+  str_length
 }
 
 #[no_mangle]
 pub extern "C" fn sapi_module_flush(_server_context: *mut c_void) {
   unsafe { sapi_send_headers() };
+
+  if let Some(ctx) = RequestContext::current() {
+    ctx.flush_output();
+  }
 }
 
 #[no_mangle]
@@ -307,54 +351,57 @@ pub extern "C" fn sapi_module_send_headers(sapi_headers: *mut sapi_headers_struc
   use ext_php_rs::ffi::sapi_get_default_content_type;
   use ext_php_rs::zend::SapiHeader;
 
-  // Extract status and mimetype as owned types BEFORE leaving PHP thread
+  // Headers are written straight into the map the response will carry, so
+  // nothing is parsed again on the async side. Names of common headers are
+  // interned by HeaderName rather than allocated.
   if let Some(ctx) = RequestContext::current() {
-    let (status, mimetype_owned) = {
+    if let Some(timing) = ctx.extensions().get::<RequestTiming>() {
+      timing.record_since(Phase::FirstByte, timing.started());
+    }
+
+    let header_list = (!sapi_headers.is_null()).then(|| unsafe { &(*sapi_headers).headers });
+    let mut headers =
+      HeaderMap::with_capacity(header_list.map_or(0, |list| list.count as usize) + 1);
+
+    let status = {
       let h = SapiGlobals::get().sapi_headers;
       let mut mime = h.mimetype;
       if mime.is_null() {
         mime = unsafe { sapi_get_default_content_type() };
       }
 
-      let mime_str = if !mime.is_null() {
-        unsafe { std::ffi::CStr::from_ptr(mime) }
-          .to_str()
-          .unwrap_or("text/html")
-          .to_owned()
-      } else {
-        "text/html".to_owned()
-      };
+      let content_type = (!mime.is_null())
+        .then(|| HeaderValue::from_bytes(unsafe { CStr::from_ptr(mime) }.to_bytes()).ok())
+        .flatten()
+        .unwrap_or(HeaderValue::from_static("text/html"));
+      headers.append(header::CONTENT_TYPE, content_type);
 
       // Free the mimetype if it was allocated
       if !mime.is_null() && mime != h.mimetype {
         unsafe { efree(mime.cast::<u8>()) };
       }
 
-      (h.http_response_code as u16, mime_str)
+      h.http_response_code as u16
     };
 
-    // Extract headers from sapi_headers_struct
-    let mut custom_headers = Vec::new();
-    if !sapi_headers.is_null() {
-      let headers_list = unsafe { &(*sapi_headers).headers };
-
-      for header in headers_list.iter::<SapiHeader>() {
-        let name = header.name();
-        if let Some(value) = header.value() {
-          custom_headers.push((name.to_string(), value.to_string()));
-        }
+    // PHP has already rejected header() calls with line breaks, anything
+    // else HeaderMap would refuse is skipped rather than failing the response.
+    for header in header_list
+      .into_iter()
+      .flat_map(|list| list.iter::<SapiHeader>())
+    {
+      let Some(value) = header.value() else {
+        continue;
+      };
+      if let (Ok(name), Ok(value)) = (
+        HeaderName::from_bytes(header.name().as_bytes()),
+        HeaderValue::from_str(value),
+      ) {
+        headers.append(name, value);
       }
     }
 
-    // Collect logs from ResponseLog extension
-    let logs = if let Some(log_ext) = ctx.extensions().get::<ResponseLog>() {
-      bytes::Bytes::copy_from_slice(log_ext.as_bytes())
-    } else {
-      bytes::Bytes::new()
-    };
-
-    // Signal headers sent with owned data including custom headers and logs
-    ctx.signal_headers_sent_with_data(status, mimetype_owned.clone(), custom_headers, logs);
+    ctx.signal_headers_sent(status, headers);
   }
 
   1 // SAPI_HEADER_SENT_SUCCESSFULLY
@@ -362,247 +409,252 @@ pub extern "C" fn sapi_module_send_headers(sapi_headers: *mut sapi_headers_struc
 
 #[no_mangle]
 pub extern "C" fn sapi_module_read_post(buffer: *mut c_char, length: usize) -> usize {
-  use tokio::io::AsyncReadExt;
+  if buffer.is_null() || length == 0 {
+    return 0;
+  }
 
-  if length == 0 {
+  let Some(ctx) = RequestContext::current() else {
     return 0;
+  };
+
+  let out = unsafe { std::slice::from_raw_parts_mut(buffer as *mut u8, length) };
+  let read = read_body(ctx, out);
+
+  if let Some(metrics) = ctx.extensions().get::<Arc<Metrics>>() {
+    metrics.bytes_in.fetch_add(read as u64, Ordering::Relaxed);
   }
+  read
+}
 
-  let result = RequestContext::current()
-    .and_then(|ctx| {
-      // Get or create BodyBuffer extension
-      let buffer_len = ctx
-        .extensions()
-        .get::<BodyBuffer>()
-        .map(|b| b.len())
-        .unwrap_or(0);
-
-      // If buffer is empty and we have a request stream, wait for data
-      if buffer_len == 0 {
-        // Check if we have a request stream
-        if let Some(request_stream) = ctx.extensions().get::<crate::extensions::RequestStream>() {
-          // Clone body to avoid holding ctx reference
-          let mut body = request_stream.0.clone();
-
-          // Keep reading chunks until we have enough data or hit EOF
-          loop {
-            // Check current buffer size
-            let current_buffer_len = ctx
-              .extensions()
-              .get::<BodyBuffer>()
-              .map(|b| b.len())
-              .unwrap_or(0);
-
-            // If we have enough data, stop reading
-            if current_buffer_len >= length {
-              break;
-            }
-
-            // Read a chunk from the stream using block_on
-            let read_result = fallback_handle().block_on(async {
-              let mut chunk = vec![0u8; 8192];
-              match body.read(&mut chunk).await {
-                Ok(0) => None, // EOF
-                Ok(n) => {
-                  chunk.truncate(n);
-                  Some(bytes::Bytes::from(chunk))
-                }
-                Err(_) => None, // Error, treat as EOF
-              }
-            });
-
-            // Append data if we got some
-            if let Some(data) = read_result {
-              if !data.is_empty() {
-                // Get or insert BodyBuffer and append data
-                if let Some(body_buf) = ctx.extensions_mut().get_mut::<BodyBuffer>() {
-                  body_buf.append(&data);
-                } else {
-                  ctx.extensions_mut().insert(BodyBuffer::from_bytes(data));
-                }
-              }
-            } else {
-              // EOF reached
-              break;
-            }
-          }
-        }
-      }
+// Fill PHP's buffer from the request body, returning how many bytes were read.
+fn read_body(ctx: &mut RequestContext, out: &mut [u8]) -> usize {
+  use tokio::io::AsyncReadExt;
 
-      // Now read from the buffer
-      // We need to consume data from the buffer, so we'll convert to BytesMut, split, then convert back
-      ctx
-        .extensions_mut()
-        .get_mut::<BodyBuffer>()
-        .and_then(|body| {
-          let actual_length = length.min(body.len());
-          if actual_length == 0 {
-            return None;
-          }
-
-          // Get the bytes as a slice and copy to output buffer
-          let bytes = body.as_bytes();
-          unsafe {
-            std::ptr::copy_nonoverlapping(bytes.as_ptr() as *const c_char, buffer, actual_length);
-          }
-
-          // Now we need to remove the consumed bytes - convert to BytesMut, split, convert back
-          let mut bytes_mut = std::mem::replace(body, BodyBuffer::new()).into_bytes_mut();
-          bytes_mut.advance(actual_length);
-          *body = BodyBuffer::from_bytes(bytes_mut.freeze());
-
-          Some(actual_length)
-        })
-    })
-    .unwrap_or(0);
+  let length = out.len();
 
-  result
+  // Fast path: serve a fully buffered body by advancing through its bytes.
+  if let Some(body) = ctx.extensions_mut().get_mut::<BufferedBody>() {
+    let read = length.min(body.0.len());
+    out[..read].copy_from_slice(&body.0[..read]);
+    body.0.advance(read);
+    return read;
+  }
+
+  // Streaming path: read straight into PHP's buffer. PHP treats a short read
+  // as the end of the body, so keep reading until it is full or EOF.
+  let Some(request_stream) = ctx.extensions().get::<crate::extensions::RequestStream>() else {
+    return 0;
+  };
+  let mut body = request_stream.0.clone();
+
+  crate::runtime::handle().block_on(async {
+    let mut filled = 0;
+    while filled < length {
+      match body.read(&mut out[filled..]).await {
+        Ok(0) | Err(_) => break,
+        Ok(n) => filled += n,
+      }
+    }
+    filled
+  })
 }
 
 #[no_mangle]
 pub extern "C" fn sapi_module_read_cookies() -> *mut c_char {
   RequestContext::current()
     .map(|ctx| match ctx.headers().get("Cookie") {
-      Some(cookie) => estrdup(cookie.to_str().unwrap_or("")),
+      Some(cookie) => estrndup(cookie.as_bytes()),
       None => std::ptr::null_mut(),
     })
     .unwrap_or(std::ptr::null_mut())
 }
 
-fn env_var<K, V>(
-  vars: *mut ext_php_rs::types::Zval,
-  key: K,
-  value: V,
-) -> Result<(), EmbedRequestError>
-where
-  K: AsRef<str>,
-  V: AsRef<str>,
-{
-  let c_value = estrdup(value.as_ref());
-  env_var_c(vars, key, c_value)?;
-  maybe_efree(c_value.cast::<u8>());
-
-  Ok(())
-}
+// Matches the SAPI name passed to SapiBuilder, which PHP reports itself as.
+const SERVER_SOFTWARE: &CStr = c"php_lang_handler";
 
-fn env_var_c<K>(
-  vars: *mut ext_php_rs::types::Zval,
-  key: K,
-  c_value: *const c_char,
-) -> Result<(), EmbedRequestError>
-where
-  K: AsRef<str>,
-{
-  let c_key = estrdup(key.as_ref());
+// Hostname of this machine, looked up once rather than on every request.
+static SERVER_NAME: Lazy<Option<CString>> = Lazy::new(|| {
+  hostname::get()
+    .ok()
+    .and_then(|name| name.into_string().ok())
+    .and_then(|name| CString::new(name).ok())
+});
+
+// Longest HTTP_* variable name, including the NUL, built on the stack.
+// Longer header names are rare enough to allocate for.
+const MAX_HEADER_VAR_LEN: usize = 128;
+
+// Register a server variable. PHP copies both the name and the value, so the
+// value needs no NUL terminator and neither needs to outlive the call.
+fn register_var(vars: *mut Zval, key: &CStr, value: &[u8]) {
   unsafe {
-    php_register_variable(c_key, c_value, vars);
+    php_register_variable_safe(
+      key.as_ptr(),
+      value.as_ptr() as *const c_char,
+      value.len(),
+      vars,
+    );
   }
-  maybe_efree(c_key.cast::<u8>());
+}
 
-  Ok(())
+fn register_var_c(vars: *mut Zval, key: &CStr, value: *const c_char) {
+  if !value.is_null() {
+    register_var(vars, key, unsafe { CStr::from_ptr(value) }.to_bytes());
+  }
+}
+
+// Register a server variable formatted into a stack buffer, for numbers and
+// addresses which would otherwise each allocate a String.
+fn register_var_display<T: std::fmt::Display>(vars: *mut Zval, key: &CStr, value: T) {
+  use std::io::Write;
+
+  let mut buf = [0u8; 64];
+  let mut cursor = std::io::Cursor::new(&mut buf[..]);
+  if write!(cursor, "{value}").is_ok() {
+    let len = cursor.position() as usize;
+    register_var(vars, key, &buf[..len]);
+  }
+}
+
+// CGI variable names for common headers, to skip building them per request.
+fn known_header_var(name: &str) -> Option<&'static CStr> {
+  Some(match name {
+    "accept" => c"HTTP_ACCEPT",
+    "accept-encoding" => c"HTTP_ACCEPT_ENCODING",
+    "accept-language" => c"HTTP_ACCEPT_LANGUAGE",
+    "authorization" => c"HTTP_AUTHORIZATION",
+    "cache-control" => c"HTTP_CACHE_CONTROL",
+    "connection" => c"HTTP_CONNECTION",
+    "content-length" => c"HTTP_CONTENT_LENGTH",
+    "content-type" => c"HTTP_CONTENT_TYPE",
+    "cookie" => c"HTTP_COOKIE",
+    "host" => c"HTTP_HOST",
+    "if-modified-since" => c"HTTP_IF_MODIFIED_SINCE",
+    "if-none-match" => c"HTTP_IF_NONE_MATCH",
+    "origin" => c"HTTP_ORIGIN",
+    "referer" => c"HTTP_REFERER",
+    "user-agent" => c"HTTP_USER_AGENT",
+    "x-forwarded-for" => c"HTTP_X_FORWARDED_FOR",
+    "x-forwarded-host" => c"HTTP_X_FORWARDED_HOST",
+    "x-forwarded-proto" => c"HTTP_X_FORWARDED_PROTO",
+    "x-real-ip" => c"HTTP_X_REAL_IP",
+    "x-requested-with" => c"HTTP_X_REQUESTED_WITH",
+    _ => return None,
+  })
+}
+
+// Build the HTTP_* variable name for a header into `buf`. Header names are
+// already lowercase ASCII without NUL bytes.
+fn header_var<'a>(name: &str, buf: &'a mut [u8]) -> Option<&'a CStr> {
+  let len = 5 + name.len();
+  if len >= buf.len() {
+    return None;
+  }
+
+  buf[..5].copy_from_slice(b"HTTP_");
+  for (dst, byte) in buf[5..len].iter_mut().zip(name.bytes()) {
+    *dst = match byte {
+      b'-' => b'_',
+      byte => byte.to_ascii_uppercase(),
+    };
+  }
+  buf[len] = 0;
+
+  CStr::from_bytes_with_nul(&buf[..=len]).ok()
+}
+
+fn register_header(vars: *mut Zval, name: &str, value: &[u8]) {
+  if let Some(key) = known_header_var(name) {
+    return register_var(vars, key, value);
+  }
+
+  let mut buf = [0u8; MAX_HEADER_VAR_LEN];
+  match header_var(name, &mut buf) {
+    Some(key) => register_var(vars, key, value),
+    None => {
+      let key = format!("HTTP_{}", name.to_ascii_uppercase().replace('-', "_"));
+      if let Ok(key) = CString::new(key) {
+        register_var(vars, &key, value);
+      }
+    }
+  }
 }
 
 #[no_mangle]
-pub extern "C" fn sapi_module_register_server_variables(vars: *mut ext_php_rs::types::Zval) {
+pub extern "C" fn sapi_module_register_server_variables(vars: *mut Zval) {
+  use std::os::unix::ffi::OsStrExt;
+
   // use ext_php_rs::ffi::php_import_environment_variables;
   // if let Some(f) = php_import_environment_variables {
   //   f(vars);
   // }
 
-  if let Some(ctx) = RequestContext::current() {
-    let headers = ctx.headers();
-    let uri = ctx.uri();
-
-    // Hack to allow ? syntax for the following code.
-    // At the moment any errors are just swallowed, but these could be
-    // collected and reported somehow in the future.
-    Ok::<(), EmbedRequestError>(())
-      .and_then(|_| {
-        for (key, value) in headers.iter() {
-          let value_string = value.to_str().unwrap_or("").to_string();
-          let upper = key.as_str().to_ascii_uppercase();
-          let cgi_key = format!("HTTP_{}", upper.replace("-", "_"));
-          env_var(vars, cgi_key, value_string)?;
-        }
-
-        let globals = SapiGlobals::get();
-        let req_info = &globals.request_info;
-
-        // Get docroot from DocumentRoot extension
-        let docroot_str = ctx
-          .document_root()
-          .map(|dr| dr.path.display().to_string())
-          .unwrap_or_else(|| ".".to_string());
-
-        let script_filename = req_info.path_translated;
-        let script_name = if !req_info.request_uri.is_null() {
-          req_info.request_uri
-        } else {
-          std::ptr::null_mut()
-        };
-
-        env_var(vars, "REQUEST_SCHEME", uri.scheme_str().unwrap_or("http"))?;
-        env_var(vars, "CONTEXT_PREFIX", "")?;
-        env_var(vars, "SERVER_ADMIN", "webmaster@localhost")?;
-        env_var(vars, "GATEWAY_INTERFACE", "CGI/1.1")?;
-
-        // Laravel seems to think "/register" should be "/index.php/register"?
-        // env_var_c(vars, "PHP_SELF", script_name as *mut c_char)?;
-        env_var(vars, "PHP_SELF", uri.path())?;
-
-        // TODO: is "/register", should be "/index.php"
-        env_var(vars, "SCRIPT_NAME", uri.path())?;
-        // env_var_c(vars, "SCRIPT_NAME", script_name as *mut c_char)?;
-        env_var_c(vars, "PATH_INFO", script_name as *mut c_char)?;
-        env_var_c(vars, "SCRIPT_FILENAME", script_filename)?;
-        env_var_c(vars, "PATH_TRANSLATED", script_filename)?;
-        env_var(vars, "DOCUMENT_ROOT", docroot_str.clone())?;
-        env_var(vars, "CONTEXT_DOCUMENT_ROOT", docroot_str)?;
-
-        if let Ok(server_name) = hostname::get() {
-          if let Some(server_name) = server_name.to_str() {
-            env_var(vars, "SERVER_NAME", server_name)?;
-          }
-        }
-
-        if !req_info.request_uri.is_null() {
-          env_var_c(vars, "REQUEST_URI", req_info.request_uri)?;
-        }
-
-        env_var(vars, "SERVER_PROTOCOL", "HTTP/1.1")?;
-
-        let sapi = get_sapi()?;
-        if let Ok(inner_sapi) = sapi.0.read() {
-          env_var_c(vars, "SERVER_SOFTWARE", inner_sapi.name)?;
-        }
-
-        if let Some(socket_info) = ctx.extensions().get::<http_handler::SocketInfo>() {
-          if let Some(local) = socket_info.local {
-            env_var(vars, "SERVER_ADDR", local.ip().to_string())?;
-            env_var(vars, "SERVER_PORT", local.port().to_string())?;
-          }
-          if let Some(remote) = socket_info.remote {
-            env_var(vars, "REMOTE_ADDR", remote.ip().to_string())?;
-            env_var(vars, "REMOTE_PORT", remote.port().to_string())?;
-          }
-        }
-
-        if !req_info.request_method.is_null() {
-          env_var_c(vars, "REQUEST_METHOD", req_info.request_method)?;
-        }
-
-        if !req_info.cookie_data.is_null() {
-          env_var_c(vars, "HTTP_COOKIE", req_info.cookie_data)?;
-        }
-
-        if !req_info.query_string.is_null() {
-          env_var_c(vars, "QUERY_STRING", req_info.query_string)?;
-        }
-
-        Ok(())
-      })
-      .ok();
+  let Some(ctx) = RequestContext::current() else {
+    return;
+  };
+
+  let uri = ctx.uri();
+
+  for (key, value) in ctx.headers().iter() {
+    register_header(vars, key.as_str(), value.as_bytes());
+  }
+
+  let globals = SapiGlobals::get();
+  let req_info = &globals.request_info;
+
+  // Get docroot from DocumentRoot extension
+  let docroot = ctx
+    .document_root()
+    .map(|dr| dr.path.as_os_str().as_bytes())
+    .unwrap_or(b".");
+
+  let script_filename = req_info.path_translated;
+  let script_name = req_info.request_uri;
+
+  register_var(
+    vars,
+    c"REQUEST_SCHEME",
+    uri.scheme_str().unwrap_or("http").as_bytes(),
+  );
+  register_var(vars, c"CONTEXT_PREFIX", b"");
+  register_var(vars, c"SERVER_ADMIN", b"webmaster@localhost");
+  register_var(vars, c"GATEWAY_INTERFACE", b"CGI/1.1");
+
+  // Laravel seems to think "/register" should be "/index.php/register"?
+  // register_var_c(vars, c"PHP_SELF", script_name);
+  register_var(vars, c"PHP_SELF", uri.path().as_bytes());
+
+  // TODO: is "/register", should be "/index.php"
+  register_var(vars, c"SCRIPT_NAME", uri.path().as_bytes());
+  // register_var_c(vars, c"SCRIPT_NAME", script_name);
+  register_var_c(vars, c"PATH_INFO", script_name);
+  register_var_c(vars, c"SCRIPT_FILENAME", script_filename);
+  register_var_c(vars, c"PATH_TRANSLATED", script_filename);
+  register_var(vars, c"DOCUMENT_ROOT", docroot);
+  register_var(vars, c"CONTEXT_DOCUMENT_ROOT", docroot);
+
+  if let Some(server_name) = SERVER_NAME.as_deref() {
+    register_var(vars, c"SERVER_NAME", server_name.to_bytes());
+  }
+
+  register_var_c(vars, c"REQUEST_URI", req_info.request_uri);
+  register_var(vars, c"SERVER_PROTOCOL", b"HTTP/1.1");
+  register_var(vars, c"SERVER_SOFTWARE", SERVER_SOFTWARE.to_bytes());
+
+  if let Some(socket_info) = ctx.extensions().get::<http_handler::SocketInfo>() {
+    if let Some(local) = socket_info.local {
+      register_var_display(vars, c"SERVER_ADDR", local.ip());
+      register_var_display(vars, c"SERVER_PORT", local.port());
+    }
+    if let Some(remote) = socket_info.remote {
+      register_var_display(vars, c"REMOTE_ADDR", remote.ip());
+      register_var_display(vars, c"REMOTE_PORT", remote.port());
+    }
   }
+
+  register_var_c(vars, c"REQUEST_METHOD", req_info.request_method);
+  register_var_c(vars, c"HTTP_COOKIE", req_info.cookie_data);
+  register_var_c(vars, c"QUERY_STRING", req_info.query_string);
 }
 
 #[no_mangle]
@@ -634,7 +686,45 @@ pub fn apache_request_headers() -> Result<HashMap<String, String>, String> {
   Ok(headers)
 }
 
+/// Wait for the next request and run `$handler` to serve it.
+///
+/// Only usable from a worker script. Returns `false` when the worker should
+/// stop looping, for example when the PHP instance is shutting down.
+#[php_function]
+pub fn php_node_handle_request(handler: &Zval) -> bool {
+  crate::worker::handle_request(handler)
+}
+
+/// Call a function of the embedding application with `$payload`, returning
+/// its result.
+///
+/// Throws when no function of that name is available or it fails.
+#[php_function]
+pub fn node_call(name: String, payload: Option<&Zval>) -> Result<Zval, String> {
+  crate::host::call(&name, payload)
+}
+
 #[php_module]
 pub fn module(module: ModuleBuilder<'_>) -> ModuleBuilder<'_> {
-  module.function(wrap_function!(apache_request_headers))
+  module
+    .function(wrap_function!(apache_request_headers))
+    .function(wrap_function!(php_node_handle_request))
+    .function(wrap_function!(node_call))
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+
+  #[test]
+  fn test_header_var() {
+    let mut buf = [0u8; MAX_HEADER_VAR_LEN];
+    assert_eq!(
+      header_var("x-custom-header", &mut buf),
+      Some(c"HTTP_X_CUSTOM_HEADER")
+    );
+
+    let long = "x".repeat(MAX_HEADER_VAR_LEN);
+    assert_eq!(header_var(&long, &mut buf), None);
+  }
 }
@@ -53,6 +53,7 @@ impl RequestScope {
 
 impl Drop for RequestScope {
   fn drop(&mut self) {
+    crate::metrics::sample_memory_peak();
     unsafe {
       php_request_shutdown(std::ptr::null_mut::<c_void>());
     }
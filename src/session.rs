@@ -0,0 +1,457 @@
+//! Native session save handler backed by a store shared by all worker threads.
+//!
+//! PHP's default `files` handler locks a file on disk for the whole of every
+//! request which starts a session, serializing concurrent requests of the same
+//! user. Instances given a [`Sessions`] store instead switch
+//! `session.save_handler` to `php_node` for their requests, which reads and
+//! writes session data in the store without locking.
+//!
+//! The handler is registered with the session extension when the engine
+//! starts. Its callbacks find the store of the running request through the
+//! RequestContext, so instances may each use a different store.
+
+use std::{
+  collections::{hash_map::RandomState, HashMap},
+  ffi::{c_char, c_void},
+  hash::BuildHasher,
+  sync::{
+    atomic::{AtomicBool, Ordering},
+    Arc, Once, RwLock,
+  },
+  time::{Duration, Instant},
+};
+
+use bytes::Bytes;
+use ext_php_rs::{
+  ffi::{ext_php_rs_zend_string_init, zend_long, zend_string},
+  types::ZendStr,
+};
+use once_cell::sync::OnceCell;
+
+use crate::{options::Shared, RequestContext};
+
+/// Name of the save handler, as used for `session.save_handler`.
+pub(crate) const SAVE_HANDLER: &str = "php_node";
+
+// Number of independently locked shards in the memory store.
+const SHARDS: usize = 16;
+
+const SUCCESS: i32 = 0;
+const FAILURE: i32 = -1;
+
+/// Storage for PHP session data.
+///
+/// Methods are called from the PHP worker threads while a request is running,
+/// and block it until they return. PHP encodes and decodes the data itself.
+pub trait SessionStore: Send + Sync {
+  /// Get the data of a session, if it exists and has not expired.
+  fn read(&self, id: &str) -> Option<Bytes>;
+
+  /// Store the data of a session for `ttl`.
+  fn write(&self, id: &str, data: Bytes, ttl: Duration);
+
+  /// Remove a session.
+  fn destroy(&self, id: &str);
+
+  /// Extend the lifetime of a session which was read but not changed.
+  fn touch(&self, id: &str, data: Bytes, ttl: Duration) {
+    self.write(id, data, ttl)
+  }
+
+  /// Remove expired sessions, returning how many were removed. Stores which
+  /// expire sessions on their own can leave this as is.
+  fn gc(&self) -> usize {
+    0
+  }
+}
+
+/// Session store kept in the memory of this process.
+///
+/// Sessions are shared by every worker thread and every instance using the
+/// store, and are lost when the process exits. Expired sessions are never
+/// returned, and are removed when PHP runs session garbage collection.
+#[derive(Default)]
+pub struct MemorySessionStore {
+  shards: [RwLock<HashMap<String, StoredSession>>; SHARDS],
+  hasher: RandomState,
+}
+
+struct StoredSession {
+  data: Bytes,
+  expires: Instant,
+}
+
+impl MemorySessionStore {
+  fn shard(&self, id: &str) -> &RwLock<HashMap<String, StoredSession>> {
+    &self.shards[self.hasher.hash_one(id) as usize % SHARDS]
+  }
+
+  /// Number of sessions held, including expired ones not yet collected.
+  pub fn len(&self) -> usize {
+    self
+      .shards
+      .iter()
+      .map(|shard| shard.read().map_or(0, |shard| shard.len()))
+      .sum()
+  }
+
+  /// Whether no sessions are held.
+  pub fn is_empty(&self) -> bool {
+    self.len() == 0
+  }
+}
+
+impl SessionStore for MemorySessionStore {
+  fn read(&self, id: &str) -> Option<Bytes> {
+    let shard = self
+      .shard(id)
+      .read()
+      .unwrap_or_else(|poisoned| poisoned.into_inner());
+
+    shard
+      .get(id)
+      .filter(|session| session.expires > Instant::now())
+      .map(|session| session.data.clone())
+  }
+
+  fn write(&self, id: &str, data: Bytes, ttl: Duration) {
+    let session = StoredSession {
+      data,
+      expires: Instant::now() + ttl,
+    };
+
+    self
+      .shard(id)
+      .write()
+      .unwrap_or_else(|poisoned| poisoned.into_inner())
+      .insert(id.to_string(), session);
+  }
+
+  fn destroy(&self, id: &str) {
+    self
+      .shard(id)
+      .write()
+      .unwrap_or_else(|poisoned| poisoned.into_inner())
+      .remove(id);
+  }
+
+  fn touch(&self, id: &str, data: Bytes, ttl: Duration) {
+    let mut shard = self
+      .shard(id)
+      .write()
+      .unwrap_or_else(|poisoned| poisoned.into_inner());
+
+    let now = Instant::now();
+    match shard.get_mut(id) {
+      Some(session) if session.expires > now => session.expires = now + ttl,
+      // An expired session is gone, whether or not it was collected yet, so
+      // its stale data must not come back
+      _ => {
+        shard.insert(
+          id.to_string(),
+          StoredSession {
+            data,
+            expires: now + ttl,
+          },
+        );
+      }
+    }
+  }
+
+  fn gc(&self) -> usize {
+    let now = Instant::now();
+
+    self
+      .shards
+      .iter()
+      .map(|shard| {
+        let mut shard = shard
+          .write()
+          .unwrap_or_else(|poisoned| poisoned.into_inner());
+        let before = shard.len();
+        shard.retain(|_, session| session.expires > now);
+        before - shard.len()
+      })
+      .sum()
+  }
+}
+
+/// A session store for `EmbedOptions::sessions`.
+///
+/// # Examples
+///
+/// ```
+/// use php::{EmbedOptions, Sessions};
+///
+/// let options = EmbedOptions {
+///   sessions: Some(Sessions::memory()),
+///   ..Default::default()
+/// };
+/// ```
+#[derive(Clone, PartialEq, Eq)]
+pub struct Sessions(pub(crate) Shared<dyn SessionStore>);
+
+impl Sessions {
+  /// Keep sessions in a [`MemorySessionStore`].
+  pub fn memory() -> Self {
+    Self::new(MemorySessionStore::default())
+  }
+
+  /// Keep sessions in the given store.
+  pub fn new<S: SessionStore + 'static>(store: S) -> Self {
+    Self(Shared(Arc::new(store)))
+  }
+}
+
+impl std::fmt::Debug for Sessions {
+  fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+    f.debug_struct("Sessions").finish_non_exhaustive()
+  }
+}
+
+//
+// Session module registration
+//
+
+// Mirrors ps_module from ext/session/php_session.h.
+#[repr(C)]
+struct PsModule {
+  s_name: *const c_char,
+  s_open: unsafe extern "C" fn(*mut *mut c_void, *const c_char, *const c_char) -> i32,
+  s_close: unsafe extern "C" fn(*mut *mut c_void) -> i32,
+  s_read: unsafe extern "C" fn(
+    *mut *mut c_void,
+    *mut zend_string,
+    *mut *mut zend_string,
+    zend_long,
+  ) -> i32,
+  s_write:
+    unsafe extern "C" fn(*mut *mut c_void, *mut zend_string, *mut zend_string, zend_long) -> i32,
+  s_destroy: unsafe extern "C" fn(*mut *mut c_void, *mut zend_string) -> i32,
+  s_gc: unsafe extern "C" fn(*mut *mut c_void, zend_long, *mut zend_long) -> zend_long,
+  s_create_sid: CreateSid,
+  s_validate_sid: unsafe extern "C" fn(*mut *mut c_void, *mut zend_string) -> i32,
+  s_update_timestamp:
+    unsafe extern "C" fn(*mut *mut c_void, *mut zend_string, *mut zend_string, zend_long) -> i32,
+}
+
+// The module is only ever read by PHP after registration.
+unsafe impl Send for PsModule {}
+unsafe impl Sync for PsModule {}
+
+type CreateSid = unsafe extern "C" fn(*mut *mut c_void) -> *mut zend_string;
+type RegisterModule = unsafe extern "C" fn(*const PsModule) -> i32;
+
+static MODULE: OnceCell<PsModule> = OnceCell::new();
+static REGISTER: Once = Once::new();
+static REGISTERED: AtomicBool = AtomicBool::new(false);
+
+/// Register the save handler with the session extension.
+///
+/// Called once the engine has started. The session extension is optional,
+/// so its functions are looked up at runtime rather than linked against.
+/// Modules registered with it are never removed, so this only happens once
+/// per process even if the engine is restarted.
+pub(crate) fn register() {
+  REGISTER.call_once(|| {
+    let (Some(register), Some(create_sid)) = (
+      lookup::<RegisterModule>(c"php_session_register_module"),
+      lookup::<CreateSid>(c"php_session_create_id"),
+    ) else {
+      return;
+    };
+
+    let module = MODULE.get_or_init(|| PsModule {
+      // Must match SAVE_HANDLER
+      s_name: c"php_node".as_ptr(),
+      s_open: ps_open,
+      s_close: ps_close,
+      s_read: ps_read,
+      s_write: ps_write,
+      s_destroy: ps_destroy,
+      s_gc: ps_gc,
+      s_create_sid: create_sid,
+      s_validate_sid: ps_validate_sid,
+      s_update_timestamp: ps_update_timestamp,
+    });
+
+    // Instances given a store fail to start when this did not succeed,
+    // rather than silently falling back to the files handler.
+    let registered = unsafe { register(module) } == SUCCESS;
+    REGISTERED.store(registered, Ordering::Release);
+  });
+}
+
+/// Whether the save handler is available to instances.
+pub(crate) fn is_registered() -> bool {
+  REGISTERED.load(Ordering::Acquire)
+}
+
+fn lookup<F: Copy>(name: &std::ffi::CStr) -> Option<F> {
+  let symbol = unsafe { libc::dlsym(libc::RTLD_DEFAULT, name.as_ptr()) };
+  if symbol.is_null() {
+    return None;
+  }
+
+  Some(unsafe { std::mem::transmute_copy::<*mut c_void, F>(&symbol) })
+}
+
+// Store of the instance serving the running request.
+fn current_store() -> Option<Arc<dyn SessionStore>> {
+  RequestContext::current()?
+    .extensions()
+    .get::<Sessions>()
+    .map(|sessions| Arc::clone(&sessions.0))
+}
+
+fn key_str<'a>(key: *mut zend_string) -> Option<&'a str> {
+  if key.is_null() {
+    return None;
+  }
+  std::str::from_utf8(unsafe { &*(key as *const ZendStr) }.as_bytes()).ok()
+}
+
+fn value_bytes(value: *mut zend_string) -> Bytes {
+  if value.is_null() {
+    return Bytes::new();
+  }
+  Bytes::copy_from_slice(unsafe { &*(value as *const ZendStr) }.as_bytes())
+}
+
+fn ttl(maxlifetime: zend_long) -> Duration {
+  Duration::from_secs(maxlifetime.max(0) as u64)
+}
+
+unsafe extern "C" fn ps_open(
+  _mod_data: *mut *mut c_void,
+  _save_path: *const c_char,
+  _session_name: *const c_char,
+) -> i32 {
+  if current_store().is_some() {
+    SUCCESS
+  } else {
+    FAILURE
+  }
+}
+
+unsafe extern "C" fn ps_close(_mod_data: *mut *mut c_void) -> i32 {
+  SUCCESS
+}
+
+unsafe extern "C" fn ps_read(
+  _mod_data: *mut *mut c_void,
+  key: *mut zend_string,
+  val: *mut *mut zend_string,
+  _maxlifetime: zend_long,
+) -> i32 {
+  let (Some(store), Some(id)) = (current_store(), key_str(key)) else {
+    return FAILURE;
+  };
+
+  // A missing session reads as empty, PHP then starts a new one
+  let data = store.read(id).unwrap_or_default();
+  *val = ext_php_rs_zend_string_init(data.as_ptr() as *const c_char, data.len(), false);
+  SUCCESS
+}
+
+unsafe extern "C" fn ps_write(
+  _mod_data: *mut *mut c_void,
+  key: *mut zend_string,
+  val: *mut zend_string,
+  maxlifetime: zend_long,
+) -> i32 {
+  let (Some(store), Some(id)) = (current_store(), key_str(key)) else {
+    return FAILURE;
+  };
+
+  store.write(id, value_bytes(val), ttl(maxlifetime));
+  SUCCESS
+}
+
+unsafe extern "C" fn ps_destroy(_mod_data: *mut *mut c_void, key: *mut zend_string) -> i32 {
+  let (Some(store), Some(id)) = (current_store(), key_str(key)) else {
+    return FAILURE;
+  };
+
+  store.destroy(id);
+  SUCCESS
+}
+
+unsafe extern "C" fn ps_gc(
+  _mod_data: *mut *mut c_void,
+  _maxlifetime: zend_long,
+  nrdels: *mut zend_long,
+) -> zend_long {
+  let removed = current_store().map_or(0, |store| store.gc()) as zend_long;
+  if !nrdels.is_null() {
+    *nrdels = removed;
+  }
+  removed
+}
+
+unsafe extern "C" fn ps_validate_sid(_mod_data: *mut *mut c_void, key: *mut zend_string) -> i32 {
+  let (Some(store), Some(id)) = (current_store(), key_str(key)) else {
+    return FAILURE;
+  };
+
+  if store.read(id).is_some() {
+    SUCCESS
+  } else {
+    FAILURE
+  }
+}
+
+unsafe extern "C" fn ps_update_timestamp(
+  _mod_data: *mut *mut c_void,
+  key: *mut zend_string,
+  val: *mut zend_string,
+  maxlifetime: zend_long,
+) -> i32 {
+  let (Some(store), Some(id)) = (current_store(), key_str(key)) else {
+    return FAILURE;
+  };
+
+  store.touch(id, value_bytes(val), ttl(maxlifetime));
+  SUCCESS
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+
+  #[test]
+  fn test_memory_store_expires_sessions() {
+    let store = MemorySessionStore::default();
+    store.write(
+      "live",
+      Bytes::from_static(b"a|i:1;"),
+      Duration::from_secs(60),
+    );
+    store.write("dead", Bytes::from_static(b"b|i:2;"), Duration::ZERO);
+
+    assert_eq!(store.read("live"), Some(Bytes::from_static(b"a|i:1;")));
+    assert_eq!(store.read("dead"), None);
+    assert_eq!(store.len(), 2);
+
+    assert_eq!(store.gc(), 1);
+    assert_eq!(store.len(), 1);
+
+    store.destroy("live");
+    assert!(store.is_empty());
+  }
+
+  #[test]
+  fn test_memory_store_touch_keeps_data() {
+    let store = MemorySessionStore::default();
+    store.write("id", Bytes::from_static(b"old"), Duration::from_secs(60));
+    store.touch("id", Bytes::from_static(b"new"), Duration::from_secs(60));
+
+    // Touching only extends the lifetime of data already stored
+    assert_eq!(store.read("id"), Some(Bytes::from_static(b"old")));
+
+    // ...unless it has expired, when the data touched with is stored instead
+    store.write("gone", Bytes::from_static(b"old"), Duration::ZERO);
+    store.touch("gone", Bytes::from_static(b"new"), Duration::from_secs(60));
+    assert_eq!(store.read("gone"), Some(Bytes::from_static(b"new")));
+  }
+}
@@ -0,0 +1,474 @@
+//! Serving files which are not PHP scripts straight from the docroot.
+//!
+//! Assets such as stylesheets and images are answered on the async side as
+//! soon as their path has been resolved, so they never wait for or occupy a
+//! PHP worker. Small files are kept in memory, larger ones are read from disk
+//! in chunks as the consumer takes them.
+
+use std::{
+  fs::File,
+  ops::Range,
+  os::unix::fs::FileExt,
+  path::{Path, PathBuf},
+  sync::Arc,
+  time::{Duration, SystemTime, UNIX_EPOCH},
+};
+
+use bytes::Bytes;
+use http_handler::{header, HeaderValue, Method, StatusCode};
+use tokio::io::AsyncWriteExt;
+
+use crate::{cache::TtlCache, extensions::BufferedResponse, Request, Response, StaticFileOptions};
+
+// Upper bound on files kept in memory.
+const STATIC_CACHE_CAPACITY: usize = 1024;
+
+// Bytes read from disk at a time when streaming a file.
+const STREAM_CHUNK_SIZE: usize = 64 * 1024;
+
+// Extensions PHP is commonly set up to run or include, which are never served
+// whatever the options say, so their source can't leak.
+const SCRIPT_EXTENSIONS: &[&str] = &[
+  "php", "phtml", "pht", "phps", "phar", "php3", "php4", "php5", "php7", "php8", "inc",
+];
+
+/// Static file server for one docroot and its tenants.
+pub(crate) struct StaticFiles {
+  extensions: Box<[String]>,
+  max_cached_size: u64,
+  cache_control: Option<HeaderValue>,
+  cache: Option<TtlCache<PathBuf, Arc<CachedFile>>>,
+}
+
+// What is known about a file without reading it.
+#[derive(Clone)]
+struct FileInfo {
+  len: u64,
+  etag: String,
+  last_modified: String,
+  content_type: &'static str,
+}
+
+struct CachedFile {
+  info: FileInfo,
+  data: Bytes,
+}
+
+// Where the bytes of a response come from.
+enum Source {
+  Memory(Bytes),
+  Disk(File),
+}
+
+impl StaticFiles {
+  pub fn new(options: StaticFileOptions, ttl: Duration) -> Self {
+    Self {
+      extensions: options
+        .extensions
+        .into_iter()
+        .map(|ext| ext.trim_start_matches('.').to_ascii_lowercase())
+        .collect(),
+      max_cached_size: options.max_cached_size,
+      cache_control: options
+        .cache_control
+        .and_then(|value| HeaderValue::from_str(&value).ok()),
+      cache: (!ttl.is_zero() && options.max_cached_size > 0)
+        .then(|| TtlCache::new(ttl, STATIC_CACHE_CAPACITY)),
+    }
+  }
+
+  /// Whether a request may be for a static file, judged by its method and
+  /// path alone so other requests never touch the filesystem here.
+  pub fn accepts(&self, method: &Method, path: &str) -> bool {
+    if method != Method::GET && method != Method::HEAD {
+      return false;
+    }
+    // Directories are served by their index.php
+    if path.ends_with('/') || path.split('/').any(|segment| segment.starts_with('.')) {
+      return false;
+    }
+
+    self.accepts_name(path.rsplit('/').next().unwrap_or(path))
+  }
+
+  fn accepts_name(&self, name: &str) -> bool {
+    let Some((_, ext)) = name.rsplit_once('.') else {
+      return false;
+    };
+    let ext = ext.to_ascii_lowercase();
+    !SCRIPT_EXTENSIONS.contains(&ext.as_str()) && self.extensions.contains(&ext)
+  }
+
+  /// Respond to a request with a file resolved within `docroot`.
+  ///
+  /// Returns `None` to leave the request to PHP, when the file turns out to
+  /// be a script or lies outside the docroot, such as through a symlink.
+  pub async fn serve(&self, request: &Request, docroot: &Path, file: PathBuf) -> Option<Response> {
+    let name = file.file_name()?.to_str()?;
+    if !file.starts_with(docroot) || !self.accepts_name(name) {
+      return None;
+    }
+
+    let (info, source) = match self.cache.as_ref().and_then(|cache| cache.get(&file)) {
+      Some(cached) => (cached.info.clone(), Source::Memory(cached.data.clone())),
+      None => self.open(file).await?,
+    };
+
+    let headers = request.headers();
+    let not_modified = match headers.get(header::IF_NONE_MATCH) {
+      Some(tags) => etag_matches(tags, &info.etag),
+      None => headers
+        .get(header::IF_MODIFIED_SINCE)
+        .is_some_and(|since| since.as_bytes() == info.last_modified.as_bytes()),
+    };
+
+    // A Range is only honoured while the file is still the one If-Range
+    // describes, otherwise the whole file is sent.
+    let range = headers
+      .get(header::RANGE)
+      .filter(|_| {
+        headers
+          .get(header::IF_RANGE)
+          .is_none_or(|tag| tag.as_bytes() == info.etag.as_bytes())
+      })
+      .and_then(|range| range.to_str().ok())
+      .and_then(|range| parse_range(range, info.len));
+
+    let (status, range) = match range {
+      _ if not_modified => (StatusCode::NOT_MODIFIED, 0..0),
+      None => (StatusCode::OK, 0..info.len),
+      Some(Some(range)) => (StatusCode::PARTIAL_CONTENT, range),
+      Some(None) => (StatusCode::RANGE_NOT_SATISFIABLE, 0..0),
+    };
+
+    let mut builder = http_handler::response::Builder::new()
+      .status(status)
+      .header(header::ETAG, &info.etag)
+      .header(header::LAST_MODIFIED, &info.last_modified)
+      .header(header::ACCEPT_RANGES, "bytes");
+    if let Some(cache_control) = &self.cache_control {
+      builder = builder.header(header::CACHE_CONTROL, cache_control);
+    }
+    match status {
+      StatusCode::NOT_MODIFIED => {}
+      StatusCode::RANGE_NOT_SATISFIABLE => {
+        builder = builder.header(header::CONTENT_RANGE, format!("bytes */{}", info.len));
+      }
+      _ => {
+        if status == StatusCode::PARTIAL_CONTENT {
+          let last = range.end - 1;
+          let content_range = format!("bytes {}-{last}/{}", range.start, info.len);
+          builder = builder.header(header::CONTENT_RANGE, content_range);
+        }
+        builder = builder
+          .header(header::CONTENT_TYPE, info.content_type)
+          .header(header::CONTENT_LENGTH, range.end - range.start);
+      }
+    }
+
+    let range = match request.method() == Method::HEAD {
+      true => 0..0,
+      false => range,
+    };
+
+    let body = request.body().create_response();
+    let mut response = builder.body(body.clone()).ok()?;
+
+    if request.extensions().get::<BufferedResponse>().is_some() {
+      let data = read_range(source, range).await.unwrap_or_default();
+      response
+        .extensions_mut()
+        .insert(http_handler::BodyBuffer::from_bytes(data));
+      let mut body = body;
+      let _ = body.shutdown().await;
+    } else {
+      stream(body, source, range);
+    }
+
+    Some(response)
+  }
+
+  // Open a file, keeping it in memory when it is small enough.
+  async fn open(&self, path: PathBuf) -> Option<(FileInfo, Source)> {
+    let max_cached_size = self.cache.as_ref().map_or(0, |_| self.max_cached_size);
+
+    let (path, info, source) = tokio::task::spawn_blocking(move || {
+      let file = File::open(&path).ok()?;
+      let metadata = file.metadata().ok()?;
+      if !metadata.is_file() {
+        return None;
+      }
+
+      let modified = metadata.modified().unwrap_or(UNIX_EPOCH);
+      let mtime = modified.duration_since(UNIX_EPOCH).unwrap_or_default();
+      let info = FileInfo {
+        len: metadata.len(),
+        etag: format!("\"{:x}-{:x}\"", mtime.as_nanos(), metadata.len()),
+        last_modified: http_date(modified),
+        content_type: content_type(&path),
+      };
+
+      let source = match info.len <= max_cached_size {
+        true => Source::Memory(read_at(&file, 0..info.len).ok()?),
+        false => Source::Disk(file),
+      };
+      Some((path, info, source))
+    })
+    .await
+    .ok()??;
+
+    if let (Some(cache), Source::Memory(data)) = (&self.cache, &source) {
+      let cached = CachedFile {
+        info: info.clone(),
+        data: data.clone(),
+      };
+      cache.insert(path, Arc::new(cached));
+    }
+
+    Some((info, source))
+  }
+}
+
+// Read part of a source into memory, off the async threads when it is on disk.
+async fn read_range(source: Source, range: Range<u64>) -> Option<Bytes> {
+  match source {
+    Source::Memory(data) => Some(data.slice(range.start as usize..range.end as usize)),
+    Source::Disk(file) => tokio::task::spawn_blocking(move || read_at(&file, range).ok())
+      .await
+      .ok()
+      .flatten(),
+  }
+}
+
+fn read_at(file: &File, range: Range<u64>) -> std::io::Result<Bytes> {
+  let mut data = vec![0; (range.end - range.start) as usize];
+  file.read_exact_at(&mut data, range.start)?;
+  Ok(Bytes::from(data))
+}
+
+// Write part of a source to the response body in the background, reading it
+// from disk only as fast as the consumer takes it.
+fn stream(mut body: http_handler::ResponseBody, source: Source, range: Range<u64>) {
+  match source {
+    Source::Memory(data) => {
+      crate::runtime::handle().spawn(async move {
+        let data = data.slice(range.start as usize..range.end as usize);
+        if !data.is_empty() {
+          let _ = body.write_all(&data).await;
+        }
+        let _ = body.shutdown().await;
+      });
+    }
+    Source::Disk(file) => {
+      crate::runtime::handle().spawn_blocking(move || {
+        let len = (range.end - range.start).min(STREAM_CHUNK_SIZE as u64) as usize;
+        let mut chunk = vec![0; len];
+        let mut offset = range.start;
+
+        while offset < range.end {
+          let len = ((range.end - offset) as usize).min(chunk.len());
+          let read = match file.read_at(&mut chunk[..len], offset) {
+            Ok(0) | Err(_) => break,
+            Ok(read) => read,
+          };
+          if !crate::backpressure::write(body.clone(), &chunk[..read], None) {
+            break;
+          }
+          offset += read as u64;
+        }
+
+        crate::runtime::handle().block_on(async {
+          let _ = body.shutdown().await;
+        });
+      });
+    }
+  }
+}
+
+// Whether an If-None-Match header lists the current entity tag. Weak tags
+// match too, as this only decides whether to send 304 Not Modified.
+fn etag_matches(tags: &HeaderValue, etag: &str) -> bool {
+  let Ok(tags) = tags.to_str() else {
+    return false;
+  };
+
+  tags
+    .split(',')
+    .map(str::trim)
+    .any(|tag| tag == "*" || tag.strip_prefix("W/").unwrap_or(tag) == etag)
+}
+
+// Parse a Range header into the bytes to send. Returns `None` for headers to
+// ignore, such as ones asking for several ranges, and `Some(None)` when the
+// range lies beyond the end of the file.
+fn parse_range(range: &str, len: u64) -> Option<Option<Range<u64>>> {
+  let spec = range.strip_prefix("bytes=")?.trim();
+  if spec.contains(',') {
+    return None;
+  }
+
+  let (start, end) = spec.split_once('-')?;
+  let (start, end) = (start.trim(), end.trim());
+
+  let range = match (start, end) {
+    ("", suffix) => {
+      let suffix = suffix.parse::<u64>().ok()?;
+      len.saturating_sub(suffix)..len
+    }
+    (start, "") => start.parse::<u64>().ok()?..len,
+    (start, end) => {
+      let (start, end) = (start.parse::<u64>().ok()?, end.parse::<u64>().ok()?);
+      if end < start {
+        return None;
+      }
+      start..(end + 1).min(len)
+    }
+  };
+
+  Some((range.start < range.end).then_some(range))
+}
+
+/// Format a time as an HTTP date, such as `Sun, 06 Nov 1994 08:49:37 GMT`.
+fn http_date(time: SystemTime) -> String {
+  const WEEKDAYS: [&str; 7] = ["Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"];
+  const MONTHS: [&str; 12] = [
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+  ];
+
+  let secs = time.duration_since(UNIX_EPOCH).map_or(0, |d| d.as_secs());
+  let (days, secs) = (secs / 86400, secs % 86400);
+
+  // Civil date from days since the epoch, after Howard Hinnant's algorithm
+  let z = days + 719_468;
+  let era = z / 146_097;
+  let doe = z - era * 146_097;
+  let yoe = (doe - doe / 1460 + doe / 36_524 - doe / 146_096) / 365;
+  let doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  let mp = (5 * doy + 2) / 153;
+  let day = doy - (153 * mp + 2) / 5 + 1;
+  let month = if mp < 10 { mp + 3 } else { mp - 9 };
+  let year = yoe + era * 400 + (month <= 2) as u64;
+
+  format!(
+    "{}, {day:02} {} {year} {:02}:{:02}:{:02} GMT",
+    // The epoch was a Thursday
+    WEEKDAYS[((days + 4) % 7) as usize],
+    MONTHS[(month - 1) as usize],
+    secs / 3600,
+    secs / 60 % 60,
+    secs % 60
+  )
+}
+
+fn content_type(path: &Path) -> &'static str {
+  let extension = path
+    .extension()
+    .and_then(|ext| ext.to_str())
+    .map(str::to_ascii_lowercase)
+    .unwrap_or_default();
+
+  match extension.as_str() {
+    "html" | "htm" => "text/html; charset=utf-8",
+    "css" => "text/css; charset=utf-8",
+    "js" | "mjs" => "text/javascript; charset=utf-8",
+    "json" | "map" => "application/json",
+    "txt" => "text/plain; charset=utf-8",
+    "csv" => "text/csv; charset=utf-8",
+    "xml" => "application/xml",
+    "svg" => "image/svg+xml",
+    "png" => "image/png",
+    "jpg" | "jpeg" => "image/jpeg",
+    "gif" => "image/gif",
+    "webp" => "image/webp",
+    "avif" => "image/avif",
+    "ico" => "image/x-icon",
+    "woff" => "font/woff",
+    "woff2" => "font/woff2",
+    "ttf" => "font/ttf",
+    "otf" => "font/otf",
+    "wasm" => "application/wasm",
+    "pdf" => "application/pdf",
+    "mp3" => "audio/mpeg",
+    "mp4" => "video/mp4",
+    "webm" => "video/webm",
+    "zip" => "application/zip",
+    "gz" => "application/gzip",
+    _ => "application/octet-stream",
+  }
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+
+  #[test]
+  fn test_accepts() {
+    let assets = StaticFiles::new(StaticFileOptions::default(), Duration::ZERO);
+    assert!(assets.accepts(&Method::GET, "/css/app.css"));
+    assert!(assets.accepts(&Method::HEAD, "/img/logo.PNG"));
+    assert!(!assets.accepts(&Method::POST, "/css/app.css"));
+    assert!(!assets.accepts(&Method::GET, "/index.PHP"));
+    assert!(!assets.accepts(&Method::GET, "/page.phtml"));
+    assert!(!assets.accepts(&Method::GET, "/config.inc"));
+    assert!(!assets.accepts(&Method::GET, "/composer.json"));
+    assert!(!assets.accepts(&Method::GET, "/dump.sql"));
+    assert!(!assets.accepts(&Method::GET, "/LICENSE"));
+    assert!(!assets.accepts(&Method::GET, "/assets/"));
+    assert!(!assets.accepts(&Method::GET, "/.env"));
+    assert!(!assets.accepts(&Method::GET, "/.git/config"));
+
+    let options = StaticFileOptions {
+      extensions: vec![".CSS".into(), "phtml".into()],
+      ..Default::default()
+    };
+    let css = StaticFiles::new(options, Duration::ZERO);
+    assert!(css.accepts(&Method::GET, "/app.css"));
+    assert!(!css.accepts(&Method::GET, "/app.js"));
+    assert!(!css.accepts(&Method::GET, "/page.phtml"));
+
+    let options = StaticFileOptions {
+      extensions: Vec::new(),
+      ..Default::default()
+    };
+    let none = StaticFiles::new(options, Duration::ZERO);
+    assert!(!none.accepts(&Method::GET, "/app.css"));
+  }
+
+  #[test]
+  fn test_parse_range() {
+    assert_eq!(parse_range("bytes=0-99", 1000), Some(Some(0..100)));
+    assert_eq!(parse_range("bytes=900-", 1000), Some(Some(900..1000)));
+    assert_eq!(parse_range("bytes=-100", 1000), Some(Some(900..1000)));
+    assert_eq!(parse_range("bytes=990-2000", 1000), Some(Some(990..1000)));
+    assert_eq!(parse_range("bytes=-2000", 1000), Some(Some(0..1000)));
+    assert_eq!(parse_range("bytes=1000-", 1000), Some(None));
+    assert_eq!(parse_range("bytes=0-1,5-9", 1000), None);
+    assert_eq!(parse_range("bytes=9-5", 1000), None);
+    assert_eq!(parse_range("items=0-1", 1000), None);
+  }
+
+  #[test]
+  fn test_etag_matches() {
+    let etag = "\"1f-a\"";
+    assert!(etag_matches(&HeaderValue::from_static("\"1f-a\""), etag));
+    assert!(etag_matches(
+      &HeaderValue::from_static("\"x\", W/\"1f-a\""),
+      etag
+    ));
+    assert!(etag_matches(&HeaderValue::from_static("*"), etag));
+    assert!(!etag_matches(&HeaderValue::from_static("\"1f-b\""), etag));
+  }
+
+  #[test]
+  fn test_http_date() {
+    assert_eq!(http_date(UNIX_EPOCH), "Thu, 01 Jan 1970 00:00:00 GMT");
+    assert_eq!(
+      http_date(UNIX_EPOCH + Duration::from_secs(784_111_777)),
+      "Sun, 06 Nov 1994 08:49:37 GMT"
+    );
+    assert_eq!(
+      http_date(UNIX_EPOCH + Duration::from_secs(951_782_400)),
+      "Tue, 29 Feb 2000 00:00:00 GMT"
+    );
+  }
+}
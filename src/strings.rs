@@ -1,7 +1,131 @@
-use std::path::{Path, PathBuf};
+use std::{
+  alloc::Layout,
+  cell::RefCell,
+  ffi::c_char,
+  path::{Path, PathBuf},
+};
+
+use ext_php_rs::alloc::emalloc;
 
 use crate::EmbedRequestError;
 
+/// Copy bytes into a NUL-terminated string owned by the Zend allocator.
+///
+/// Unlike `estrdup`, this copies straight from a borrowed slice without first
+/// building a `CString`. The result must be released with `efree`.
+pub(crate) fn estrndup(bytes: &[u8]) -> *mut c_char {
+  let layout = Layout::array::<u8>(bytes.len() + 1).expect("string length should fit a layout");
+  let ptr = emalloc(layout);
+
+  unsafe {
+    std::ptr::copy_nonoverlapping(bytes.as_ptr(), ptr, bytes.len());
+    *ptr.add(bytes.len()) = 0;
+  }
+
+  ptr as *mut c_char
+}
+
+// Size of the first arena chunk, enough for the request info of most requests.
+const ARENA_CHUNK_SIZE: usize = 4 * 1024;
+
+// Largest arena kept between requests. A request with unusually long strings
+// should not pin that memory to its worker thread for good.
+const ARENA_RETAIN_LIMIT: usize = 64 * 1024;
+
+thread_local! {
+  // Strings for the SAPI request info of the request running on this thread.
+  static REQUEST_STRINGS: RefCell<Arena> = const { RefCell::new(Arena::new()) };
+}
+
+/// Bump allocator for NUL-terminated strings which all live exactly as long
+/// as one request.
+///
+/// Strings are never freed individually. The whole arena is reset at once,
+/// keeping its largest chunk so later requests allocate nothing at all.
+/// Chunks are never moved, so strings stay put while the arena grows.
+pub(crate) struct Arena {
+  chunks: Vec<Box<[u8]>>,
+  used: usize,
+  argv: Vec<*mut c_char>,
+}
+
+impl Arena {
+  pub const fn new() -> Self {
+    Self {
+      chunks: Vec::new(),
+      used: 0,
+      argv: Vec::new(),
+    }
+  }
+
+  /// Copy bytes into the arena as a NUL-terminated string.
+  pub fn alloc_str(&mut self, bytes: &[u8]) -> *mut c_char {
+    let needed = bytes.len() + 1;
+
+    let fits = self
+      .chunks
+      .last()
+      .is_some_and(|chunk| chunk.len() - self.used >= needed);
+    if !fits {
+      // Chunks double in size, so the last one is always the largest.
+      let size = self
+        .chunks
+        .last()
+        .map_or(ARENA_CHUNK_SIZE, |chunk| chunk.len() * 2)
+        .max(needed);
+      self.chunks.push(vec![0; size].into_boxed_slice());
+      self.used = 0;
+    }
+
+    let chunk = self.chunks.last_mut().expect("arena should have a chunk");
+    unsafe {
+      let ptr = chunk.as_mut_ptr().add(self.used);
+      std::ptr::copy_nonoverlapping(bytes.as_ptr(), ptr, bytes.len());
+      *ptr.add(bytes.len()) = 0;
+      self.used += needed;
+      ptr as *mut c_char
+    }
+  }
+
+  /// Copy each argument into the arena, returning the argv array pointing at
+  /// them. The array is also owned by the arena.
+  pub fn alloc_argv<S: AsRef<str>>(&mut self, args: &[S]) -> (i32, *mut *mut c_char) {
+    self.argv.clear();
+    for arg in args {
+      let ptr = self.alloc_str(arg.as_ref().as_bytes());
+      self.argv.push(ptr);
+    }
+
+    (self.argv.len() as i32, self.argv.as_mut_ptr())
+  }
+
+  /// Release every string at once. Pointers handed out before are dangling
+  /// after this.
+  pub fn reset(&mut self) {
+    let largest = self
+      .chunks
+      .pop()
+      .filter(|chunk| chunk.len() <= ARENA_RETAIN_LIMIT);
+    self.chunks.clear();
+    self.chunks.extend(largest);
+    self.used = 0;
+    self.argv.clear();
+  }
+
+  #[cfg(test)]
+  fn capacity(&self) -> usize {
+    self.chunks.iter().map(|chunk| chunk.len()).sum()
+  }
+}
+
+/// Run `f` with the request string arena of the current thread.
+///
+/// Strings in it are what the SAPI request info points to, so it must only
+/// be reset once PHP is done with the request, in `sapi_module_deactivate`.
+pub(crate) fn with_request_strings<R>(f: impl FnOnce(&mut Arena) -> R) -> R {
+  REQUEST_STRINGS.with_borrow_mut(f)
+}
+
 pub(crate) fn translate_path<D, P>(docroot: D, request_uri: P) -> Result<PathBuf, EmbedRequestError>
 where
   D: AsRef<Path>,
@@ -46,6 +170,46 @@ mod test {
   use super::*;
   use crate::MockRoot;
 
+  #[test]
+  fn test_arena_strings_are_stable() {
+    let mut arena = Arena::new();
+
+    let first = arena.alloc_str(b"GET");
+    // Force a second chunk while the first string is still in use
+    let long = vec![b'a'; ARENA_CHUNK_SIZE * 3];
+    let second = arena.alloc_str(&long);
+
+    unsafe {
+      assert_eq!(std::ffi::CStr::from_ptr(first).to_bytes(), b"GET");
+      assert_eq!(std::ffi::CStr::from_ptr(second).to_bytes(), &long[..]);
+    }
+
+    let (argc, argv) = arena.alloc_argv(&["php", "-v"]);
+    assert_eq!(argc, 2);
+    unsafe {
+      assert_eq!(std::ffi::CStr::from_ptr(*argv.add(1)).to_bytes(), b"-v");
+    }
+  }
+
+  #[test]
+  fn test_arena_reset_keeps_largest_chunk() {
+    let mut arena = Arena::new();
+    arena.alloc_str(&vec![b'a'; ARENA_CHUNK_SIZE / 2]);
+    arena.alloc_str(&vec![b'a'; ARENA_CHUNK_SIZE / 2]);
+    assert_eq!(arena.capacity(), ARENA_CHUNK_SIZE * 3);
+
+    arena.reset();
+    assert_eq!(arena.capacity(), ARENA_CHUNK_SIZE * 2);
+
+    // Requests fitting the kept chunk allocate nothing new
+    arena.alloc_str(&vec![b'a'; ARENA_CHUNK_SIZE / 2]);
+    assert_eq!(arena.capacity(), ARENA_CHUNK_SIZE * 2);
+
+    arena.alloc_str(&vec![b'a'; ARENA_RETAIN_LIMIT * 2]);
+    arena.reset();
+    assert_eq!(arena.capacity(), 0);
+  }
+
   #[test]
   fn test_translate_path() {
     let docroot = MockRoot::builder()
@@ -0,0 +1,214 @@
+//! Routing requests for many applications to their own docroots within one
+//! `Embed`.
+//!
+//! Tenants share the instance's SAPI, worker pool and opcode cache. Each one
+//! costs a routing entry, its own path cache and its INI settings, rather
+//! than a set of worker threads.
+
+use std::{
+  path::PathBuf,
+  sync::{
+    atomic::{AtomicUsize, Ordering},
+    Arc,
+  },
+  time::Duration,
+};
+
+use crate::{cache::TtlCache, EmbedRequestError, EmbedStartError, Request, TenantOptions};
+
+// Upper bound on remembered request paths for each tenant.
+const TENANT_PATH_CACHE_CAPACITY: usize = 1024;
+
+/// An application routed to its own docroot.
+pub(crate) struct Tenant {
+  host: Option<String>,
+  prefix: Option<String>,
+  pub docroot: PathBuf,
+  pub request_ini: Arc<[(String, String)]>,
+  pub path_cache: Option<TtlCache<String, PathBuf>>,
+  max_requests: Option<usize>,
+  active: Arc<AtomicUsize>,
+}
+
+impl Tenant {
+  pub fn new(options: TenantOptions, path_cache_ttl: Duration) -> Result<Self, EmbedStartError> {
+    let docroot = options
+      .docroot
+      .canonicalize()
+      .ok()
+      .filter(|path| path.is_dir())
+      .ok_or_else(|| EmbedStartError::DocRootNotFound(options.docroot.display().to_string()))?;
+
+    let prefix = match options.prefix {
+      Some(prefix) if !prefix.starts_with('/') => {
+        return Err(EmbedStartError::InvalidTenant(format!(
+          "prefix must start with a slash: {prefix}"
+        )))
+      }
+      // A prefix of "/" matches everything, the same as no prefix
+      Some(prefix) => Some(prefix.trim_end_matches('/').to_string()).filter(|p| !p.is_empty()),
+      None => None,
+    };
+
+    Ok(Self {
+      host: options.host.map(|host| host.to_ascii_lowercase()),
+      prefix,
+      docroot,
+      request_ini: options.request_ini.into_iter().collect(),
+      path_cache: (!path_cache_ttl.is_zero())
+        .then(|| TtlCache::new(path_cache_ttl, TENANT_PATH_CACHE_CAPACITY)),
+      max_requests: options.max_requests,
+      active: Arc::new(AtomicUsize::new(0)),
+    })
+  }
+
+  /// Whether this tenant serves requests for `host` and `path`.
+  pub fn matches(&self, host: Option<&str>, path: &str) -> bool {
+    let host_matches = match &self.host {
+      Some(expected) => host.is_some_and(|host| host.eq_ignore_ascii_case(expected)),
+      None => true,
+    };
+
+    host_matches && (self.prefix.is_none() || self.strip_prefix(path).is_some())
+  }
+
+  /// Whether requests are routed here by their host.
+  pub fn routes_by_host(&self) -> bool {
+    self.host.is_some()
+  }
+
+  /// Get the path to resolve within this tenant's docroot.
+  ///
+  /// Prefixes match whole path segments and are stripped, so `/blog` serves
+  /// `/blog/index.php` from `index.php` but does not serve `/blogs`. Paths
+  /// rewritten away from the prefix are resolved as they are.
+  pub fn script_path<'a>(&self, path: &'a str) -> &'a str {
+    self.strip_prefix(path).unwrap_or(path)
+  }
+
+  fn strip_prefix<'a>(&self, path: &'a str) -> Option<&'a str> {
+    let prefix = self.prefix.as_deref()?;
+    match path.strip_prefix(prefix) {
+      Some("") => Some("/"),
+      Some(rest) if rest.starts_with('/') => Some(rest),
+      _ => None,
+    }
+  }
+
+  /// Reserve a slot for a request to this tenant, failing once it already
+  /// has `max_requests` queued or running. The slot is freed on drop.
+  pub fn admit(&self) -> Result<TenantPermit, EmbedRequestError> {
+    let active = self.active.fetch_add(1, Ordering::AcqRel);
+    let permit = TenantPermit(self.active.clone());
+
+    if self.max_requests.is_some_and(|max| active >= max) {
+      return Err(EmbedRequestError::TenantLimitReached);
+    }
+    Ok(permit)
+  }
+}
+
+/// Slot held by a request to a tenant until it has finished running.
+pub(crate) struct TenantPermit(Arc<AtomicUsize>);
+
+impl Drop for TenantPermit {
+  fn drop(&mut self) {
+    self.0.fetch_sub(1, Ordering::AcqRel);
+  }
+}
+
+/// Find the first tenant serving a request.
+pub(crate) fn route<'a>(tenants: &'a [Tenant], request: &Request) -> Option<&'a Tenant> {
+  if tenants.is_empty() {
+    return None;
+  }
+
+  let host = request_host(request);
+  let path = request.uri().path();
+  tenants.iter().find(|tenant| tenant.matches(host, path))
+}
+
+// Host a request was made to, without the port. Requests from Node.js carry
+// the host in their URL, others may only have a Host header.
+fn request_host(request: &Request) -> Option<&str> {
+  let host = match request.uri().host() {
+    Some(host) => host,
+    None => request
+      .headers()
+      .get(http_handler::header::HOST)?
+      .to_str()
+      .ok()?,
+  };
+
+  // A bracketed IPv6 address has colons of its own
+  Some(match host.rsplit_once(':') {
+    Some((name, port))
+      if port.bytes().all(|b| b.is_ascii_digit())
+        && (!name.contains(':') || name.ends_with(']')) =>
+    {
+      name
+    }
+    _ => host,
+  })
+}
+
+#[cfg(test)]
+mod test {
+  use super::*;
+  use crate::MockRoot;
+
+  fn tenant(host: Option<&str>, prefix: Option<&str>) -> Tenant {
+    let docroot = MockRoot::builder()
+      .file("/index.php", "<?php echo 'tenant'; ?>")
+      .build()
+      .expect("should prepare docroot");
+
+    Tenant::new(
+      TenantOptions {
+        host: host.map(Into::into),
+        prefix: prefix.map(Into::into),
+        docroot: docroot.to_path_buf(),
+        ..Default::default()
+      },
+      Duration::ZERO,
+    )
+    .expect("should create tenant")
+  }
+
+  #[test]
+  fn test_route_by_host() {
+    let tenant = tenant(Some("Example.com"), None);
+
+    assert!(tenant.matches(Some("example.COM"), "/a.php"));
+    assert!(!tenant.matches(Some("other.com"), "/a.php"));
+    assert!(!tenant.matches(None, "/a.php"));
+    assert_eq!(tenant.script_path("/a.php"), "/a.php");
+  }
+
+  #[test]
+  fn test_route_by_prefix() {
+    let tenant = tenant(None, Some("/blog/"));
+
+    assert!(tenant.matches(None, "/blog"));
+    assert!(!tenant.matches(None, "/blogs/post.php"));
+    assert_eq!(tenant.script_path("/blog"), "/");
+    assert_eq!(tenant.script_path("/blog/"), "/");
+    assert_eq!(tenant.script_path("/blog/post.php"), "/post.php");
+    assert_eq!(tenant.script_path("/index.php"), "/index.php");
+  }
+
+  #[test]
+  fn test_admit_limit() {
+    let mut tenant = tenant(None, None);
+    tenant.max_requests = Some(1);
+
+    let permit = tenant.admit().expect("should admit first request");
+    assert!(matches!(
+      tenant.admit(),
+      Err(EmbedRequestError::TenantLimitReached)
+    ));
+
+    drop(permit);
+    assert!(tenant.admit().is_ok());
+  }
+}
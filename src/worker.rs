@@ -0,0 +1,278 @@
+//! Worker mode: boot a long-lived PHP script once per worker thread and
+//! dispatch many requests into it.
+//!
+//! The worker script calls `php_node_handle_request($handler)` in a loop. Each
+//! call blocks until the next request is queued, swaps in that request's
+//! context and superglobals, runs `$handler`, and then flushes and resets the
+//! per-request SAPI state without a full `php_request_shutdown`.
+//!
+//! ```php
+//! <?php
+//! $app = require __DIR__ . '/bootstrap.php';
+//!
+//! while (php_node_handle_request(function () use ($app) {
+//!   $app->handle();
+//! })) {}
+//! ```
+
+use std::{
+  cell::{Cell, RefCell},
+  ffi::c_char,
+  ops::DerefMut,
+  panic::{catch_unwind, AssertUnwindSafe},
+  path::Path,
+  time::{Duration, Instant},
+};
+
+use ext_php_rs::{
+  error::Error,
+  ffi::{
+    php_execute_script, php_hash_environment, php_output_activate, php_output_deactivate,
+    php_output_end_all, sapi_activate, sapi_deactivate, sapi_send_headers, zend_is_auto_global_str,
+    zend_is_unwind_exit, zval_ptr_dtor,
+  },
+  types::Zval,
+  zend::{try_catch, try_catch_first, ExecutorGlobals, ProcessGlobals, SapiGlobals},
+};
+
+use crate::{
+  extensions::{Phase, RequestTiming},
+  ini,
+  pool::{self, next_job, JobReceiver},
+  scopes::{FileHandleScope, RequestScope},
+  strings::with_request_strings,
+  EmbedRequestError,
+};
+
+// Delay before rebooting a worker script which exited without serving anything,
+// to avoid spinning on a script that is broken or exits immediately.
+const REBOOT_BACKOFF: Duration = Duration::from_millis(100);
+
+thread_local! {
+  // Queue this worker thread pulls requests from, set only in worker mode.
+  static RECEIVER: RefCell<Option<JobReceiver>> = const { RefCell::new(None) };
+
+  // Request handler passed to the in-progress php_node_handle_request call.
+  static HANDLER: Cell<*const Zval> = const { Cell::new(std::ptr::null()) };
+
+  // Whether per-request SAPI and output state is currently active.
+  static ACTIVE: Cell<bool> = const { Cell::new(false) };
+
+  // Set when the pool has closed its queue and the worker should exit.
+  static CLOSED: Cell<bool> = const { Cell::new(false) };
+
+  // Set when the worker script should be rebooted, such as after a bailout.
+  static REBOOT: Cell<bool> = const { Cell::new(false) };
+
+  // Number of requests served by this thread, used to detect boot loops.
+  static SERVED: Cell<u64> = const { Cell::new(0) };
+}
+
+/// Run the worker script on the current thread until the pool closes.
+///
+/// The script is rebooted whenever it returns while the pool is still open,
+/// for example after a fatal error inside a request handler.
+pub(crate) fn run(script: &Path, receiver: &JobReceiver) {
+  RECEIVER.with(|r| *r.borrow_mut() = Some(receiver.clone()));
+
+  while !CLOSED.get() {
+    let served = SERVED.get();
+    boot(script);
+
+    if !CLOSED.get() && SERVED.get() == served {
+      std::thread::sleep(REBOOT_BACKOFF);
+    }
+  }
+
+  RECEIVER.with(|r| r.borrow_mut().take());
+}
+
+fn boot(script: &Path) {
+  REBOOT.set(false);
+
+  let script_str = script.display().to_string();
+
+  // The boot request has no RequestContext, so any output from bootstrapping
+  // is discarded and no request body or cookies are read.
+  {
+    let mut globals = SapiGlobals::get_mut();
+    globals.options |= ext_php_rs::ffi::SAPI_OPTION_NO_CHDIR as i32;
+    globals.request_info.proto_num = 110;
+    globals.request_info.headers_read = false;
+    globals.request_info.content_length = 0;
+    globals.request_info.path_translated =
+      with_request_strings(|arena| arena.alloc_str(script_str.as_bytes()));
+    globals.sapi_headers.http_response_code = 200;
+  }
+
+  let _ = try_catch_first(|| {
+    let _request_scope = RequestScope::new()?;
+    ACTIVE.set(true);
+
+    let mut file_handle = FileHandleScope::new(script_str.clone());
+    let _ = try_catch(AssertUnwindSafe(|| unsafe {
+      php_execute_script(file_handle.deref_mut())
+    }));
+
+    // Uncaught exceptions outside of a request handler have no request to be
+    // reported to. The script is simply rebooted.
+    ExecutorGlobals::take_exception();
+
+    Ok::<(), EmbedRequestError>(())
+  });
+
+  ACTIVE.set(false);
+}
+
+/// Implementation of `php_node_handle_request()`.
+///
+/// Returns `false` when the worker script should stop looping, either because
+/// the pool is shutting down or the script must be rebooted. Always returns
+/// `false` when not running in worker mode.
+pub(crate) fn handle_request(handler: &Zval) -> bool {
+  let Some(receiver) = RECEIVER.with(|r| r.borrow().clone()) else {
+    return false;
+  };
+
+  // The first call ends the boot request, later calls have already ended the
+  // previous request in dispatch().
+  if ACTIVE.get() {
+    request_shutdown();
+  }
+
+  pool::mark_ready();
+  let Some(job) = next_job(&receiver) else {
+    CLOSED.set(true);
+    // Leave an active request for php_request_shutdown to tear down when the
+    // worker script returns.
+    request_startup();
+    return false;
+  };
+
+  HANDLER.set(handler as *const Zval);
+  let _ = catch_unwind(AssertUnwindSafe(job));
+  HANDLER.set(std::ptr::null());
+  SERVED.set(SERVED.get() + 1);
+
+  if REBOOT.get() {
+    request_startup();
+    return false;
+  }
+
+  true
+}
+
+/// Get the handler of the in-progress `php_node_handle_request()` call, if
+/// the current thread is dispatching into a worker script.
+pub(crate) fn current_handler<'a>() -> Option<&'a Zval> {
+  let ptr = HANDLER.get();
+  if ptr.is_null() {
+    return None;
+  }
+
+  Some(unsafe { &*ptr })
+}
+
+/// Run a request through the worker script's handler.
+///
+/// The RequestContext and SAPI request info must already be set up, exactly
+/// as they would be before `php_request_startup`.
+pub(crate) fn dispatch(
+  handler: &Zval,
+  ini: &[(&str, &str)],
+  timing: &RequestTiming,
+) -> Result<(), EmbedRequestError> {
+  let starting = Instant::now();
+  if !request_startup() {
+    request_shutdown();
+    REBOOT.set(true);
+    return Err(EmbedRequestError::SapiRequestNotStarted);
+  }
+  let executing = timing.record_since(Phase::RequestStartup, starting);
+
+  let result = ini::apply(ini.iter().copied()).and_then(|_| {
+    match try_catch(AssertUnwindSafe(|| handler.try_call(vec![]))) {
+      Ok(Ok(_)) => Ok(()),
+      Ok(Err(Error::Exception(ex))) => exception_result(Error::Exception(ex)),
+      Ok(Err(err)) => Err(EmbedRequestError::Exception(err.to_string())),
+      Err(_) => {
+        REBOOT.set(true);
+        Err(EmbedRequestError::Bailout)
+      }
+    }
+  });
+
+  let result = result.and_then(|_| match ExecutorGlobals::take_exception() {
+    Some(ex) => exception_result(Error::Exception(ex)),
+    None => Ok(()),
+  });
+  let shutting_down = timing.record_since(Phase::Execute, executing);
+
+  request_shutdown();
+  // The worker script's own request carries on, so undo this request's INI
+  // changes rather than leaving them for the next one.
+  ini::restore(ini.iter().copied());
+  timing.record_since(Phase::RequestShutdown, shutting_down);
+  result
+}
+
+// exit() unwinds with a special exception which marks a normal end of the
+// request rather than an error.
+fn exception_result(err: Error) -> Result<(), EmbedRequestError> {
+  if let Error::Exception(ex) = &err {
+    if unsafe { zend_is_unwind_exit(&**ex) } {
+      return Ok(());
+    }
+  }
+
+  Err(EmbedRequestError::Exception(err.to_string()))
+}
+
+// Activate SAPI and output state for a request, and rebuild the superglobals
+// from the current request info.
+fn request_startup() -> bool {
+  ACTIVE.set(true);
+
+  // php_request_startup would reset this, a previous request may have been
+  // aborted by its caller.
+  ProcessGlobals::get_mut().connection_status = 0;
+
+  try_catch(AssertUnwindSafe(|| unsafe {
+    php_output_activate();
+    sapi_activate();
+    reset_superglobals();
+  }))
+  .is_ok()
+}
+
+// Flush output, send headers if nothing was written, and release per-request
+// SAPI state. This calls sapi_module_deactivate to free the request info.
+fn request_shutdown() {
+  ACTIVE.set(false);
+  crate::metrics::sample_memory_peak();
+
+  let _ = try_catch(AssertUnwindSafe(|| unsafe {
+    php_output_end_all();
+    if SapiGlobals::get().headers_sent == 0 {
+      sapi_send_headers();
+    }
+  }));
+  let _ = try_catch(AssertUnwindSafe(|| unsafe { php_output_deactivate() }));
+  let _ = try_catch(AssertUnwindSafe(|| unsafe { sapi_deactivate() }));
+}
+
+unsafe fn reset_superglobals() {
+  {
+    let mut globals = ProcessGlobals::get_mut();
+    for var in globals.http_globals.iter_mut() {
+      zval_ptr_dtor(var);
+    }
+  }
+
+  php_hash_environment();
+
+  // $_SERVER and $_REQUEST are populated just-in-time when a script using
+  // them is compiled. The handler is already compiled, so populate them now.
+  zend_is_auto_global_str(c"_SERVER".as_ptr() as *const c_char, 7);
+  zend_is_auto_global_str(c"_REQUEST".as_ptr() as *const c_char, 8);
+}